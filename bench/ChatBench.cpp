@@ -0,0 +1,601 @@
+// Chat server load generator.
+//
+// Opens N sessions to a running chat-server over loopback, spread over a
+// few worker threads, joins them into rooms of K members, and has some of
+// them send TEXT messages at a fixed rate. Every delivery is timed from
+// the moment its message was written to the socket. After a warmup, it
+// measures for T seconds and reports messages/sec, deliveries/sec, lost
+// deliveries, and p50/p90/p99/p999/max delivery latency. --json writes
+// the configuration, results and latency histogram to a file (or stdout
+// for -), so runs can be compared.
+//
+// Usage: chat-bench [host] [port] [--sessions=N] [--room-size=K]
+//                   [--senders-per-room=S] [--rate=R] [--payload=BYTES]
+//                   [--threads=W] [--warmup=SECONDS] [--seconds=T]
+//                   [--json=PATH]
+//
+// --room-size=0 keeps every session in the lobby. --rate is messages per
+// second per sender.
+
+#include "../shared/Message.h"
+#include "../shared/Serializer.h"
+#include "../shared/FrameDecoder.h"
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+int64_t nowNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now().time_since_epoch()).count();
+}
+
+struct Options {
+    std::string host = "127.0.0.1";
+    uint16_t port = 8080;
+    int sessions = 2000;
+    int roomSize = 50;
+    int sendersPerRoom = 1;
+    double rate = 10;
+    size_t payload = 64;
+    int threads = 4;
+    int warmupSeconds = 2;
+    int seconds = 10;
+    std::string jsonPath;
+};
+
+// Log-linear histogram of nanosecond values: SUB_BUCKETS linear buckets
+// per power of two, so every bucket is within 1/SUB_BUCKETS of its values
+class LatencyHistogram {
+public:
+    LatencyHistogram() : counts_(BUCKETS, 0), total_(0), sum_(0), max_(0) {}
+    
+    void record(int64_t nanos) {
+        uint64_t value = nanos > 0 ? static_cast<uint64_t>(nanos) : 0;
+        counts_[bucketOf(value)]++;
+        total_++;
+        sum_ += value;
+        max_ = std::max(max_, value);
+    }
+    
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            counts_[i] += other.counts_[i];
+        }
+        total_ += other.total_;
+        sum_ += other.sum_;
+        max_ = std::max(max_, other.max_);
+    }
+    
+    uint64_t count() const { return total_; }
+    uint64_t max() const { return max_; }
+    double mean() const { return total_ > 0 ? static_cast<double>(sum_) / total_ : 0.0; }
+    
+    // Midpoint of the bucket holding the value at quantile q
+    double quantile(double q) const {
+        if (total_ == 0) {
+            return 0.0;
+        }
+        uint64_t rank = static_cast<uint64_t>(q * (total_ - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            seen += counts_[i];
+            if (seen >= rank) {
+                return std::min((lowerBound(i) + upperBound(i)) / 2.0, static_cast<double>(max_));
+            }
+        }
+        return static_cast<double>(max_);
+    }
+    
+    // Non-empty buckets as [upper bound us, count] pairs
+    void writeBuckets(std::ostream& out) const {
+        out << "[";
+        bool first = true;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            if (counts_[i] == 0) {
+                continue;
+            }
+            out << (first ? "" : ", ") << "[" << upperBound(i) / 1000.0 << ", " << counts_[i] << "]";
+            first = false;
+        }
+        out << "]";
+    }
+    
+private:
+    static constexpr unsigned SUB_BITS = 5;
+    static constexpr uint64_t SUB_BUCKETS = uint64_t(1) << SUB_BITS;
+    static constexpr size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+    
+    static size_t bucketOf(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return static_cast<size_t>(value);
+        }
+        unsigned exponent = 63 - static_cast<unsigned>(__builtin_clzll(value));
+        unsigned shift = exponent - SUB_BITS;
+        return static_cast<size_t>((shift + 1) * SUB_BUCKETS + ((value >> shift) - SUB_BUCKETS));
+    }
+    
+    static double lowerBound(size_t bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return static_cast<double>(bucket);
+        }
+        unsigned shift = static_cast<unsigned>(bucket / SUB_BUCKETS) - 1;
+        return static_cast<double>((SUB_BUCKETS + bucket % SUB_BUCKETS) << shift);
+    }
+    
+    static double upperBound(size_t bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return static_cast<double>(bucket + 1);
+        }
+        unsigned shift = static_cast<unsigned>(bucket / SUB_BUCKETS) - 1;
+        return lowerBound(bucket) + static_cast<double>(uint64_t(1) << shift);
+    }
+    
+    std::vector<uint64_t> counts_;
+    uint64_t total_;
+    uint64_t sum_;
+    uint64_t max_;
+};
+
+// Phases the main thread moves the workers through
+enum class Phase { JOINING, WARMUP, MEASURE, DRAIN, DONE };
+
+struct Session {
+    int fd;
+    std::string name;
+    std::string room;       // Empty for the lobby
+    uint32_t roomId;
+    bool ready;             // Joined, and in its room if it has one
+    bool sender;
+    int64_t nextSend;
+    FrameDecoder decoder;
+    
+    Session() : fd(-1), roomId(LOBBY_ROOM_ID), ready(false), sender(false), nextSend(0), decoder(16 * 1024) {}
+};
+
+struct WorkerResult {
+    uint64_t sent = 0;           // Messages sent in the measured window
+    uint64_t expected = 0;       // Deliveries those should cause
+    uint64_t delivered = 0;      // Deliveries of measured messages
+    uint64_t disconnected = 0;
+    LatencyHistogram latency;
+};
+
+struct Shared {
+    const Options* options;
+    std::string runTag;          // Marks this run's messages, history from earlier runs is ignored
+    std::atomic<Phase> phase{Phase::JOINING};
+    std::atomic<int> ready{0};
+    std::atomic<int64_t> measureStart{0};
+    std::atomic<int64_t> measureEnd{0};
+};
+
+int connectTo(const std::string& host, uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, host.c_str(), &addr.sin_addr);
+    
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+bool sendAll(int fd, const uint8_t* data, size_t size) {
+    size_t sent = 0;
+    while (sent < size) {
+        ssize_t n = send(fd, data + sent, size - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Parses "tag:nanos:" at the start of content; returns -1 if it is not there
+int64_t parseSendTime(std::string_view content, const std::string& tag) {
+    if (content.size() <= tag.size() + 1 || content.compare(0, tag.size(), tag) != 0 ||
+        content[tag.size()] != ':') {
+        return -1;
+    }
+    int64_t value = 0;
+    for (size_t i = tag.size() + 1; i < content.size() && content[i] != ':'; ++i) {
+        if (content[i] < '0' || content[i] > '9') {
+            return -1;
+        }
+        value = value * 10 + (content[i] - '0');
+    }
+    return value;
+}
+
+class Worker {
+public:
+    Worker(Shared& shared, std::vector<Session*> sessions, const std::vector<int>& roomMembers)
+        : shared_(shared), sessions_(std::move(sessions)), roomMembers_(roomMembers) {}
+    
+    void run() {
+        const Options& options = *shared_.options;
+        int epollFd = epoll_create1(EPOLL_CLOEXEC);
+        for (Session* session : sessions_) {
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.ptr = session;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, session->fd, &ev);
+            
+            // JOIN and ROOM_JOIN back to back; the server handles them in order
+            Message join(MessageType::JOIN, session->name, "");
+            std::vector<uint8_t> frames = Serializer::serialize(join);
+            if (!session->room.empty()) {
+                std::vector<uint8_t> roomJoin =
+                    Serializer::serialize(Message(MessageType::ROOM_JOIN, session->name, session->room));
+                frames.insert(frames.end(), roomJoin.begin(), roomJoin.end());
+            }
+            if (!sendAll(session->fd, frames.data(), frames.size())) {
+                closeSession(epollFd, session);
+            }
+        }
+        
+        const int64_t interval = static_cast<int64_t>(1e9 / options.rate);
+        std::string padding(options.payload, 'x');
+        std::vector<uint8_t> frame;
+        epoll_event events[256];
+        
+        while (true) {
+            Phase phase = shared_.phase.load();
+            if (phase == Phase::DONE) {
+                break;
+            }
+            
+            int64_t now = nowNanos();
+            int64_t nextDue = now + 10000000;
+            if (phase == Phase::WARMUP || phase == Phase::MEASURE) {
+                for (Session* session : sessions_) {
+                    if (!session->sender || session->fd < 0) {
+                        continue;
+                    }
+                    if (session->nextSend == 0) {
+                        // Spread the senders' first messages over one interval
+                        session->nextSend = now + static_cast<int64_t>(
+                            (std::hash<std::string>()(session->name) % 1000) * (interval / 1000));
+                    }
+                    while (session->nextSend <= now) {
+                        send(epollFd, session, padding, frame);
+                        session->nextSend += interval;
+                    }
+                    nextDue = std::min(nextDue, session->nextSend);
+                }
+            }
+            
+            int timeoutMs = static_cast<int>(std::max<int64_t>(0, (nextDue - nowNanos()) / 1000000));
+            int count = epoll_wait(epollFd, events, 256, timeoutMs);
+            for (int i = 0; i < count; ++i) {
+                receive(epollFd, static_cast<Session*>(events[i].data.ptr));
+            }
+        }
+        
+        close(epollFd);
+    }
+    
+    const WorkerResult& result() const { return result_; }
+    
+private:
+    void send(int epollFd, Session* session, const std::string& padding, std::vector<uint8_t>& frame) {
+        // Timed from the write, so a generator that falls behind its rate
+        // does not inflate the latencies
+        int64_t sendTime = nowNanos();
+        Message msg(MessageType::TEXT, session->name,
+                    shared_.runTag + ":" + std::to_string(sendTime) + ":" + padding);
+        msg.roomId = session->roomId;
+        frame.resize(Serializer::serializedSize(msg));
+        size_t size = Serializer::serializeInto(msg, frame.data(), frame.size());
+        if (!sendAll(session->fd, frame.data(), size)) {
+            closeSession(epollFd, session);
+            return;
+        }
+        
+        if (inWindow(sendTime)) {
+            result_.sent++;
+            result_.expected += static_cast<uint64_t>(roomMembers_[roomIndex(*session)] - 1);
+        }
+    }
+    
+    void receive(int epollFd, Session* session) {
+        RingBuffer& ring = session->decoder.buffer();
+        ring.reserve(16 * 1024);
+        uint8_t* first;
+        uint8_t* second;
+        size_t firstLen, secondLen;
+        ring.writableRegions(first, firstLen, second, secondLen);
+        ssize_t n = recv(session->fd, first, firstLen, MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        if (n <= 0) {
+            closeSession(epollFd, session);
+            return;
+        }
+        ring.commitWrite(static_cast<size_t>(n));
+        
+        int64_t arrival = nowNanos();
+        const uint8_t* frame;
+        size_t frameSize;
+        while (session->decoder.nextView(frame, frameSize) == FrameDecoder::Result::FRAME) {
+            MessageView view;
+            if (!Serializer::deserializeView(frame, frameSize, view)) {
+                continue;
+            }
+            
+            if (view.type == MessageType::TEXT) {
+                int64_t sendTime = parseSendTime(view.content, shared_.runTag);
+                if (sendTime >= 0 && inWindow(sendTime)) {
+                    result_.delivered++;
+                    result_.latency.record(arrival - sendTime);
+                }
+            } else if (!session->ready) {
+                // The lobby is joined once the user list arrives, a room
+                // once the session's own ROOM_JOIN confirmation does
+                bool joined = session->room.empty()
+                    ? view.type == MessageType::USER_LIST
+                    : view.type == MessageType::ROOM_JOIN && view.sender == session->name;
+                if (joined) {
+                    session->roomId = view.roomId;
+                    session->ready = true;
+                    shared_.ready++;
+                }
+            }
+        }
+    }
+    
+    bool inWindow(int64_t sendTime) const {
+        int64_t start = shared_.measureStart.load();
+        return start != 0 && sendTime >= start && sendTime < shared_.measureEnd.load();
+    }
+    
+    size_t roomIndex(const Session& session) const {
+        return static_cast<size_t>(std::atoi(session.name.c_str() + session.name.rfind('-') + 1)) /
+               static_cast<size_t>(roomSize());
+    }
+    
+    int roomSize() const {
+        const Options& options = *shared_.options;
+        return options.roomSize > 0 ? options.roomSize : options.sessions;
+    }
+    
+    void closeSession(int epollFd, Session* session) {
+        if (session->fd < 0) {
+            return;
+        }
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, session->fd, nullptr);
+        close(session->fd);
+        session->fd = -1;
+        result_.disconnected++;
+    }
+    
+    Shared& shared_;
+    std::vector<Session*> sessions_;
+    const std::vector<int>& roomMembers_;
+    WorkerResult result_;
+};
+
+void writeJson(std::ostream& out, const Options& options, const WorkerResult& total, double seconds) {
+    out << std::fixed << std::setprecision(1);
+    out << "{\n";
+    out << "  \"config\": {\"host\": \"" << options.host << "\", \"port\": " << options.port
+        << ", \"sessions\": " << options.sessions << ", \"roomSize\": " << options.roomSize
+        << ", \"sendersPerRoom\": " << options.sendersPerRoom << ", \"rate\": " << options.rate
+        << ", \"payload\": " << options.payload << ", \"threads\": " << options.threads
+        << ", \"warmupSeconds\": " << options.warmupSeconds << ", \"seconds\": " << options.seconds << "},\n";
+    out << "  \"results\": {\"sent\": " << total.sent << ", \"delivered\": " << total.delivered
+        << ", \"expected\": " << total.expected << ", \"disconnected\": " << total.disconnected
+        << ", \"messagesPerSec\": " << total.sent / seconds
+        << ", \"deliveriesPerSec\": " << total.delivered / seconds << "},\n";
+    const LatencyHistogram& latency = total.latency;
+    out << "  \"latencyUs\": {\"mean\": " << latency.mean() / 1000.0
+        << ", \"p50\": " << latency.quantile(0.50) / 1000.0
+        << ", \"p90\": " << latency.quantile(0.90) / 1000.0
+        << ", \"p99\": " << latency.quantile(0.99) / 1000.0
+        << ", \"p999\": " << latency.quantile(0.999) / 1000.0
+        << ", \"max\": " << latency.max() / 1000.0 << "},\n";
+    out << "  \"histogramUs\": ";
+    latency.writeBuckets(out);
+    out << "\n}\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    int positional = 0;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--sessions=", 0) == 0) {
+            options.sessions = std::atoi(arg.c_str() + 11);
+        } else if (arg.rfind("--room-size=", 0) == 0) {
+            options.roomSize = std::atoi(arg.c_str() + 12);
+        } else if (arg.rfind("--senders-per-room=", 0) == 0) {
+            options.sendersPerRoom = std::atoi(arg.c_str() + 19);
+        } else if (arg.rfind("--rate=", 0) == 0) {
+            options.rate = std::atof(arg.c_str() + 7);
+        } else if (arg.rfind("--payload=", 0) == 0) {
+            options.payload = static_cast<size_t>(std::atoll(arg.c_str() + 10));
+        } else if (arg.rfind("--threads=", 0) == 0) {
+            options.threads = std::atoi(arg.c_str() + 10);
+        } else if (arg.rfind("--warmup=", 0) == 0) {
+            options.warmupSeconds = std::atoi(arg.c_str() + 9);
+        } else if (arg.rfind("--seconds=", 0) == 0) {
+            options.seconds = std::atoi(arg.c_str() + 10);
+        } else if (arg.rfind("--json=", 0) == 0) {
+            options.jsonPath = arg.substr(7);
+        } else if (arg.rfind("--", 0) == 0) {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return 1;
+        } else if (positional == 0) {
+            options.host = arg;
+            ++positional;
+        } else {
+            options.port = static_cast<uint16_t>(std::atoi(arg.c_str()));
+        }
+    }
+    
+    if (options.sessions < 2 || options.roomSize == 1 || options.rate <= 0 ||
+        options.threads < 1 || options.seconds < 1 || options.sendersPerRoom < 1) {
+        std::cerr << "Need at least 2 sessions, rooms of 2 or more, a positive rate and a worker" << std::endl;
+        return 1;
+    }
+    
+    signal(SIGPIPE, SIG_IGN);
+    
+    // Thousands of sessions need more descriptors than the usual soft limit
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    
+    Shared shared;
+    shared.options = &options;
+    shared.runTag = "bench" + std::to_string(getpid());
+    
+    int roomSize = options.roomSize > 0 ? options.roomSize : options.sessions;
+    int rooms = (options.sessions + roomSize - 1) / roomSize;
+    std::vector<int> roomMembers(static_cast<size_t>(rooms), 0);
+    
+    std::vector<Session> sessions(static_cast<size_t>(options.sessions));
+    for (int i = 0; i < options.sessions; ++i) {
+        Session& session = sessions[static_cast<size_t>(i)];
+        session.fd = connectTo(options.host, options.port);
+        if (session.fd < 0) {
+            std::cerr << "Failed to connect session " << i << ": " << std::strerror(errno) << std::endl;
+            return 1;
+        }
+        int room = i / roomSize;
+        session.name = shared.runTag + "-" + std::to_string(i);
+        if (options.roomSize > 0) {
+            session.room = shared.runTag + "-room" + std::to_string(room);
+        }
+        session.sender = i % roomSize < options.sendersPerRoom;
+        roomMembers[static_cast<size_t>(room)]++;
+    }
+    
+    int senders = 0;
+    for (const Session& session : sessions) {
+        senders += session.sender ? 1 : 0;
+    }
+    std::cout << "sessions=" << options.sessions << " rooms=" << rooms << " senders=" << senders
+              << " rate=" << options.rate << "/s per sender (" << senders * options.rate
+              << " msgs/s) payload=" << options.payload << " threads=" << options.threads << std::endl;
+    
+    // Sessions are dealt out round-robin so every worker gets a share of the senders
+    std::vector<std::vector<Session*>> shares(static_cast<size_t>(options.threads));
+    for (size_t i = 0; i < sessions.size(); ++i) {
+        shares[i % shares.size()].push_back(&sessions[i]);
+    }
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    for (std::vector<Session*>& share : shares) {
+        workers.emplace_back(new Worker(shared, share, roomMembers));
+    }
+    for (std::unique_ptr<Worker>& worker : workers) {
+        threads.emplace_back(&Worker::run, worker.get());
+    }
+    
+    auto joinDeadline = Clock::now() + std::chrono::seconds(30);
+    while (shared.ready < options.sessions && Clock::now() < joinDeadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    if (shared.ready < options.sessions) {
+        std::cerr << "Only " << shared.ready << " of " << options.sessions << " sessions joined" << std::endl;
+    }
+    
+    shared.phase = Phase::WARMUP;
+    std::this_thread::sleep_for(std::chrono::seconds(options.warmupSeconds));
+    
+    int64_t start = nowNanos();
+    shared.measureEnd = start + static_cast<int64_t>(options.seconds) * 1000000000;
+    shared.measureStart = start;
+    shared.phase = Phase::MEASURE;
+    std::this_thread::sleep_for(std::chrono::seconds(options.seconds));
+    
+    // Stop sending and give the last deliveries time to arrive
+    shared.phase = Phase::DRAIN;
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+    shared.phase = Phase::DONE;
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    
+    WorkerResult total;
+    for (const std::unique_ptr<Worker>& worker : workers) {
+        const WorkerResult& result = worker->result();
+        total.sent += result.sent;
+        total.expected += result.expected;
+        total.delivered += result.delivered;
+        total.disconnected += result.disconnected;
+        total.latency.merge(result.latency);
+    }
+    for (const Session& session : sessions) {
+        if (session.fd >= 0) {
+            close(session.fd);
+        }
+    }
+    
+    double seconds = options.seconds;
+    const LatencyHistogram& latency = total.latency;
+    std::cout << std::fixed << std::setprecision(0);
+    std::cout << "messages/sec:    " << total.sent / seconds << std::endl;
+    std::cout << "deliveries/sec:  " << total.delivered / seconds << std::endl;
+    std::cout << "deliveries:      " << total.delivered << " / " << total.expected
+              << " (" << total.disconnected << " sessions lost)" << std::endl;
+    std::cout << std::setprecision(1);
+    std::cout << "p50 (us):        " << latency.quantile(0.50) / 1000.0 << std::endl;
+    std::cout << "p99 (us):        " << latency.quantile(0.99) / 1000.0 << std::endl;
+    std::cout << "p999 (us):       " << latency.quantile(0.999) / 1000.0 << std::endl;
+    std::cout << "max (us):        " << latency.max() / 1000.0 << std::endl;
+    
+    if (!options.jsonPath.empty()) {
+        if (options.jsonPath == "-") {
+            writeJson(std::cout, options, total, seconds);
+        } else {
+            std::ofstream out(options.jsonPath);
+            writeJson(out, options, total, seconds);
+            std::cout << "Wrote " << options.jsonPath << std::endl;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,212 @@
+// Compression cost benchmark.
+//
+// Encodes TEXT messages of several kinds and sizes with and without
+// compressed content, the way the router does for a large broadcast, and
+// decodes them again the way a client does. Prints the compression ratio,
+// encode and decode throughput, CPU time per message, and the bytes a
+// broadcast to R compression-capable recipients saves on the wire.
+//
+// Usage: chat-compression-bench [--sizes=256,1024,4096,16384,65536]
+//                               [--recipients=R] [--millis=T]
+
+#include "../shared/Message.h"
+#include "../shared/Serializer.h"
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <cstdlib>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::vector<size_t> sizes = {256, 1024, 4096, 16384, 65536};
+    size_t recipients = 1000;
+    int millis = 200; // Minimum measuring time per case
+};
+
+struct Result {
+    size_t plainBytes;
+    size_t compressedBytes;  // 0 if compression was skipped
+    double encodeMicros;     // Per message, compressed encoding
+    double plainMicros;      // Per message, plain encoding
+    double decodeMicros;     // Per message, decompressing decode
+};
+
+// Chat-like prose: words drawn from a small vocabulary
+std::string chatText(size_t size, std::mt19937& rng) {
+    static const char* words[] = {
+        "the", "deploy", "is", "done", "can", "you", "check", "staging", "again",
+        "looks", "good", "to", "me", "I", "think", "we", "should", "ship", "it",
+        "after", "lunch", "ok", "thanks", "will", "do", "build", "failed", "on",
+        "main", "retrying", "now"};
+    std::uniform_int_distribution<size_t> pick(0, sizeof(words) / sizeof(words[0]) - 1);
+    std::string text;
+    while (text.size() < size) {
+        text += words[pick(rng)];
+        text += ' ';
+    }
+    text.resize(size);
+    return text;
+}
+
+// Pasted logs and stack traces: repetitive lines with varying numbers
+std::string logText(size_t size, std::mt19937& rng) {
+    std::uniform_int_distribution<int> number(0, 99999);
+    std::string text;
+    int line = 0;
+    while (text.size() < size) {
+        if (line % 4 == 3) {
+            text += "    at com.example.chat.server.MessageRouter.routeFrame(MessageRouter.java:" +
+                    std::to_string(number(rng) % 700) + ")\n";
+        } else {
+            text += "2024-05-14T12:" + std::to_string(10 + line % 50) + ":07.412Z INFO  [worker-" +
+                    std::to_string(line % 8) + "] request id=" + std::to_string(number(rng)) +
+                    " status=200 latency_ms=" + std::to_string(number(rng) % 300) + "\n";
+        }
+        line++;
+    }
+    text.resize(size);
+    return text;
+}
+
+// Incompressible bytes, the worst case the size check has to catch
+std::string randomText(size_t size, std::mt19937& rng) {
+    std::uniform_int_distribution<int> byte(0, 255);
+    std::string text(size, '\0');
+    for (char& c : text) {
+        c = static_cast<char>(byte(rng));
+    }
+    return text;
+}
+
+// Calls fn until at least millis have passed; returns microseconds per call
+template <typename Fn>
+double timePerCall(int millis, Fn fn) {
+    size_t calls = 0;
+    auto start = Clock::now();
+    auto deadline = start + std::chrono::milliseconds(millis);
+    Clock::time_point now;
+    do {
+        for (int i = 0; i < 16; ++i) {
+            fn();
+        }
+        calls += 16;
+        now = Clock::now();
+    } while (now < deadline);
+    return std::chrono::duration<double, std::micro>(now - start).count() / calls;
+}
+
+bool runCase(const Message& msg, const Options& options, Result& result) {
+    std::vector<uint8_t> plain(Serializer::serializedSize(msg));
+    std::vector<uint8_t> compressed(plain.size());
+    result.plainBytes = Serializer::serializeInto(msg, plain.data(), plain.size());
+    result.compressedBytes = Serializer::serializeCompressedInto(msg, compressed.data(), compressed.size());
+    
+    result.plainMicros = timePerCall(options.millis, [&] {
+        Serializer::serializeInto(msg, plain.data(), plain.size());
+    });
+    result.encodeMicros = timePerCall(options.millis, [&] {
+        Serializer::serializeCompressedInto(msg, compressed.data(), compressed.size());
+    });
+    
+    result.decodeMicros = 0;
+    if (result.compressedBytes == 0) {
+        return true;
+    }
+    
+    compressed.resize(result.compressedBytes);
+    Message decoded;
+    if (!Serializer::deserialize(compressed, decoded) || decoded.content != msg.content) {
+        std::cerr << "Round trip failed for " << msg.content.size() << " bytes" << std::endl;
+        return false;
+    }
+    result.decodeMicros = timePerCall(options.millis, [&] {
+        Serializer::deserialize(compressed, decoded);
+    });
+    return true;
+}
+
+std::vector<size_t> parseList(const std::string& text) {
+    std::vector<size_t> values;
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t comma = text.find(',', start);
+        if (comma == std::string::npos) {
+            comma = text.size();
+        }
+        if (comma > start) {
+            values.push_back(static_cast<size_t>(std::atoll(text.c_str() + start)));
+        }
+        start = comma + 1;
+    }
+    return values;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--sizes=", 0) == 0) {
+            options.sizes = parseList(arg.substr(8));
+        } else if (arg.rfind("--recipients=", 0) == 0) {
+            options.recipients = static_cast<size_t>(std::atoll(arg.c_str() + 13));
+        } else if (arg.rfind("--millis=", 0) == 0) {
+            options.millis = std::atoi(arg.c_str() + 9);
+        } else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return 1;
+        }
+    }
+    
+    struct Kind {
+        const char* name;
+        std::string (*generate)(size_t, std::mt19937&);
+    };
+    const Kind kinds[] = {{"chat", chatText}, {"log", logText}, {"random", randomText}};
+    
+    std::cout << "recipients=" << options.recipients << " min-size=" << Compression::MIN_INPUT_SIZE
+              << std::endl;
+    std::cout << std::setw(7) << "kind" << std::setw(8) << "bytes" << std::setw(9) << "ratio"
+              << std::setw(12) << "enc MB/s" << std::setw(12) << "dec MB/s"
+              << std::setw(11) << "+us/msg" << std::setw(16) << "saved/bcast" << std::endl;
+    
+    std::mt19937 rng(42);
+    for (const Kind& kind : kinds) {
+        for (size_t size : options.sizes) {
+            Message msg(MessageType::TEXT, "alice", kind.generate(size, rng));
+            Result result;
+            if (!runCase(msg, options, result)) {
+                return 1;
+            }
+            
+            std::cout << std::setw(7) << kind.name << std::setw(8) << size;
+            if (result.compressedBytes == 0) {
+                std::cout << std::setw(9) << "skipped" << std::fixed << std::setprecision(0)
+                          << std::setw(12) << size / result.encodeMicros
+                          << std::setw(12) << "-" << std::setprecision(2)
+                          << std::setw(11) << result.encodeMicros - result.plainMicros
+                          << std::setw(16) << 0 << std::endl;
+                continue;
+            }
+            
+            // Compression runs once per broadcast; the saving is per recipient
+            size_t saved = (result.plainBytes - result.compressedBytes) * options.recipients;
+            std::cout << std::fixed << std::setprecision(2)
+                      << std::setw(9) << static_cast<double>(result.plainBytes) / result.compressedBytes
+                      << std::setprecision(0)
+                      << std::setw(12) << size / result.encodeMicros
+                      << std::setw(12) << size / result.decodeMicros << std::setprecision(2)
+                      << std::setw(11) << result.encodeMicros - result.plainMicros
+                      << std::setw(16) << saved << std::endl;
+        }
+    }
+    
+    return 0;
+}
@@ -0,0 +1,159 @@
+// Wire encoding benchmark.
+//
+// Encodes TEXT messages of several sizes as v1 frames and as compact (v2)
+// frames, and decodes them again the way a client does. Prints the bytes
+// per message of each, their ratio, encode and decode time per message,
+// and the bytes a broadcast to R compact-capable recipients saves.
+//
+// Usage: chat-encoding-bench [--sizes=8,32,128,512,4096] [--recipients=R]
+//                            [--millis=T]
+
+#include "../shared/Message.h"
+#include "../shared/Serializer.h"
+#include "../shared/CompactSerializer.h"
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::vector<size_t> sizes = {8, 32, 128, 512, 4096};
+    size_t recipients = 1000;
+    int millis = 200; // Minimum measuring time per case
+};
+
+struct Result {
+    size_t plainBytes = 0;
+    size_t compactBytes = 0;
+    double plainEncodeNanos = 0;   // Per message
+    double compactEncodeNanos = 0;
+    double plainDecodeNanos = 0;
+    double compactDecodeNanos = 0;
+};
+
+// Calls fn until at least millis have passed; returns nanoseconds per call
+template <typename Fn>
+double timePerCall(int millis, Fn fn) {
+    size_t calls = 0;
+    auto start = Clock::now();
+    auto deadline = start + std::chrono::milliseconds(millis);
+    Clock::time_point now;
+    do {
+        for (int i = 0; i < 64; ++i) {
+            fn();
+        }
+        calls += 64;
+        now = Clock::now();
+    } while (now < deadline);
+    return std::chrono::duration<double, std::nano>(now - start).count() / calls;
+}
+
+bool runCase(const Message& msg, uint32_t senderId, const Options& options, Result& result) {
+    MessageView view(msg);
+    std::vector<uint8_t> plain(Serializer::serializedSize(view));
+    std::vector<uint8_t> compact(CompactSerializer::maxTextSize(view));
+    result.plainBytes = Serializer::serializeInto(msg, plain.data(), plain.size());
+    result.compactBytes = CompactSerializer::encodeText(view, senderId, compact.data(), compact.size());
+    if (result.compactBytes == 0) {
+        std::cerr << "No compact form for " << msg.content.size() << " bytes" << std::endl;
+        return false;
+    }
+    
+    result.plainEncodeNanos = timePerCall(options.millis, [&] {
+        Serializer::serializeInto(msg, plain.data(), plain.size());
+    });
+    result.compactEncodeNanos = timePerCall(options.millis, [&] {
+        CompactSerializer::encodeText(view, senderId, compact.data(), compact.size());
+    });
+    
+    // The receiver learned the sender's name once, ahead of the first frame
+    SenderTable senders;
+    std::vector<uint8_t> definition = CompactSerializer::encodeSender(senderId, msg.sender);
+    Message decoded;
+    CompactSerializer::decode(definition.data(), definition.size(), senders, decoded);
+    
+    plain.resize(result.plainBytes);
+    compact.resize(result.compactBytes);
+    if (!CompactSerializer::decode(compact.data(), compact.size(), senders, decoded) ||
+        decoded.sender != msg.sender || decoded.content != msg.content ||
+        decoded.timestamp != msg.timestamp || decoded.messageId != msg.messageId) {
+        std::cerr << "Round trip failed for " << msg.content.size() << " bytes" << std::endl;
+        return false;
+    }
+    
+    result.plainDecodeNanos = timePerCall(options.millis, [&] {
+        Serializer::deserialize(plain, decoded);
+    });
+    result.compactDecodeNanos = timePerCall(options.millis, [&] {
+        CompactSerializer::decode(compact.data(), compact.size(), senders, decoded);
+    });
+    return true;
+}
+
+std::vector<size_t> parseList(const std::string& text) {
+    std::vector<size_t> values;
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t comma = text.find(',', start);
+        if (comma == std::string::npos) {
+            comma = text.size();
+        }
+        if (comma > start) {
+            values.push_back(static_cast<size_t>(std::atoll(text.c_str() + start)));
+        }
+        start = comma + 1;
+    }
+    return values;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--sizes=", 0) == 0) {
+            options.sizes = parseList(arg.substr(8));
+        } else if (arg.rfind("--recipients=", 0) == 0) {
+            options.recipients = static_cast<size_t>(std::atoll(arg.c_str() + 13));
+        } else if (arg.rfind("--millis=", 0) == 0) {
+            options.millis = std::atoi(arg.c_str() + 9);
+        } else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return 1;
+        }
+    }
+    
+    std::cout << "recipients=" << options.recipients << std::endl;
+    std::cout << std::setw(8) << "bytes" << std::setw(8) << "v1" << std::setw(8) << "v2"
+              << std::setw(8) << "ratio" << std::setw(11) << "v1 enc ns" << std::setw(11) << "v2 enc ns"
+              << std::setw(11) << "v1 dec ns" << std::setw(11) << "v2 dec ns"
+              << std::setw(14) << "saved/bcast" << std::endl;
+    
+    uint32_t messageId = 1000;
+    for (size_t size : options.sizes) {
+        Message msg(MessageType::TEXT, "alice", std::string(size, 'x'));
+        msg.messageId = messageId++;
+        Result result;
+        if (!runCase(msg, 42, options, result)) {
+            return 1;
+        }
+        
+        size_t saved = (result.plainBytes - result.compactBytes) * options.recipients;
+        std::cout << std::setw(8) << size << std::setw(8) << result.plainBytes
+                  << std::setw(8) << result.compactBytes << std::fixed << std::setprecision(2)
+                  << std::setw(8) << static_cast<double>(result.plainBytes) / result.compactBytes
+                  << std::setprecision(1)
+                  << std::setw(11) << result.plainEncodeNanos << std::setw(11) << result.compactEncodeNanos
+                  << std::setw(11) << result.plainDecodeNanos << std::setw(11) << result.compactDecodeNanos
+                  << std::setw(14) << saved << std::endl;
+    }
+    
+    return 0;
+}
@@ -0,0 +1,223 @@
+// Fan-out delivery latency benchmark.
+//
+// Connects one sender and N receivers to a running chat-server over
+// loopback. The sender broadcasts TEXT messages carrying their send time;
+// every receiver records how long each message took to arrive. Prints
+// p50/p99/p999 of the per-delivery latency.
+//
+// Usage: chat-fanout-bench [host] [port] [--receivers=N] [--messages=M] [--interval-ms=X]
+
+#include "../shared/Message.h"
+#include "../shared/Serializer.h"
+#include "../shared/FrameDecoder.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <poll.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+int64_t nowNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now().time_since_epoch()).count();
+}
+
+int connectTo(const std::string& host, uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, host.c_str(), &addr.sin_addr);
+    
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+bool sendAll(int fd, const std::vector<uint8_t>& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Lobby messages only reach clients that joined the chat
+bool join(int fd, const std::string& name) {
+    return sendAll(fd, Serializer::serialize(Message(MessageType::JOIN, name, "")));
+}
+
+double percentile(const std::vector<int64_t>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    size_t index = static_cast<size_t>(p * (sorted.size() - 1));
+    return sorted[index] / 1000.0;
+}
+
+struct Receiver {
+    int fd;
+    FrameDecoder decoder;
+    
+    explicit Receiver(int socket) : fd(socket), decoder(4096) {}
+};
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::string host = "127.0.0.1";
+    uint16_t port = 8080;
+    int receiverCount = 1000;
+    int messageCount = 200;
+    int intervalMs = 20;
+    
+    int positional = 0;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--receivers=", 0) == 0) {
+            receiverCount = std::atoi(arg.c_str() + 12);
+        } else if (arg.rfind("--messages=", 0) == 0) {
+            messageCount = std::atoi(arg.c_str() + 11);
+        } else if (arg.rfind("--interval-ms=", 0) == 0) {
+            intervalMs = std::atoi(arg.c_str() + 14);
+        } else if (positional == 0) {
+            host = arg;
+            ++positional;
+        } else {
+            port = static_cast<uint16_t>(std::atoi(arg.c_str()));
+        }
+    }
+    
+    signal(SIGPIPE, SIG_IGN);
+    
+    std::vector<Receiver> receivers;
+    receivers.reserve(receiverCount);
+    for (int i = 0; i < receiverCount; ++i) {
+        int fd = connectTo(host, port);
+        if (fd < 0 || !join(fd, "receiver" + std::to_string(i))) {
+            std::cerr << "Failed to connect receiver " << i << ": " << std::strerror(errno) << std::endl;
+            return 1;
+        }
+        receivers.emplace_back(fd);
+    }
+    
+    int senderFd = connectTo(host, port);
+    if (senderFd < 0 || !join(senderFd, "bench")) {
+        std::cerr << "Failed to connect sender" << std::endl;
+        return 1;
+    }
+    
+    // Give the server time to register every session before measuring
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    
+    std::vector<pollfd> pollFds(receivers.size());
+    for (size_t i = 0; i < receivers.size(); ++i) {
+        pollFds[i].fd = receivers[i].fd;
+        pollFds[i].events = POLLIN;
+    }
+    
+    std::vector<int64_t> latencies;
+    latencies.reserve(static_cast<size_t>(receiverCount) * messageCount);
+    const size_t expected = static_cast<size_t>(receiverCount) * messageCount;
+    
+    int sent = 0;
+    int64_t nextSend = nowNanos();
+    int64_t deadline = 0;
+    std::vector<uint8_t> frame;
+    
+    while (latencies.size() < expected) {
+        int64_t now = nowNanos();
+        if (sent < messageCount && now >= nextSend) {
+            Message msg(MessageType::TEXT, "bench", std::to_string(nowNanos()));
+            if (!sendAll(senderFd, Serializer::serialize(msg))) {
+                std::cerr << "Sender disconnected" << std::endl;
+                break;
+            }
+            ++sent;
+            nextSend += static_cast<int64_t>(intervalMs) * 1000000;
+            if (sent == messageCount) {
+                deadline = nowNanos() + 5000000000LL;
+            }
+        }
+        if (deadline != 0 && now > deadline) {
+            break;
+        }
+        
+        int timeoutMs = 1;
+        if (poll(pollFds.data(), pollFds.size(), timeoutMs) <= 0) {
+            continue;
+        }
+        
+        for (size_t i = 0; i < pollFds.size(); ++i) {
+            if (!(pollFds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            
+            Receiver& receiver = receivers[i];
+            uint8_t* first;
+            uint8_t* second;
+            size_t firstLen, secondLen;
+            RingBuffer& ring = receiver.decoder.buffer();
+            ring.reserve(1024);
+            ring.writableRegions(first, firstLen, second, secondLen);
+            ssize_t n = recv(receiver.fd, first, firstLen, 0);
+            if (n <= 0) {
+                pollFds[i].fd = -1;
+                continue;
+            }
+            ring.commitWrite(static_cast<size_t>(n));
+            
+            int64_t arrival = nowNanos();
+            Message msg;
+            while (receiver.decoder.next(frame) == FrameDecoder::Result::FRAME) {
+                if (Serializer::deserialize(frame, msg) && msg.type == MessageType::TEXT
+                    && msg.sender == "bench") {
+                    latencies.push_back(arrival - std::stoll(msg.content));
+                }
+            }
+        }
+    }
+    
+    std::sort(latencies.begin(), latencies.end());
+    
+    std::cout << "receivers:   " << receiverCount << std::endl;
+    std::cout << "messages:    " << sent << std::endl;
+    std::cout << "deliveries:  " << latencies.size() << " / " << expected << std::endl;
+    std::cout << "p50 (us):    " << percentile(latencies, 0.50) << std::endl;
+    std::cout << "p99 (us):    " << percentile(latencies, 0.99) << std::endl;
+    std::cout << "p999 (us):   " << percentile(latencies, 0.999) << std::endl;
+    std::cout << "max (us):    " << (latencies.empty() ? 0.0 : latencies.back() / 1000.0) << std::endl;
+    
+    for (Receiver& receiver : receivers) {
+        close(receiver.fd);
+    }
+    close(senderFd);
+    return 0;
+}
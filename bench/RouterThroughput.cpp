@@ -0,0 +1,318 @@
+// Router throughput benchmark.
+//
+// For each shard count, starts a chat-server with --router-shards=N, then
+// connects S senders and R receivers over loopback. Every sender keeps up
+// to W broadcasts in flight (acknowledged when the last receiver sees
+// them) for a fixed duration. Prints broadcast messages/sec and delivered
+// frames/sec per shard count.
+//
+// Usage: chat-router-bench [--server=PATH] [--port=P] [--shards=0,1,2,4]
+//                          [--senders=S] [--receivers=R] [--window=W]
+//                          [--seconds=T] [--payload=BYTES] [--engine=threaded|epoll]
+
+#include "../shared/Message.h"
+#include "../shared/Serializer.h"
+#include "../shared/FrameDecoder.h"
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string server;
+    std::string engine = "threaded";
+    uint16_t port = 9300;
+    std::vector<unsigned int> shards = {0, 1, 2, 4};
+    int senders = 8;
+    int receivers = 200;
+    int window = 32;
+    int seconds = 3;
+    size_t payload = 64;
+};
+
+struct Result {
+    double messagesPerSec;
+    double deliveriesPerSec;
+};
+
+int connectTo(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+bool sendAll(int fd, const std::vector<uint8_t>& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Lobby messages only reach clients that joined the chat
+bool join(int fd, const std::string& name) {
+    return sendAll(fd, Serializer::serialize(Message(MessageType::JOIN, name, "")));
+}
+
+pid_t startServer(const Options& options, unsigned int shards) {
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+    
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    dup2(devNull, STDERR_FILENO);
+    
+    std::string port = std::to_string(options.port);
+    std::string engine = "--engine=" + options.engine;
+    std::string shardArg = "--router-shards=" + std::to_string(shards);
+    execl(options.server.c_str(), options.server.c_str(), port.c_str(),
+          engine.c_str(), shardArg.c_str(), static_cast<char*>(nullptr));
+    _exit(127);
+}
+
+void stopServer(pid_t pid) {
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+}
+
+bool runOnce(const Options& options, Result& result) {
+    // The server needs a moment to bind
+    std::vector<int> fds;
+    for (int attempt = 0; attempt < 50; ++attempt) {
+        int fd = connectTo(options.port);
+        if (fd >= 0 && join(fd, "bench0")) {
+            fds.push_back(fd);
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    if (fds.empty()) {
+        std::cerr << "Could not connect to " << options.server << std::endl;
+        return false;
+    }
+    
+    // Senders first, then receivers; the last receiver acknowledges
+    int total = options.senders + options.receivers;
+    while (static_cast<int>(fds.size()) < total) {
+        int fd = connectTo(options.port);
+        if (fd < 0 || !join(fd, "bench" + std::to_string(fds.size()))) {
+            std::cerr << "Failed to connect: " << std::strerror(errno) << std::endl;
+            for (int open : fds) {
+                close(open);
+            }
+            return false;
+        }
+        fds.push_back(fd);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    
+    std::vector<FrameDecoder> decoders(fds.size(), FrameDecoder(64 * 1024));
+    std::vector<pollfd> pollFds(fds.size());
+    for (size_t i = 0; i < fds.size(); ++i) {
+        pollFds[i].fd = fds[i];
+        pollFds[i].events = POLLIN;
+    }
+    
+    std::vector<uint64_t> sent(options.senders, 0);
+    std::vector<uint64_t> acked(options.senders, 0);
+    std::string padding(options.payload, 'x');
+    size_t ackIndex = fds.size() - 1;
+    uint64_t deliveries = 0;
+    uint64_t acknowledged = 0;
+    bool failed = false;
+    
+    Clock::time_point start = Clock::now();
+    Clock::time_point end = start + std::chrono::seconds(options.seconds);
+    
+    while (Clock::now() < end && !failed) {
+        for (int s = 0; s < options.senders; ++s) {
+            while (sent[s] - acked[s] < static_cast<uint64_t>(options.window)) {
+                // Content is "sender:seq:" plus padding
+                Message msg(MessageType::TEXT, "bench",
+                            std::to_string(s) + ":" + std::to_string(sent[s]) + ":" + padding);
+                if (!sendAll(fds[s], Serializer::serialize(msg))) {
+                    failed = true;
+                    break;
+                }
+                sent[s]++;
+            }
+        }
+        
+        if (poll(pollFds.data(), pollFds.size(), 10) <= 0) {
+            continue;
+        }
+        
+        for (size_t i = 0; i < pollFds.size(); ++i) {
+            if (!(pollFds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            
+            RingBuffer& ring = decoders[i].buffer();
+            ring.reserve(16 * 1024);
+            uint8_t* first;
+            uint8_t* second;
+            size_t firstLen, secondLen;
+            ring.writableRegions(first, firstLen, second, secondLen);
+            ssize_t n = recv(fds[i], first, firstLen, 0);
+            if (n <= 0) {
+                std::cerr << "Connection " << i << " closed by server" << std::endl;
+                failed = true;
+                break;
+            }
+            ring.commitWrite(static_cast<size_t>(n));
+            
+            const uint8_t* frame;
+            size_t frameSize;
+            while (decoders[i].nextView(frame, frameSize) == FrameDecoder::Result::FRAME) {
+                MessageView view;
+                if (!Serializer::deserializeView(frame, frameSize, view) ||
+                    view.type != MessageType::TEXT) {
+                    continue;
+                }
+                deliveries++;
+                if (i == ackIndex) {
+                    size_t colon = view.content.find(':');
+                    int s = std::atoi(std::string(view.content.substr(0, colon)).c_str());
+                    if (s >= 0 && s < options.senders) {
+                        acked[s]++;
+                        acknowledged++;
+                    }
+                }
+            }
+        }
+    }
+    
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    for (int fd : fds) {
+        close(fd);
+    }
+    if (failed) {
+        return false;
+    }
+    
+    result.messagesPerSec = acknowledged / elapsed;
+    result.deliveriesPerSec = deliveries / elapsed;
+    return true;
+}
+
+std::vector<unsigned int> parseList(const std::string& text) {
+    std::vector<unsigned int> values;
+    std::istringstream iss(text);
+    std::string item;
+    while (std::getline(iss, item, ',')) {
+        values.push_back(static_cast<unsigned int>(std::atoi(item.c_str())));
+    }
+    return values;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    std::string self = argv[0];
+    size_t slash = self.rfind('/');
+    options.server = (slash == std::string::npos ? std::string(".") : self.substr(0, slash)) + "/chat-server";
+    
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--server=", 0) == 0) {
+            options.server = arg.substr(9);
+        } else if (arg.rfind("--engine=", 0) == 0) {
+            options.engine = arg.substr(9);
+        } else if (arg.rfind("--port=", 0) == 0) {
+            options.port = static_cast<uint16_t>(std::atoi(arg.c_str() + 7));
+        } else if (arg.rfind("--shards=", 0) == 0) {
+            options.shards = parseList(arg.substr(9));
+        } else if (arg.rfind("--senders=", 0) == 0) {
+            options.senders = std::atoi(arg.c_str() + 10);
+        } else if (arg.rfind("--receivers=", 0) == 0) {
+            options.receivers = std::atoi(arg.c_str() + 12);
+        } else if (arg.rfind("--window=", 0) == 0) {
+            options.window = std::atoi(arg.c_str() + 9);
+        } else if (arg.rfind("--seconds=", 0) == 0) {
+            options.seconds = std::atoi(arg.c_str() + 10);
+        } else if (arg.rfind("--payload=", 0) == 0) {
+            options.payload = static_cast<size_t>(std::atoll(arg.c_str() + 10));
+        } else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return 1;
+        }
+    }
+    
+    if (options.senders < 1 || options.receivers < 1) {
+        std::cerr << "Need at least one sender and one receiver" << std::endl;
+        return 1;
+    }
+    
+    signal(SIGPIPE, SIG_IGN);
+    
+    std::cout << "senders=" << options.senders << " receivers=" << options.receivers
+              << " window=" << options.window << " payload=" << options.payload
+              << " engine=" << options.engine << std::endl;
+    std::cout << std::setw(8) << "shards" << std::setw(16) << "msgs/sec"
+              << std::setw(18) << "deliveries/sec" << std::endl;
+    
+    for (unsigned int shards : options.shards) {
+        pid_t pid = startServer(options, shards);
+        if (pid < 0) {
+            std::cerr << "fork failed" << std::endl;
+            return 1;
+        }
+        
+        Result result;
+        bool ok = runOnce(options, result);
+        stopServer(pid);
+        if (!ok) {
+            return 1;
+        }
+        
+        std::cout << std::setw(8) << shards << std::fixed << std::setprecision(0)
+                  << std::setw(16) << result.messagesPerSec
+                  << std::setw(18) << result.deliveriesPerSec << std::endl;
+        
+        // Give the previous server a moment to release the port
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+    
+    return 0;
+}
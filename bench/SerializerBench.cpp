@@ -0,0 +1,333 @@
+// Serializer and frame decoder microbenchmark.
+//
+// For each codec and content size, measures encoding a TEXT message,
+// decoding its frame the way a receiver does (bytes written into a
+// FrameDecoder, the frame taken out with nextView() and parsed), and the
+// two back to back. Prints ns per message, content MB/s and heap
+// allocations per message for each, so a change to Serializer.h or
+// CompactSerializer.h can be judged on numbers.
+//
+// Codecs:
+//   v1          serialize() into a new vector, decoded into a Message
+//   v1-into     serializeInto() a reused buffer, decoded as a MessageView
+//   v1-lz       serializeCompressedInto(), decoded and decompressed
+//   compact     CompactSerializer::encodeText(), decoded into a Message
+//
+// A new encoding gets a row by adding an entry to codecs().
+//
+// Usage: chat-serializer-bench [--sizes=16,64,256,1024,4096,16384,65536]
+//                              [--codecs=v1,v1-into,v1-lz,compact] [--millis=T]
+
+#include "../shared/Message.h"
+#include "../shared/Serializer.h"
+#include "../shared/CompactSerializer.h"
+#include "../shared/FrameDecoder.h"
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <new>
+#include <cstdlib>
+
+namespace {
+
+// Heap allocations so far; the replaced operator new below counts them
+size_t allocations = 0;
+
+}
+
+void* operator new(size_t size) {
+    allocations++;
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::vector<size_t> sizes = {16, 64, 256, 1024, 4096, 16384, 65536};
+    std::vector<std::string> codecs;  // Empty for all
+    int millis = 200;                 // Minimum measuring time per case
+};
+
+// State a codec keeps between calls, like a connection would
+struct CodecState {
+    std::vector<uint8_t> frame;  // Last encoded frame
+    Message decoded;
+    MessageView view;
+    SenderTable senders;
+};
+
+struct Codec {
+    const char* name;
+    // Encodes msg into state.frame; returns false if it has no such form
+    bool (*encode)(const Message& msg, CodecState& state);
+    // Parses a frame as taken out of the FrameDecoder
+    bool (*decode)(const uint8_t* data, size_t size, CodecState& state);
+    bool decodesToView;  // decode fills state.view rather than state.decoded
+};
+
+constexpr uint32_t SENDER_ID = 42;
+
+const std::vector<Codec>& codecs() {
+    static const std::vector<Codec> list = {
+        {"v1",
+         [](const Message& msg, CodecState& state) {
+             state.frame = Serializer::serialize(msg);
+             return true;
+         },
+         [](const uint8_t* data, size_t size, CodecState& state) {
+             MessageView view;
+             return Serializer::deserializeView(data, size, view) && Serializer::toMessage(view, state.decoded);
+         },
+         false},
+        {"v1-into",
+         [](const Message& msg, CodecState& state) {
+             state.frame.resize(Serializer::serializedSize(msg));
+             state.frame.resize(Serializer::serializeInto(msg, state.frame.data(), state.frame.size()));
+             return true;
+         },
+         [](const uint8_t* data, size_t size, CodecState& state) {
+             return Serializer::deserializeView(data, size, state.view);
+         },
+         true},
+        {"v1-lz",
+         [](const Message& msg, CodecState& state) {
+             state.frame.resize(Serializer::serializedSize(msg));
+             size_t size = Serializer::serializeCompressedInto(msg, state.frame.data(), state.frame.size());
+             state.frame.resize(size);
+             return size > 0;
+         },
+         [](const uint8_t* data, size_t size, CodecState& state) {
+             MessageView view;
+             return Serializer::deserializeView(data, size, view) && Serializer::toMessage(view, state.decoded);
+         },
+         false},
+        {"compact",
+         [](const Message& msg, CodecState& state) {
+             MessageView view(msg);
+             state.frame.resize(CompactSerializer::maxTextSize(view));
+             size_t size = CompactSerializer::encodeText(view, SENDER_ID, state.frame.data(), state.frame.size());
+             state.frame.resize(size);
+             return size > 0;
+         },
+         [](const uint8_t* data, size_t size, CodecState& state) {
+             return CompactSerializer::decode(data, size, state.senders, state.decoded);
+         },
+         false},
+    };
+    return list;
+}
+
+struct Measurement {
+    double nanos = 0;   // Per message
+    double allocs = 0;  // Per message
+};
+
+struct Result {
+    size_t frameBytes = 0;
+    Measurement encode;
+    Measurement decode;
+    Measurement roundTrip;
+};
+
+// Calls fn until at least millis have passed
+template <typename Fn>
+Measurement measure(int millis, Fn fn) {
+    size_t calls = 0;
+    size_t allocationsBefore = allocations;
+    auto start = Clock::now();
+    auto deadline = start + std::chrono::milliseconds(millis);
+    Clock::time_point now;
+    do {
+        for (int i = 0; i < 16; ++i) {
+            fn();
+        }
+        calls += 16;
+        now = Clock::now();
+    } while (now < deadline);
+    return {std::chrono::duration<double, std::nano>(now - start).count() / calls,
+            static_cast<double>(allocations - allocationsBefore) / calls};
+}
+
+// Feeds the frame through the decoder as if it had just been read from a
+// socket, then parses it
+bool receive(const Codec& codec, FrameDecoder& decoder, CodecState& state) {
+    decoder.buffer().write(state.frame.data(), state.frame.size());
+    const uint8_t* data;
+    size_t size;
+    if (decoder.nextView(data, size) != FrameDecoder::Result::FRAME) {
+        return false;
+    }
+    return codec.decode(data, size, state);
+}
+
+// Chat-like text, so the compressed codec sees realistic input
+std::string makeContent(size_t size) {
+    static const char* words[] = {"the ", "build ", "is ", "green ", "again ", "after ", "the ",
+                                  "fix ", "to ", "room ", "routing, ", "thanks ", "everyone. "};
+    std::string content;
+    for (size_t i = 0; content.size() < size; ++i) {
+        content += words[(i * 7 + i / 13) % (sizeof(words) / sizeof(words[0]))];
+    }
+    content.resize(size);
+    return content;
+}
+
+enum class Outcome { MEASURED, NO_FORM, FAILED };
+
+Outcome runCase(const Codec& codec, const Message& msg, const Options& options, Result& result) {
+    CodecState state;
+    // The receiver learned the sender's name once, ahead of the first frame
+    std::vector<uint8_t> definition = CompactSerializer::encodeSender(SENDER_ID, msg.sender);
+    CompactSerializer::decode(definition.data(), definition.size(), state.senders, state.decoded);
+    // Clients accept compact frames; the server's decoder does the same work for v1
+    FrameDecoder decoder(64 * 1024, true);
+    
+    if (!codec.encode(msg, state)) {
+        return Outcome::NO_FORM;
+    }
+    result.frameBytes = state.frame.size();
+    
+    // Check the round trip once before timing it
+    if (!receive(codec, decoder, state)) {
+        std::cerr << codec.name << ": could not decode " << msg.content.size() << " bytes" << std::endl;
+        return Outcome::FAILED;
+    }
+    if (codec.decodesToView) {
+        state.decoded = state.view.toMessage();
+    }
+    if (state.decoded.sender != msg.sender || state.decoded.content != msg.content ||
+        state.decoded.timestamp != msg.timestamp || state.decoded.messageId != msg.messageId) {
+        std::cerr << codec.name << ": round trip failed for " << msg.content.size() << " bytes" << std::endl;
+        return Outcome::FAILED;
+    }
+    
+    result.encode = measure(options.millis, [&] {
+        codec.encode(msg, state);
+    });
+    result.decode = measure(options.millis, [&] {
+        receive(codec, decoder, state);
+    });
+    result.roundTrip = measure(options.millis, [&] {
+        codec.encode(msg, state);
+        receive(codec, decoder, state);
+    });
+    return Outcome::MEASURED;
+}
+
+std::vector<std::string> split(const std::string& text) {
+    std::vector<std::string> values;
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t comma = text.find(',', start);
+        if (comma == std::string::npos) {
+            comma = text.size();
+        }
+        if (comma > start) {
+            values.push_back(text.substr(start, comma - start));
+        }
+        start = comma + 1;
+    }
+    return values;
+}
+
+bool selected(const Options& options, const Codec& codec) {
+    if (options.codecs.empty()) {
+        return true;
+    }
+    for (const std::string& name : options.codecs) {
+        if (name == codec.name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void printMeasurement(const Measurement& m, size_t contentBytes) {
+    std::cout << std::setw(10) << m.nanos << std::setw(9) << contentBytes * 1000.0 / m.nanos
+              << std::setw(7) << m.allocs;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--sizes=", 0) == 0) {
+            options.sizes.clear();
+            for (const std::string& size : split(arg.substr(8))) {
+                options.sizes.push_back(static_cast<size_t>(std::atoll(size.c_str())));
+            }
+        } else if (arg.rfind("--codecs=", 0) == 0) {
+            options.codecs = split(arg.substr(9));
+        } else if (arg.rfind("--millis=", 0) == 0) {
+            options.millis = std::atoi(arg.c_str() + 9);
+        } else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return 1;
+        }
+    }
+    
+    for (const std::string& name : options.codecs) {
+        bool known = false;
+        for (const Codec& codec : codecs()) {
+            known = known || name == codec.name;
+        }
+        if (!known) {
+            std::cerr << "Unknown codec: " << name << std::endl;
+            return 1;
+        }
+    }
+    
+    // MB/s counts message content, so codecs compare on the same work
+    std::cout << std::setw(9) << "codec" << std::setw(8) << "bytes" << std::setw(8) << "frame"
+              << std::setw(10) << "enc ns" << std::setw(9) << "enc MB/s" << std::setw(7) << "allocs"
+              << std::setw(10) << "dec ns" << std::setw(9) << "dec MB/s" << std::setw(7) << "allocs"
+              << std::setw(10) << "rt ns" << std::setw(9) << "rt MB/s" << std::setw(7) << "allocs"
+              << std::endl;
+    
+    uint32_t messageId = 1000;
+    for (size_t size : options.sizes) {
+        Message msg(MessageType::TEXT, "alice", makeContent(size));
+        msg.messageId = messageId++;
+        
+        for (const Codec& codec : codecs()) {
+            if (!selected(options, codec)) {
+                continue;
+            }
+            
+            Result result;
+            std::cout << std::setw(9) << codec.name << std::setw(8) << size;
+            Outcome outcome = runCase(codec, msg, options, result);
+            if (outcome == Outcome::FAILED) {
+                return 1;
+            }
+            if (outcome == Outcome::NO_FORM) {
+                std::cout << std::setw(8) << "-" << std::endl;
+                continue;
+            }
+            std::cout << std::setw(8) << result.frameBytes << std::fixed << std::setprecision(1);
+            printMeasurement(result.encode, size);
+            printMeasurement(result.decode, size);
+            printMeasurement(result.roundTrip, size);
+            std::cout << std::endl;
+        }
+    }
+    
+    return 0;
+}
@@ -0,0 +1,294 @@
+// Slow-consumer policy check.
+//
+// Starts a chat-server with --slow-consumer=drop-oldest and a small send
+// queue, joins a receiver that reads far slower than a sender broadcasts
+// M numbered TEXT messages, then lets the receiver drain its socket. Under
+// drop-oldest the newest messages must arrive, in order, with the dropped
+// ones older than every message after the last gap. Exits non-zero if
+// they do not.
+//
+// Usage: chat-slow-consumer-check [--server=PATH] [--port=P] [--engine=threaded|epoll]
+//                                 [--messages=M] [--queue-frames=Q] [--trickle=K]
+//                                 [--payload=BYTES]
+
+#include "../shared/Message.h"
+#include "../shared/Serializer.h"
+#include "../shared/FrameDecoder.h"
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+namespace {
+
+struct Options {
+    std::string server;
+    std::string engine = "threaded";
+    uint16_t port = 9310;
+    int messages = 2000;
+    int queueFrames = 200;
+    int trickle = 8;
+    size_t payload = 32 * 1024;
+};
+
+int connectTo(uint16_t port, int receiveBuffer) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // Set before connecting, so the window the server sees stays small
+    if (receiveBuffer > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer));
+    }
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+bool sendAll(int fd, const std::vector<uint8_t>& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Reads up to maxBytes once data arrives within timeoutMs, appending the
+// sequence numbers of TEXT frames to seqs. Returns 1 once a frame of type
+// stop was decoded, 0 if not, and -1 on timeout or a closed connection.
+int receiveFrames(int fd, FrameDecoder& decoder, size_t maxBytes, int timeoutMs,
+                  MessageType stop, std::vector<int>* seqs) {
+    pollfd pfd{fd, POLLIN, 0};
+    if (poll(&pfd, 1, timeoutMs) <= 0) {
+        return -1;
+    }
+    
+    RingBuffer& ring = decoder.buffer();
+    ring.reserve(maxBytes);
+    uint8_t* first;
+    uint8_t* second;
+    size_t firstLen, secondLen;
+    ring.writableRegions(first, firstLen, second, secondLen);
+    ssize_t n = recv(fd, first, std::min(firstLen, maxBytes), 0);
+    if (n <= 0) {
+        return -1;
+    }
+    ring.commitWrite(static_cast<size_t>(n));
+    
+    int result = 0;
+    const uint8_t* frame;
+    size_t frameSize;
+    while (decoder.nextView(frame, frameSize) == FrameDecoder::Result::FRAME) {
+        MessageView view;
+        if (!Serializer::deserializeView(frame, frameSize, view)) {
+            continue;
+        }
+        // Content is "seq:" plus padding
+        if (view.type == MessageType::TEXT && seqs) {
+            size_t colon = view.content.find(':');
+            seqs->push_back(std::atoi(std::string(view.content.substr(0, colon)).c_str()));
+        }
+        if (view.type == stop) {
+            result = 1;
+        }
+    }
+    return result;
+}
+
+bool readUntil(int fd, FrameDecoder& decoder, MessageType stop, int timeoutMs,
+               std::vector<int>* seqs) {
+    int result;
+    while ((result = receiveFrames(fd, decoder, 64 * 1024, timeoutMs, stop, seqs)) == 0) {
+    }
+    return result == 1;
+}
+
+pid_t startServer(const Options& options) {
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    dup2(devNull, STDERR_FILENO);
+
+    std::string port = std::to_string(options.port);
+    std::string engine = "--engine=" + options.engine;
+    std::string queueFrames = "--queue-frames=" + std::to_string(options.queueFrames);
+    // Room for twice the frames in bytes, so the frame limit is the one hit
+    std::string queueBytes = "--queue-bytes=" +
+        std::to_string(2 * options.queueFrames * (options.payload + 64));
+    execl(options.server.c_str(), options.server.c_str(), port.c_str(), engine.c_str(),
+          "--slow-consumer=drop-oldest", queueFrames.c_str(), queueBytes.c_str(),
+          "--history=0", static_cast<char*>(nullptr));
+    _exit(127);
+}
+
+void stopServer(pid_t pid) {
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+}
+
+bool run(const Options& options) {
+    // The server needs a moment to bind
+    int receiver = -1;
+    for (int attempt = 0; attempt < 50 && receiver < 0; ++attempt) {
+        receiver = connectTo(options.port, 4096);
+        if (receiver < 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+    }
+    int sender = connectTo(options.port, 0);
+    if (receiver < 0 || sender < 0) {
+        std::cerr << "Could not connect to " << options.server << std::endl;
+        return false;
+    }
+
+    // Both join; the user list answering each JOIN means it was handled
+    FrameDecoder receiverDecoder(64 * 1024);
+    FrameDecoder senderDecoder(64 * 1024);
+    if (!sendAll(receiver, Serializer::serialize(Message(MessageType::JOIN, "receiver", ""))) ||
+        !readUntil(receiver, receiverDecoder, MessageType::USER_LIST, 2000, nullptr) ||
+        !sendAll(sender, Serializer::serialize(Message(MessageType::JOIN, "sender", ""))) ||
+        !readUntil(sender, senderDecoder, MessageType::USER_LIST, 2000, nullptr)) {
+        std::cerr << "Join failed" << std::endl;
+        return false;
+    }
+
+    // The receiver reads 4 KB per --trickle messages, slower than they
+    // arrive, so the server's socket buffer stays full and its queue
+    // overflows. Each read lets the sender take more off the queue.
+    std::vector<int> seqs;
+    std::string padding(options.payload, 'x');
+    for (int seq = 0; seq < options.messages; ++seq) {
+        if (options.trickle > 0 && seq % options.trickle == 0) {
+            receiveFrames(receiver, receiverDecoder, 4096, 0, MessageType::ERROR_MSG, &seqs);
+        }
+        Message msg(MessageType::TEXT, "sender", std::to_string(seq) + ":" + padding);
+        if (!sendAll(sender, Serializer::serialize(msg))) {
+            std::cerr << "Sender disconnected" << std::endl;
+            return false;
+        }
+    }
+    // Handled after every message before it, so all of them are queued
+    if (!sendAll(sender, Serializer::serialize(Message(MessageType::USER_LIST, "sender", ""))) ||
+        !readUntil(sender, senderDecoder, MessageType::USER_LIST, 10000, nullptr)) {
+        std::cerr << "Sender got no user list" << std::endl;
+        return false;
+    }
+
+    readUntil(receiver, receiverDecoder, MessageType::ERROR_MSG, 1000, &seqs);
+    close(sender);
+    close(receiver);
+
+    // In order, newest present, and everything after the last gap intact
+    int gaps = 0;
+    size_t tailStart = 0;
+    for (size_t i = 1; i < seqs.size(); ++i) {
+        if (seqs[i] <= seqs[i - 1]) {
+            std::cerr << "FAIL: message " << seqs[i] << " arrived after " << seqs[i - 1] << std::endl;
+            return false;
+        }
+        if (seqs[i] != seqs[i - 1] + 1) {
+            gaps++;
+            tailStart = i;
+        }
+    }
+    size_t tail = seqs.size() - tailStart;
+    int newest = seqs.empty() ? -1 : seqs.back();
+
+    std::cout << "engine=" << options.engine << " sent=" << options.messages
+              << " received=" << seqs.size() << " gaps=" << gaps << " newest=" << newest
+              << " intact tail=" << tail << std::endl;
+
+    if (newest != options.messages - 1) {
+        std::cerr << "FAIL: newest messages were dropped" << std::endl;
+        return false;
+    }
+    if (seqs.size() == static_cast<size_t>(options.messages)) {
+        std::cerr << "FAIL: nothing was dropped; raise --messages" << std::endl;
+        return false;
+    }
+    if (tail < static_cast<size_t>(options.queueFrames / 2)) {
+        std::cerr << "FAIL: only " << tail << " of the newest messages survived" << std::endl;
+        return false;
+    }
+    std::cout << "PASS" << std::endl;
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    std::string self = argv[0];
+    size_t slash = self.rfind('/');
+    options.server = (slash == std::string::npos ? std::string(".") : self.substr(0, slash)) + "/chat-server";
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--server=", 0) == 0) {
+            options.server = arg.substr(9);
+        } else if (arg.rfind("--engine=", 0) == 0) {
+            options.engine = arg.substr(9);
+        } else if (arg.rfind("--port=", 0) == 0) {
+            options.port = static_cast<uint16_t>(std::atoi(arg.c_str() + 7));
+        } else if (arg.rfind("--messages=", 0) == 0) {
+            options.messages = std::atoi(arg.c_str() + 11);
+        } else if (arg.rfind("--queue-frames=", 0) == 0) {
+            options.queueFrames = std::atoi(arg.c_str() + 15);
+        } else if (arg.rfind("--trickle=", 0) == 0) {
+            options.trickle = std::atoi(arg.c_str() + 10);
+        } else if (arg.rfind("--payload=", 0) == 0) {
+            options.payload = static_cast<size_t>(std::atoll(arg.c_str() + 10));
+        } else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    if (options.messages < 1 || options.queueFrames < 1) {
+        std::cerr << "Need at least one message and one queued frame" << std::endl;
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t pid = startServer(options);
+    if (pid < 0) {
+        std::cerr << "fork failed" << std::endl;
+        return 1;
+    }
+    bool ok = run(options);
+    stopServer(pid);
+    return ok ? 0 : 1;
+}
@@ -1,8 +1,10 @@
 #include "Client.h"
+#include "../shared/Protocol.h"
 #include <iostream>
 #include <sstream>
 
-Client::Client() : connected_(false) {
+Client::Client()
+    : connected_(false), currentRoom_(LOBBY_ROOM_ID), presenceResyncPending_(false) {
     network_.setMessageCallback([this](const Message& msg) {
         onMessageReceived(msg);
     });
@@ -27,7 +29,10 @@ bool Client::connect(const std::string& host, uint16_t port, const std::string&
         return false;
     }
     
-    // Send join message
+    // Negotiate features, then join. The join need not wait for the
+    // server's answer; an older server ignores the hello.
+    network_.sendHello(FEATURE_COMPRESSION | FEATURE_COMPACT_ENCODING | FEATURE_HEARTBEAT |
+                       FEATURE_PRESENCE);
     Message joinMsg(MessageType::JOIN, username, "");
     network_.sendMessage(joinMsg);
     
@@ -62,6 +67,10 @@ void Client::sendTextMessage(const std::string& text) {
     }
     
     Message msg(MessageType::TEXT, username_, text);
+    {
+        std::lock_guard<std::mutex> lock(roomsMutex_);
+        msg.roomId = currentRoom_;
+    }
     network_.sendMessage(msg);
 }
 
@@ -74,12 +83,89 @@ void Client::requestUserList() {
     network_.sendMessage(msg);
 }
 
+void Client::joinRoom(const std::string& name) {
+    if (!connected_ || !network_.isConnected()) {
+        return;
+    }
+    
+    {
+        // Already a member: just make it the current room
+        std::lock_guard<std::mutex> lock(roomsMutex_);
+        auto it = rooms_.find(name);
+        if (it != rooms_.end()) {
+            currentRoom_ = it->second;
+            ui_.displaySystemMessage("Now talking in #" + name);
+            return;
+        }
+    }
+    
+    // The server answers with ROOM_JOIN carrying the room id
+    Message msg(MessageType::ROOM_JOIN, username_, name);
+    network_.sendMessage(msg);
+}
+
+void Client::partRoom(const std::string& name) {
+    if (!connected_ || !network_.isConnected()) {
+        return;
+    }
+    
+    uint32_t roomId = LOBBY_ROOM_ID;
+    {
+        std::lock_guard<std::mutex> lock(roomsMutex_);
+        if (name.empty()) {
+            roomId = currentRoom_;
+        } else {
+            auto it = rooms_.find(name);
+            if (it != rooms_.end()) {
+                roomId = it->second;
+            }
+        }
+    }
+    
+    if (roomId == LOBBY_ROOM_ID) {
+        ui_.displaySystemMessage(name.empty() ? "You are in the lobby" : "Not in room #" + name);
+        return;
+    }
+    
+    Message msg(MessageType::ROOM_PART, username_, "");
+    msg.roomId = roomId;
+    network_.sendMessage(msg);
+}
+
 bool Client::isConnected() const {
     return connected_ && network_.isConnected();
 }
 
 void Client::onMessageReceived(const Message& msg) {
+    if (msg.type == MessageType::PRESENCE) {
+        // A missed delta: ask for a fresh snapshot, once
+        if (!ui_.applyPresenceDelta(msg.content, msg.messageId) &&
+            !presenceResyncPending_.exchange(true)) {
+            requestUserList();
+        }
+        return;
+    }
+    if (msg.type == MessageType::USER_LIST) {
+        presenceResyncPending_ = false;
+    }
+    
+    if (msg.type == MessageType::ROOM_JOIN && msg.sender == username_) {
+        std::lock_guard<std::mutex> lock(roomsMutex_);
+        rooms_[msg.content] = msg.roomId;
+        currentRoom_ = msg.roomId;
+        ui_.setRoomName(msg.roomId, msg.content);
+    }
+    
     ui_.displayMessage(msg);
+    
+    if (msg.type == MessageType::ROOM_PART && msg.sender == username_) {
+        std::lock_guard<std::mutex> lock(roomsMutex_);
+        rooms_.erase(msg.content);
+        if (currentRoom_ == msg.roomId) {
+            currentRoom_ = LOBBY_ROOM_ID;
+        }
+        ui_.removeRoom(msg.roomId);
+    }
 }
 
 void Client::onInputReceived(const std::string& input) {
@@ -106,11 +192,33 @@ void Client::handleCommand(const std::string& command) {
         disconnect();
         ui_.displaySystemMessage("Disconnected from server");
     } else if (cmd == "/users" || cmd == "/list") {
-        requestUserList();
+        ui_.displayUserList();
+    } else if (cmd == "/join") {
+        std::string room;
+        iss >> room;
+        if (room.empty()) {
+            ui_.displaySystemMessage("Usage: /join <room>");
+        } else {
+            joinRoom(room);
+        }
+    } else if (cmd == "/part") {
+        std::string room;
+        iss >> room;
+        partRoom(room);
+    } else if (cmd == "/lobby") {
+        std::lock_guard<std::mutex> lock(roomsMutex_);
+        currentRoom_ = LOBBY_ROOM_ID;
+        ui_.displaySystemMessage("Now talking in the lobby");
+    } else if (cmd == "/stats") {
+        network_.requestStats();
     } else if (cmd == "/help") {
         ui_.displaySystemMessage("Available commands:");
         ui_.displaySystemMessage("  /quit, /exit - Disconnect from server");
         ui_.displaySystemMessage("  /users, /list - List connected users");
+        ui_.displaySystemMessage("  /join <room> - Join a room, or switch to one already joined");
+        ui_.displaySystemMessage("  /part [room] - Leave a room (default: the current one)");
+        ui_.displaySystemMessage("  /lobby - Send messages to the lobby again");
+        ui_.displaySystemMessage("  /stats - Show the server's metrics (local servers only)");
         ui_.displaySystemMessage("  /help - Show this help message");
     } else {
         ui_.displaySystemMessage("Unknown command: " + cmd + ". Type /help for available commands.");
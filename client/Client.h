@@ -5,6 +5,9 @@
 #include "UI.h"
 #include "../shared/Message.h"
 #include <string>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
 
 class Client {
 public:
@@ -15,6 +18,8 @@ public:
     void disconnect();
     void sendTextMessage(const std::string& text);
     void requestUserList();
+    void joinRoom(const std::string& name);
+    void partRoom(const std::string& name);
     bool isConnected() const;
     
 private:
@@ -26,6 +31,14 @@ private:
     UI ui_;
     std::string username_;
     bool connected_;
+    
+    // Joined rooms by name, and where plain text input goes
+    std::unordered_map<std::string, uint32_t> rooms_;
+    uint32_t currentRoom_;
+    std::mutex roomsMutex_;
+    
+    // Set while a presence snapshot requested after a gap is outstanding
+    std::atomic<bool> presenceResyncPending_;
 };
 
 #endif // CLIENT_H
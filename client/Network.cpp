@@ -3,12 +3,16 @@
 #include "../shared/Protocol.h"
 #include <iostream>
 #include <cstring>
+#include <cerrno>
 
 #ifdef _WIN32
     #pragma comment(lib, "ws2_32.lib")
+#else
+    #include <sys/uio.h>
 #endif
 
-Network::Network() : socket_(INVALID_SOCKET_VALUE), connected_(false), running_(false) {
+Network::Network() : socket_(INVALID_SOCKET_VALUE), connected_(false), running_(false),
+                     protocolVersion_(MIN_PROTOCOL_VERSION), features_(0) {
     #ifdef _WIN32
         WSADATA wsaData;
         WSAStartup(MAKEWORD(2, 2), &wsaData);
@@ -59,6 +63,12 @@ bool Network::connect(const std::string& host, uint16_t port) {
         return false;
     }
     
+    // Drop anything buffered from a previous connection
+    decoder_ = FrameDecoder(64 * 1024, true);
+    protocolVersion_ = MIN_PROTOCOL_VERSION;
+    features_ = 0;
+    senders_.clear();
+    
     connected_ = true;
     running_ = true;
     receiveThread_ = std::thread(&Network::receiveThread, this);
@@ -88,39 +98,51 @@ void Network::disconnect() {
     }
 }
 
-bool Network::receiveData(std::vector<uint8_t>& buffer) {
-    MessageHeader header;
-    int bytesReceived = 0;
-    
-    // Receive header
-    bytesReceived = recv(socket_, reinterpret_cast<char*>(&header), sizeof(MessageHeader), 0);
-    
-    if (bytesReceived <= 0) {
-        return false;
+int Network::readIntoDecoder() {
+    RingBuffer& ring = decoder_.buffer();
+    if (ring.freeSpace() == 0) {
+        ring.reserve(ring.capacity());
     }
     
-    if (bytesReceived != static_cast<int>(sizeof(MessageHeader))) {
-        return false;
-    }
+    uint8_t* first;
+    uint8_t* second;
+    size_t firstLen, secondLen;
+    ring.writableRegions(first, firstLen, second, secondLen);
     
-    // Validate magic
-    if (header.magic != PROTOCOL_MAGIC) {
-        return false;
-    }
-    
-    // Receive payload
-    buffer.resize(sizeof(MessageHeader) + header.payloadSize);
-    std::memcpy(buffer.data(), &header, sizeof(MessageHeader));
+    #ifdef _WIN32
+        int bytesReceived = recv(socket_, reinterpret_cast<char*>(first), static_cast<int>(firstLen), 0);
+    #else
+        iovec iov[2] = {{first, firstLen}, {second, secondLen}};
+        int bytesReceived = static_cast<int>(readv(socket_, iov, secondLen > 0 ? 2 : 1));
+    #endif
     
-    if (header.payloadSize > 0) {
-        bytesReceived = recv(socket_, reinterpret_cast<char*>(buffer.data() + sizeof(MessageHeader)), 
-                           header.payloadSize, 0);
-        if (bytesReceived != static_cast<int>(header.payloadSize)) {
+    if (bytesReceived > 0) {
+        ring.commitWrite(static_cast<size_t>(bytesReceived));
+    }
+    return bytesReceived;
+}
+
+bool Network::receiveData(std::vector<uint8_t>& buffer) {
+    // Hand out buffered frames first, read only when none is complete
+    while (true) {
+        FrameDecoder::Result result = decoder_.next(buffer);
+        if (result == FrameDecoder::Result::FRAME) {
+            return true;
+        }
+        if (result == FrameDecoder::Result::INVALID) {
+            return false;
+        }
+        
+        int bytesReceived = readIntoDecoder();
+        if (bytesReceived <= 0) {
+            #ifndef _WIN32
+                if (bytesReceived < 0 && errno == EINTR) {
+                    continue;
+                }
+            #endif
             return false;
         }
     }
-    
-    return true;
 }
 
 bool Network::sendData(const std::vector<uint8_t>& data) {
@@ -137,13 +159,48 @@ bool Network::sendData(const std::vector<uint8_t>& data) {
     return true;
 }
 
+void Network::sendHello(uint32_t features) {
+    if (!connected_) {
+        return;
+    }
+    
+    HelloMessage hello;
+    hello.features = features;
+    hello.agent = "chat-client";
+    std::lock_guard<std::mutex> lock(sendMutex_);
+    if (!sendData(Serializer::serializeHello(ProtocolMessageType::CLIENT_HELLO, hello))) {
+        connected_ = false;
+    }
+}
+
 void Network::sendMessage(const Message& msg) {
     if (!connected_) {
         return;
     }
     
-    std::vector<uint8_t> data = Serializer::serialize(msg);
-    if (!sendData(data)) {
+    // Encode into the reused buffer; it only grows for a larger message
+    std::lock_guard<std::mutex> lock(sendMutex_);
+    sendBuffer_.resize(Serializer::serializedSize(msg));
+    size_t size = 0;
+    if (msg.type == MessageType::TEXT && (features_ & FEATURE_COMPRESSION)) {
+        size = Serializer::serializeCompressedInto(msg, sendBuffer_.data(), sendBuffer_.size());
+    }
+    if (size == 0) {
+        size = Serializer::serializeInto(msg, sendBuffer_.data(), sendBuffer_.size());
+    }
+    sendBuffer_.resize(size);
+    if (!sendData(sendBuffer_)) {
+        connected_ = false;
+    }
+}
+
+void Network::requestStats() {
+    if (!connected_) {
+        return;
+    }
+    
+    std::lock_guard<std::mutex> lock(sendMutex_);
+    if (!sendData(Serializer::serializeStatsRequest())) {
         connected_ = false;
     }
 }
@@ -163,12 +220,58 @@ void Network::receiveThread() {
         }
         
         Message msg;
-        if (Serializer::deserialize(buffer, msg)) {
-            std::lock_guard<std::mutex> lock(callbackMutex_);
-            if (messageCallback_) {
-                messageCallback_(msg);
+        if (CompactSerializer::isCompact(buffer.data(), buffer.size())) {
+            if (CompactSerializer::decode(buffer.data(), buffer.size(), senders_, msg)) {
+                deliver(msg);
+            }
+            continue;
+        }
+        
+        if (Serializer::frameType(buffer.data()) ==
+            static_cast<uint16_t>(ProtocolMessageType::SERVER_HELLO)) {
+            handleServerHello(buffer);
+            continue;
+        }
+        if (Serializer::frameType(buffer.data()) ==
+            static_cast<uint16_t>(ProtocolMessageType::HEARTBEAT)) {
+            answerHeartbeat(buffer);
+            continue;
+        }
+        if (Serializer::frameType(buffer.data()) ==
+            static_cast<uint16_t>(ProtocolMessageType::STATS_RESPONSE)) {
+            std::string text;
+            if (Serializer::deserializeStats(buffer.data(), buffer.size(), text)) {
+                deliver(Message(MessageType::SYSTEM, "SERVER", text));
             }
+            continue;
+        }
+        
+        if (Serializer::deserialize(buffer, msg)) {
+            deliver(msg);
         }
     }
 }
 
+void Network::deliver(const Message& msg) {
+    std::lock_guard<std::mutex> lock(callbackMutex_);
+    if (messageCallback_) {
+        messageCallback_(msg);
+    }
+}
+
+void Network::handleServerHello(const std::vector<uint8_t>& frame) {
+    HelloMessage hello;
+    if (!Serializer::deserializeHello(frame.data(), frame.size(), hello)) {
+        return;
+    }
+    protocolVersion_ = hello.maxVersion;
+    features_ = hello.features;
+}
+
+void Network::answerHeartbeat(const std::vector<uint8_t>& frame) {
+    // Echoed as is; any frame from us shows the server we are alive
+    std::lock_guard<std::mutex> lock(sendMutex_);
+    if (!sendData(frame)) {
+        connected_ = false;
+    }
+}
@@ -2,6 +2,8 @@
 #define NETWORK_H
 
 #include "../shared/Message.h"
+#include "../shared/FrameDecoder.h"
+#include "../shared/CompactSerializer.h"
 #include <string>
 #include <thread>
 #include <atomic>
@@ -38,18 +40,39 @@ public:
     void disconnect();
     bool isConnected() const { return connected_; }
     
+    // Opens the handshake, asking for the given FEATURE_* bits; send it
+    // first. The server's SERVER_HELLO is consumed here, not passed on, and
+    // so are its HEARTBEAT frames, which are answered automatically.
+    void sendHello(uint32_t features);
+    // Large TEXT messages are compressed once the server accepted it
     void sendMessage(const Message& msg);
+    // Asks for the server's metrics; the answer reaches the message
+    // callback as a SYSTEM message
+    void requestStats();
+    // What the server accepted; version 1 and no features until then
+    uint16_t getProtocolVersion() const { return protocolVersion_; }
+    uint32_t getFeatures() const { return features_; }
     void setMessageCallback(MessageCallback callback);
     
 private:
     void receiveThread();
     bool receiveData(std::vector<uint8_t>& buffer);
+    int readIntoDecoder();
     bool sendData(const std::vector<uint8_t>& data);
+    void handleServerHello(const std::vector<uint8_t>& frame);
+    void answerHeartbeat(const std::vector<uint8_t>& frame);
+    void deliver(const Message& msg);
     
     SocketHandle socket_;
     std::atomic<bool> connected_;
     std::atomic<bool> running_;
+    std::atomic<uint16_t> protocolVersion_;
+    std::atomic<uint32_t> features_;
     std::thread receiveThread_;
+    FrameDecoder decoder_;
+    SenderTable senders_; // Names for compact frames; receive thread only
+    std::vector<uint8_t> sendBuffer_;
+    std::mutex sendMutex_;
     
     MessageCallback messageCallback_;
     std::mutex callbackMutex_;
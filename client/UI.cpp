@@ -13,7 +13,7 @@
     #include <fcntl.h>
 #endif
 
-UI::UI() : running_(false) {
+UI::UI() : presenceVersion_(0), hasPresence_(false), running_(false) {
 }
 
 UI::~UI() {
@@ -75,7 +75,7 @@ void UI::displayMessage(const Message& msg) {
     std::string typeStr;
     switch (msg.type) {
         case MessageType::TEXT:
-            std::cout << "[" << msg.sender << "]: " << msg.content << std::endl;
+            std::cout << roomPrefix(msg.roomId) << "[" << msg.sender << "]: " << msg.content << std::endl;
             break;
         case MessageType::JOIN:
             std::cout << ">>> " << msg.content << std::endl;
@@ -86,17 +86,25 @@ void UI::displayMessage(const Message& msg) {
         case MessageType::SYSTEM:
             std::cout << "[SYSTEM]: " << msg.content << std::endl;
             break;
-        case MessageType::USER_LIST:
-            if (!msg.content.empty()) {
-                std::istringstream iss(msg.content);
-                std::string user;
-                std::vector<std::string> users;
-                while (std::getline(iss, user, ',')) {
-                    users.push_back(user);
-                }
-                updateUserList(users);
+        case MessageType::ROOM_JOIN:
+            std::cout << ">>> " << msg.sender << " joined #" << msg.content << std::endl;
+            break;
+        case MessageType::ROOM_PART:
+            std::cout << "<<< " << msg.sender << " left #" << msg.content << std::endl;
+            break;
+        case MessageType::ERROR_MSG:
+            std::cout << "[ERROR]: " << msg.content << std::endl;
+            break;
+        case MessageType::USER_LIST: {
+            std::istringstream iss(msg.content);
+            std::string user;
+            std::vector<std::string> users;
+            while (std::getline(iss, user, ',')) {
+                users.push_back(user);
             }
+            updateUserList(users, msg.messageId);
             break;
+        }
         default:
             std::cout << "[UNKNOWN]: " << msg.content << std::endl;
     }
@@ -112,9 +120,96 @@ void UI::displaySystemMessage(const std::string& msg) {
     printInputPrompt();
 }
 
-void UI::updateUserList(const std::vector<std::string>& users) {
-    userList_ = users;
-    // Could display user list in a sidebar if implementing GUI
+void UI::updateUserList(const std::vector<std::string>& users, uint32_t version) {
+    users_.clear();
+    users_.insert(users.begin(), users.end());
+    presenceVersion_ = version;
+    hasPresence_ = true;
+}
+
+bool UI::applyPresenceDelta(const std::string& delta, uint32_t version) {
+    std::lock_guard<std::mutex> lock(messagesMutex_);
+    
+    // Deltas sent before our snapshot, or already included in it
+    if (!hasPresence_ || version <= presenceVersion_) {
+        return true;
+    }
+    if (version != presenceVersion_ + 1 || delta.empty()) {
+        return false;
+    }
+    
+    // Entries carry final states, so only ones that change the list count
+    std::vector<std::string> joined;
+    std::vector<std::string> left;
+    std::istringstream iss(delta);
+    std::string entry;
+    while (std::getline(iss, entry, ',')) {
+        if (entry.size() < 2) {
+            continue;
+        }
+        std::string name = entry.substr(1);
+        if (entry[0] == '+') {
+            if (users_.insert(name).second) {
+                joined.push_back(name);
+            }
+        } else if (users_.erase(name) > 0) {
+            left.push_back(name);
+        }
+    }
+    presenceVersion_ = version;
+    
+    if (!joined.empty()) {
+        std::cout << ">>> " << summarizeNames(joined) << " joined the chat" << std::endl;
+    }
+    if (!left.empty()) {
+        std::cout << "<<< " << summarizeNames(left) << " left the chat" << std::endl;
+    }
+    if (!joined.empty() || !left.empty()) {
+        printInputPrompt();
+    }
+    return true;
+}
+
+std::string UI::summarizeNames(const std::vector<std::string>& names) {
+    // Join storms would otherwise flood the screen
+    const size_t shown = std::min(names.size(), MAX_LISTED_PRESENCE_NAMES);
+    std::string text;
+    for (size_t i = 0; i < shown; ++i) {
+        text += i == 0 ? names[i] : ", " + names[i];
+    }
+    if (names.size() > shown) {
+        text += " and " + std::to_string(names.size() - shown) + " others";
+    }
+    return text;
+}
+
+void UI::displayUserList() {
+    std::lock_guard<std::mutex> lock(messagesMutex_);
+    std::string list;
+    for (const std::string& user : users_) {
+        list += list.empty() ? user : ", " + user;
+    }
+    
+    std::cout << "[SYSTEM]: Online (" << users_.size() << "): " << list << std::endl;
+    printInputPrompt();
+}
+
+void UI::setRoomName(uint32_t roomId, const std::string& name) {
+    std::lock_guard<std::mutex> lock(messagesMutex_);
+    roomNames_[roomId] = name;
+}
+
+void UI::removeRoom(uint32_t roomId) {
+    std::lock_guard<std::mutex> lock(messagesMutex_);
+    roomNames_.erase(roomId);
+}
+
+std::string UI::roomPrefix(uint32_t roomId) const {
+    if (roomId == LOBBY_ROOM_ID) {
+        return "";
+    }
+    auto it = roomNames_.find(roomId);
+    return it != roomNames_.end() ? "#" + it->second + " " : "#" + std::to_string(roomId) + " ";
 }
 
 void UI::setInputCallback(InputCallback callback) {
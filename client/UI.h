@@ -4,6 +4,8 @@
 #include "../shared/Message.h"
 #include <string>
 #include <vector>
+#include <set>
+#include <unordered_map>
 #include <functional>
 #include <atomic>
 #include <thread>
@@ -22,7 +24,14 @@ public:
     void displaySystemMessage(const std::string& msg);
     void setInputCallback(InputCallback callback);
     void setUsername(const std::string& username);
-    void updateUserList(const std::vector<std::string>& users);
+    // Presence: a full snapshot replaces the list, deltas (comma-separated
+    // "+name" or "-name" entries) are applied in version order. Returns
+    // false if the delta's version shows one was missed and a new snapshot
+    // is needed.
+    bool applyPresenceDelta(const std::string& delta, uint32_t version);
+    void displayUserList();
+    void setRoomName(uint32_t roomId, const std::string& name);
+    void removeRoom(uint32_t roomId);
     
 private:
     void inputThread();
@@ -30,11 +39,20 @@ private:
     void printHeader();
     void printMessages();
     void printInputPrompt();
+    std::string roomPrefix(uint32_t roomId) const; // Requires messagesMutex_
+    void updateUserList(const std::vector<std::string>& users, uint32_t version); // Requires messagesMutex_
+    static std::string summarizeNames(const std::vector<std::string>& names);
+    
+    // Names printed per join/leave line before the rest are counted
+    static constexpr size_t MAX_LISTED_PRESENCE_NAMES = 5;
     
     std::vector<Message> messages_;
     std::vector<std::string> systemMessages_;
-    std::vector<std::string> userList_;
+    std::set<std::string> users_;
+    uint32_t presenceVersion_;
+    bool hasPresence_;
     std::string username_;
+    std::unordered_map<uint32_t, std::string> roomNames_;
     std::atomic<bool> running_;
     std::thread inputThread_;
     std::mutex messagesMutex_;
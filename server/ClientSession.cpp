@@ -1,29 +1,197 @@
 #include "ClientSession.h"
+#include "FramePool.h"
 #include "MessageRouter.h"
+#include "EventLoop.h"
 #include "../shared/Message.h"
 #include "../shared/Serializer.h"
-#include "../shared/Protocol.h"
+#include "../shared/CompactSerializer.h"
+#include "Protocol.h"
+#include "Metrics.h"
+#include "Tracer.h"
 #include <iostream>
 #include <algorithm>
 #include <thread>
 #include <chrono>
 #include <cstring>
+#include <cerrno>
 
 #ifdef _WIN32
     #pragma comment(lib, "ws2_32.lib")
+#else
+    #include <fcntl.h>
+    #include <sys/uio.h>
+    #include <netinet/tcp.h>
 #endif
 
-uint32_t ClientSession::nextClientId_ = 1;
+#ifdef MSG_NOSIGNAL
+    #define SEND_FLAGS MSG_NOSIGNAL
+#else
+    #define SEND_FLAGS 0
+#endif
+
+std::atomic<uint32_t> ClientSession::nextClientId_(1);
+
+namespace {
 
-ClientSession::ClientSession(SocketHandle socket, MessageRouter* router)
-    : socket_(socket), router_(router), clientId_(nextClientId_++), 
-      connected_(false), running_(false) {
+bool setNonBlocking(SocketHandle socket) {
+    #ifdef _WIN32
+        u_long mode = 1;
+        return ioctlsocket(socket, FIONBIO, &mode) == 0;
+    #else
+        int flags = fcntl(socket, F_GETFL, 0);
+        return flags >= 0 && fcntl(socket, F_SETFL, flags | O_NONBLOCK) == 0;
+    #endif
+}
+
+bool lastErrorWouldBlock() {
+    #ifdef _WIN32
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+    #else
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    #endif
+}
+
+// Scatter/gather slice for one gathered send
+#ifdef _WIN32
+    typedef WSABUF IoSlice;
+    
+    void setSlice(IoSlice& slice, const uint8_t* data, size_t len) {
+        slice.buf = reinterpret_cast<CHAR*>(const_cast<uint8_t*>(data));
+        slice.len = static_cast<ULONG>(len);
+    }
+    
+    long writeSlices(SocketHandle socket, IoSlice* slices, size_t count) {
+        DWORD bytesSent = 0;
+        if (WSASend(socket, slices, static_cast<DWORD>(count), &bytesSent, 0, nullptr, nullptr) != 0) {
+            return -1;
+        }
+        return static_cast<long>(bytesSent);
+    }
+#else
+    typedef iovec IoSlice;
+    
+    void setSlice(IoSlice& slice, const uint8_t* data, size_t len) {
+        slice.iov_base = const_cast<uint8_t*>(data);
+        slice.iov_len = len;
+    }
+    
+    long writeSlices(SocketHandle socket, IoSlice* slices, size_t count) {
+        // sendmsg rather than writev so MSG_NOSIGNAL applies
+        msghdr msg{};
+        msg.msg_iov = slices;
+        msg.msg_iovlen = count;
+        return static_cast<long>(sendmsg(socket, &msg, SEND_FLAGS));
+    }
+#endif
+
+bool lastErrorInterrupted() {
+    #ifdef _WIN32
+        return WSAGetLastError() == WSAEINTR;
+    #else
+        return errno == EINTR;
+    #endif
+}
+
+bool isLoopbackPeer(SocketHandle socket) {
+    sockaddr_storage peer{};
+    socklen_t length = sizeof(peer);
+    if (getpeername(socket, reinterpret_cast<sockaddr*>(&peer), &length) != 0) {
+        return false;
+    }
+    if (peer.ss_family == AF_INET) {
+        const sockaddr_in* address = reinterpret_cast<const sockaddr_in*>(&peer);
+        return (ntohl(address->sin_addr.s_addr) >> 24) == 127;
+    }
+    if (peer.ss_family == AF_INET6) {
+        const sockaddr_in6* address = reinterpret_cast<const sockaddr_in6*>(&peer);
+        return IN6_IS_ADDR_LOOPBACK(&address->sin6_addr) != 0;
+    }
+    return false;
+}
+
+// Lets the kernel probe a peer that cannot answer heartbeats: it is
+// dropped after idleMs of silence and count unanswered probes
+void enableKeepAlive(SocketHandle socket, unsigned int idleMs, unsigned int intervalMs) {
+    int on = 1;
+    setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, reinterpret_cast<const char*>(&on), sizeof(on));
+    #if defined(TCP_KEEPIDLE) && defined(TCP_KEEPINTVL) && defined(TCP_KEEPCNT)
+        int idle = static_cast<int>(std::max(1u, idleMs / 1000));
+        int interval = static_cast<int>(std::max(1u, intervalMs / 1000));
+        int count = 3;
+        setsockopt(socket, IPPROTO_TCP, TCP_KEEPIDLE, reinterpret_cast<const char*>(&idle), sizeof(idle));
+        setsockopt(socket, IPPROTO_TCP, TCP_KEEPINTVL, reinterpret_cast<const char*>(&interval), sizeof(interval));
+        setsockopt(socket, IPPROTO_TCP, TCP_KEEPCNT, reinterpret_cast<const char*>(&count), sizeof(count));
+    #else
+        (void)idleMs;
+        (void)intervalMs;
+    #endif
+}
+
+// Every session sends the same HEARTBEAT frame
+const FramePtr& heartbeatFrame() {
+    static const FramePtr frame =
+        std::make_shared<const std::vector<uint8_t>>(Serializer::serializeHeartbeat());
+    return frame;
+}
+
+} // namespace
+
+ClientSession::ClientSession(SocketHandle socket, MessageRouter* router,
+                             const SendQueueLimits& limits)
+    : socket_(socket), router_(router), loop_(nullptr), clientId_(nextClientId_++), 
+      protocolVersion_(MIN_PROTOCOL_VERSION), features_(0), handshakeDone_(false), connected_(false), running_(false), limits_(limits), queuedFrames_(0),
+      queuedBytes_(0), droppedFrames_(0), closeAfterFlush_(false), closing_(false), socketClosed_(false),
+      decoder_(4096), lastReadNs_(0), lastReceiveMs_(0), heartbeatSentMs_(0), flushRequested_(false),
+      sendCalls_(0), framesSent_(0), bytesSent_(0) {
 }
 
 ClientSession::~ClientSession() {
     stop();
 }
 
+void ClientSession::reset(SocketHandle socket, MessageRouter* router,
+                          const SendQueueLimits& limits) {
+    socket_ = socket;
+    router_ = router;
+    loop_ = nullptr;
+    username_.clear();
+    clientId_ = nextClientId_++;
+    protocolVersion_ = MIN_PROTOCOL_VERSION;
+    features_ = 0;
+    handshakeDone_ = false;
+    connected_ = false;
+    running_ = false;
+    
+    clearSendQueue();
+    limits_ = limits;
+    droppedFrames_ = 0;
+    closeAfterFlush_ = false;
+    closing_ = false;
+    socketClosed_ = false;
+    
+    if (decoder_.buffer().capacity() > MAX_RETAINED_DECODER_BYTES) {
+        decoder_ = FrameDecoder(4096);
+    } else {
+        decoder_.reset();
+    }
+    
+    lastReadNs_ = 0;
+    lastReceiveMs_ = 0;
+    heartbeatSentMs_ = 0;
+    flushRequested_ = false;
+    sendCalls_ = 0;
+    framesSent_ = 0;
+    bytesSent_ = 0;
+}
+
+void ClientSession::clearSendQueue() {
+    std::lock_guard<std::mutex> lock(sendQueueMutex_);
+    sendQueue_.clear();
+    knownSenders_.clear();
+    replayedThrough_.clear();
+    removeQueued(queuedFrames_, queuedBytes_);
+}
+
 bool ClientSession::start() {
     if (running_) {
         return false;
@@ -31,6 +199,8 @@ bool ClientSession::start() {
     
     running_ = true;
     connected_ = true;
+    lastReceiveMs_ = monotonicMillis();
+    countOpened();
     
     receiveThread_ = std::thread(&ClientSession::receiveThread, this);
     sendThread_ = std::thread(&ClientSession::sendThread, this);
@@ -38,19 +208,55 @@ bool ClientSession::start() {
     return true;
 }
 
+bool ClientSession::attach(EventLoop* loop) {
+    if (running_ || !loop) {
+        return false;
+    }
+    
+    if (!setNonBlocking(socket_)) {
+        #ifdef _WIN32
+            closesocket(socket_);
+        #else
+            close(socket_);
+        #endif
+        return false;
+    }
+    
+    loop_ = loop;
+    running_ = true;
+    connected_ = true;
+    lastReceiveMs_ = monotonicMillis();
+    countOpened();
+    
+    return true;
+}
+
 void ClientSession::stop() {
-    if (!running_) {
+    if (!running_.exchange(false)) {
         return;
     }
     
-    running_ = false;
     connected_ = false;
+    ServerMetrics& metrics = ServerMetrics::get();
+    metrics.connectionsClosed.add();
+    metrics.connections.sub(1);
     
-    #ifdef _WIN32
-        closesocket(socket_);
-    #else
-        close(socket_);
-    #endif
+    {
+        // Other threads only shut the socket down under this lock, so they
+        // can never hit a descriptor number that has been reused
+        std::lock_guard<std::mutex> lock(sendQueueMutex_);
+        
+        // Unblocks a sender stuck writing to a peer that stopped reading
+        shutdownSocket();
+        
+        #ifdef _WIN32
+            closesocket(socket_);
+        #else
+            close(socket_);
+        #endif
+        socketClosed_ = true;
+    }
+    sendQueueCv_.notify_all();
     
     if (receiveThread_.joinable()) {
         receiveThread_.join();
@@ -61,113 +267,715 @@ void ClientSession::stop() {
     }
 }
 
-void ClientSession::sendMessage(const std::vector<uint8_t>& data) {
+void ClientSession::sendMessage(const FramePtr& frame) {
+    {
+        std::lock_guard<std::mutex> lock(sendQueueMutex_);
+        if (closing_) {
+            return;
+        }
+        if (closeAfterFlush_) {
+            // Still backed up since the overflow error was queued: give up on
+            // a graceful close, the peer is not reading
+            shutdownSocket();
+            return;
+        }
+        enqueue(frame);
+    }
+    notifySender();
+}
+
+void ClientSession::sendBroadcast(const BroadcastFrames& frames) {
+    if (frames.presence) {
+        const FramePtr& frame = acceptsPresence() ? frames.frame : frames.legacy;
+        if (frame) {
+            sendMessage(frame);
+        }
+        return;
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(sendQueueMutex_);
+        if (closing_) {
+            return;
+        }
+        if (closeAfterFlush_) {
+            shutdownSocket();
+            return;
+        }
+        
+        // Stored before this session joined and sent to it in the replay
+        if (frames.sequence != 0 && !replayedThrough_.empty()) {
+            auto replayed = replayedThrough_.find(frames.roomId);
+            if (replayed != replayedThrough_.end() && frames.sequence <= replayed->second) {
+                return;
+            }
+        }
+        
+        if (!frames.compact || !acceptsCompactEncoding()) {
+            enqueue(frames.compressed && acceptsCompression() ? frames.compressed : frames.frame);
+        } else {
+            bool named = knownSenders_.find(frames.senderId) != knownSenders_.end();
+            if (!named) {
+                // Past the limit the client's table is reset before naming more
+                bool room = knownSenders_.size() < MAX_KNOWN_SENDERS;
+                if (!room && enqueue(std::make_shared<const std::vector<uint8_t>>(
+                                 CompactSerializer::encodeSender(0, "")))) {
+                    knownSenders_.clear();
+                    room = true;
+                }
+                
+                // The name comes from the v1 frame of the same message
+                MessageView view;
+                Serializer::deserializeView(frames.frame->data(), frames.frame->size(), view);
+                if (room && enqueue(std::make_shared<const std::vector<uint8_t>>(
+                                CompactSerializer::encodeSender(frames.senderId, view.sender)),
+                            frames.senderId)) {
+                    knownSenders_.insert(frames.senderId);
+                    named = true;
+                }
+            }
+            if (!closeAfterFlush_) {
+                if (named) {
+                    enqueue(frames.compact, frames.senderId, frames.frame);
+                } else {
+                    enqueue(frames.frame);
+                }
+            }
+        }
+    }
+    notifySender();
+}
+
+void ClientSession::sendReplay(uint32_t roomId, uint64_t sequence, const FramePtr& frame) {
+    {
+        std::lock_guard<std::mutex> lock(sendQueueMutex_);
+        replayedThrough_[roomId] = sequence;
+        if (closing_) {
+            return;
+        }
+        if (closeAfterFlush_) {
+            shutdownSocket();
+            return;
+        }
+        enqueue(frame);
+    }
+    notifySender();
+}
+
+void ClientSession::forgetReplay(uint32_t roomId) {
     std::lock_guard<std::mutex> lock(sendQueueMutex_);
-    sendQueue_.push(data);
+    replayedThrough_.erase(roomId);
 }
 
-bool ClientSession::receiveData(std::vector<uint8_t>& buffer) {
-    MessageHeader header;
-    int bytesReceived = 0;
+bool ClientSession::enqueue(const FramePtr& frame, uint32_t senderId, const FramePtr& fallback) {
+    if (!makeRoomFor(frame)) {
+        return false;
+    }
+    // Making room may have dropped the SENDER frame a compact frame needs
+    if (fallback && knownSenders_.find(senderId) == knownSenders_.end()) {
+        return enqueue(fallback);
+    }
+    uint32_t traceId = Tracer::current();
+    OutboundFrame& queued = sendQueue_.emplace_back(frame, traceId, traceId ? Tracer::nowNanos() : 0);
+    queued.senderId = senderId;
+    queued.fallback = fallback;
+    addQueued(1, frame->size());
+    return true;
+}
+
+void ClientSession::notifySender() {
+    sendQueueCv_.notify_one();
     
-    // First, receive the header
-    bytesReceived = recv(socket_, reinterpret_cast<char*>(&header), sizeof(MessageHeader), 0);
+    // Only one flush request per batch of enqueued frames reaches the loop
+    if (loop_ && !flushRequested_.exchange(true)) {
+        loop_->requestFlush(this);
+    }
+}
+
+bool ClientSession::makeRoomFor(const FramePtr& frame) {
+    auto fits = [this, &frame] {
+        return queuedFrames_ + 1 <= limits_.maxFrames &&
+               queuedBytes_ + frame->size() <= limits_.maxBytes;
+    };
     
-    if (bytesReceived <= 0) {
-        return false;
+    if (fits()) {
+        return true;
     }
     
-    if (bytesReceived != static_cast<int>(sizeof(MessageHeader))) {
-        // Partial header received, would need buffering in production
-        return false;
+    // A partially written frame at the front must go out whole
+    size_t firstDroppable = (!sendQueue_.empty() && sendQueue_.front().offset > 0) ? 1 : 0;
+    
+    switch (limits_.policy) {
+        case SlowConsumerPolicy::DROP_OLDEST:
+            while (!fits() && firstDroppable < sendQueue_.size()) {
+                dropQueuedFrame(firstDroppable);
+            }
+            if (!fits()) {
+                countDropped();
+                return false;
+            }
+            return true;
+        
+        case SlowConsumerPolicy::DROP_TEXT:
+            if (frameMessageType(frame) == static_cast<uint16_t>(MessageType::TEXT)) {
+                countDropped();
+                return false;
+            }
+            // Control frames may overrun the limits, but only up to twice them
+            if (queuedFrames_ + 1 <= 2 * limits_.maxFrames &&
+                queuedBytes_ + frame->size() <= 2 * limits_.maxBytes) {
+                return true;
+            }
+            return disconnectSlowConsumer(firstDroppable);
+        
+        case SlowConsumerPolicy::DISCONNECT:
+        default:
+            return disconnectSlowConsumer(firstDroppable);
+    }
+}
+
+bool ClientSession::disconnectSlowConsumer(size_t firstDroppable) {
+    while (firstDroppable < sendQueue_.size()) {
+        dropQueuedFrame(firstDroppable);
     }
+    countDropped();
     
-    // Validate magic
-    if (header.magic != PROTOCOL_MAGIC) {
-        return false;
+    Message errorMsg(MessageType::ERROR_MSG, "SERVER",
+                     "Disconnected: too many undelivered messages");
+    errorMsg.messageId = static_cast<uint32_t>(ProtocolError::SLOW_CONSUMER);
+    FramePtr errorFrame = FramePool::instance().encode(errorMsg);
+    sendQueue_.emplace_back(errorFrame);
+    addQueued(1, errorFrame->size());
+    closeAfterFlush_ = true;
+    
+    std::cout << "Client " << clientId_ << " send queue overflow, disconnecting" << std::endl;
+    return false;
+}
+
+void ClientSession::dropQueuedFrame(size_t index) {
+    OutboundFrame& dropped = sendQueue_[index];
+    if (frameMessageType(dropped.frame) == static_cast<uint16_t>(MessageType::SENDER)) {
+        // The client never learns this name. Send the compact frames queued
+        // behind it as v1 instead, up to the next frame naming the sender,
+        // and name it again on its next message
+        uint32_t senderId = dropped.senderId;
+        knownSenders_.erase(senderId);
+        for (size_t i = index + 1; i < sendQueue_.size(); ++i) {
+            OutboundFrame& later = sendQueue_[i];
+            if (later.senderId != senderId) {
+                continue;
+            }
+            if (!later.fallback) {
+                break;
+            }
+            removeQueued(0, later.frame->size());
+            addQueued(0, later.fallback->size());
+            later.frame = std::move(later.fallback);
+            later.fallback.reset();
+            later.senderId = 0;
+        }
+    }
+    removeQueued(1, dropped.remaining());
+    countDropped();
+    sendQueue_.erase(sendQueue_.begin() + index);
+}
+
+SendQueueDepth ClientSession::getSendQueueDepth() const {
+    SendQueueDepth depth;
+    depth.frames = queuedFrames_;
+    depth.bytes = queuedBytes_;
+    depth.droppedFrames = droppedFrames_;
+    return depth;
+}
+
+void ClientSession::addQueued(size_t frames, size_t bytes) {
+    queuedFrames_ += frames;
+    queuedBytes_ += bytes;
+    ServerMetrics& metrics = ServerMetrics::get();
+    metrics.queuedFrames.add(static_cast<int64_t>(frames));
+    metrics.queuedBytes.add(static_cast<int64_t>(bytes));
+}
+
+void ClientSession::removeQueued(size_t frames, size_t bytes) {
+    queuedFrames_ -= frames;
+    queuedBytes_ -= bytes;
+    ServerMetrics& metrics = ServerMetrics::get();
+    metrics.queuedFrames.sub(static_cast<int64_t>(frames));
+    metrics.queuedBytes.sub(static_cast<int64_t>(bytes));
+}
+
+void ClientSession::countDropped() {
+    droppedFrames_++;
+    ServerMetrics::get().droppedFrames.add();
+}
+
+void ClientSession::countOpened() {
+    ServerMetrics& metrics = ServerMetrics::get();
+    metrics.connectionsOpened.add();
+    metrics.connections.add(1);
+}
+
+void ClientSession::shutdownSocket() {
+    if (socketClosed_) {
+        return;
     }
     
-    // Receive payload
-    buffer.resize(sizeof(MessageHeader) + header.payloadSize);
-    std::memcpy(buffer.data(), &header, sizeof(MessageHeader));
+    #ifdef _WIN32
+        shutdown(socket_, SD_BOTH);
+    #else
+        shutdown(socket_, SHUT_RDWR);
+    #endif
+}
+
+void ClientSession::wakeSender() {
+    // Taking the lock orders the state change before the waiter's predicate check
+    {
+        std::lock_guard<std::mutex> lock(sendQueueMutex_);
+    }
+    sendQueueCv_.notify_all();
+}
+
+bool ClientSession::hasPendingSend() const {
+    std::lock_guard<std::mutex> lock(sendQueueMutex_);
+    return !sendQueue_.empty();
+}
+
+int ClientSession::readIntoDecoder(bool* filled) {
+    RingBuffer& ring = decoder_.buffer();
+    if (ring.freeSpace() == 0) {
+        ring.reserve(ring.capacity());
+    }
+    
+    uint8_t* first;
+    uint8_t* second;
+    size_t firstLen, secondLen;
+    ring.writableRegions(first, firstLen, second, secondLen);
     
-    if (header.payloadSize > 0) {
-        bytesReceived = recv(socket_, reinterpret_cast<char*>(buffer.data() + sizeof(MessageHeader)), 
-                           header.payloadSize, 0);
-        if (bytesReceived != static_cast<int>(header.payloadSize)) {
+    // A traced frame's receive stage starts here. A blocking read waits
+    // for the peer, so the threaded engine starts it when the read returns.
+    bool tracing = Tracer::instance().enabled();
+    uint64_t readStart = tracing && loop_ ? Tracer::nowNanos() : 0;
+    
+    // One call fills all free space, including the wrapped region
+    #ifdef _WIN32
+        int bytesReceived = recv(socket_, reinterpret_cast<char*>(first), static_cast<int>(firstLen), 0);
+    #else
+        iovec iov[2] = {{first, firstLen}, {second, secondLen}};
+        int bytesReceived = static_cast<int>(readv(socket_, iov, secondLen > 0 ? 2 : 1));
+    #endif
+    
+    if (bytesReceived > 0) {
+        ring.commitWrite(static_cast<size_t>(bytesReceived));
+        lastReceiveMs_.store(monotonicMillis(), std::memory_order_relaxed);
+        if (tracing) {
+            lastReadNs_ = readStart ? readStart : Tracer::nowNanos();
+        }
+    }
+    if (filled) {
+        *filled = bytesReceived == static_cast<int>(firstLen + secondLen);
+    }
+    return bytesReceived;
+}
+
+bool ClientSession::onReadable() {
+    while (true) {
+        bool filled = false;
+        int bytesReceived = readIntoDecoder(&filled);
+        if (bytesReceived == 0) {
+            return false;
+        }
+        if (bytesReceived < 0) {
+            if (lastErrorInterrupted()) {
+                continue;
+            }
+            if (lastErrorWouldBlock()) {
+                break;
+            }
             return false;
         }
+        
+        // Dispatch every complete frame, a trailing partial one stays buffered
+        const uint8_t* frame;
+        size_t frameSize;
+        FrameDecoder::Result result;
+        while ((result = decoder_.nextView(frame, frameSize)) == FrameDecoder::Result::FRAME) {
+            handleFrame(frame, frameSize);
+        }
+        if (result == FrameDecoder::Result::INVALID) {
+            return false;
+        }
+        
+        // A short read means the socket is drained
+        if (!filled) {
+            break;
+        }
     }
     
-    return true;
+    return connected_;
 }
 
-bool ClientSession::sendData(const std::vector<uint8_t>& data) {
-    size_t totalSent = 0;
-    while (totalSent < data.size()) {
-        int bytesSent = send(socket_, 
-                                reinterpret_cast<const char*>(data.data() + totalSent),
-                                static_cast<int>(data.size() - totalSent), 0);
-        if (bytesSent <= 0) {
+bool ClientSession::onWritable() {
+    flushRequested_ = false;
+    
+    std::lock_guard<std::mutex> lock(sendQueueMutex_);
+    while (!sendQueue_.empty()) {
+        long bytesSent = writeBatch(sendQueue_);
+        if (bytesSent < 0) {
+            if (lastErrorInterrupted()) {
+                continue;
+            }
+            // Socket buffer full: the loop re-arms EPOLLOUT and retries later
+            return lastErrorWouldBlock();
+        }
+    }
+    
+    // The overflow or protocol error has been delivered, let the loop close
+    // the session
+    return !closeAfterFlush_ && !closing_;
+}
+
+long ClientSession::writeBatch(std::deque<OutboundFrame>& frames) {
+    IoSlice slices[MAX_BATCH_FRAMES];
+    size_t count = 0;
+    size_t batchBytes = 0;
+    bool traced = false;
+    
+    for (const OutboundFrame& pending : frames) {
+        if (count == MAX_BATCH_FRAMES || (count > 0 && batchBytes >= MAX_BATCH_BYTES)) {
+            break;
+        }
+        setSlice(slices[count++], pending.data(), pending.remaining());
+        batchBytes += pending.remaining();
+        traced = traced || pending.traceId != 0;
+    }
+    
+    uint64_t writeStart = traced ? Tracer::nowNanos() : 0;
+    long bytesSent = writeSlices(socket_, slices, count);
+    if (bytesSent < 0) {
+        return bytesSent;
+    }
+    uint64_t writeEnd = traced ? Tracer::nowNanos() : 0;
+    
+    // Retire fully written frames, remember how far into the next one we got
+    size_t framesDone = 0;
+    size_t remaining = static_cast<size_t>(bytesSent);
+    while (remaining > 0 && remaining >= frames.front().remaining()) {
+        const OutboundFrame& done = frames.front();
+        if (done.traceId) {
+            Tracer& tracer = Tracer::instance();
+            tracer.record("send queue", done.traceId, done.queuedNs, writeStart);
+            tracer.record("send", done.traceId, writeStart, writeEnd);
+        }
+        remaining -= done.remaining();
+        frames.pop_front();
+        ++framesDone;
+    }
+    if (remaining > 0) {
+        frames.front().offset += remaining;
+    }
+    
+    removeQueued(framesDone, static_cast<size_t>(bytesSent));
+    
+    sendCalls_++;
+    framesSent_ += framesDone;
+    bytesSent_ += static_cast<uint64_t>(bytesSent);
+    ServerMetrics& metrics = ServerMetrics::get();
+    metrics.sendCalls.add();
+    metrics.framesSent.add(framesDone);
+    metrics.bytesSent.add(static_cast<uint64_t>(bytesSent));
+    return bytesSent;
+}
+
+SendStats ClientSession::getSendStats() const {
+    SendStats stats;
+    stats.sendCalls = sendCalls_;
+    stats.framesSent = framesSent_;
+    stats.bytesSent = bytesSent_;
+    return stats;
+}
+
+SendStats ClientSession::getTotalSendStats() {
+    ServerMetrics& metrics = ServerMetrics::get();
+    SendStats stats;
+    stats.sendCalls = metrics.sendCalls.value();
+    stats.framesSent = metrics.framesSent.value();
+    stats.bytesSent = metrics.bytesSent.value();
+    return stats;
+}
+
+bool ClientSession::receiveData(const uint8_t*& frame, size_t& frameSize) {
+    while (true) {
+        FrameDecoder::Result result = decoder_.nextView(frame, frameSize);
+        if (result == FrameDecoder::Result::FRAME) {
+            return true;
+        }
+        if (result == FrameDecoder::Result::INVALID) {
+            return false;
+        }
+        
+        int bytesReceived = readIntoDecoder(nullptr);
+        if (bytesReceived <= 0) {
+            if (bytesReceived < 0 && lastErrorInterrupted()) {
+                continue;
+            }
             return false;
         }
-        totalSent += bytesSent;
     }
-    return true;
 }
 
 void ClientSession::receiveThread() {
     while (running_ && connected_) {
-        std::vector<uint8_t> buffer;
+        const uint8_t* frame;
+        size_t frameSize;
         
-        if (!receiveData(buffer)) {
+        if (!receiveData(frame, frameSize)) {
             connected_ = false;
+            wakeSender();
             break;
         }
         
-        Message msg;
-        if (Serializer::deserialize(buffer, msg)) {
-            // Handle join message
-            if (msg.type == MessageType::JOIN && username_.empty()) {
-                username_ = msg.sender;
-                if (router_) {
-                    router_->onClientJoined(this, username_);
-                }
-            }
-            
-            // Route message through router
-            if (router_) {
-                router_->routeMessage(this, msg);
-            }
+        handleFrame(frame, frameSize);
+    }
+    
+    handleDisconnect();
+}
+
+void ClientSession::handleFrame(const uint8_t* frame, size_t frameSize) {
+    ServerMetrics& metrics = ServerMetrics::get();
+    metrics.framesReceived.add();
+    metrics.bytesReceived.add(frameSize);
+    // Already answered with a protocol error and about to be closed
+    if (closing_) {
+        return;
+    }
+    
+    // A sampled frame records each stage of its way through the server
+    Tracer& tracer = Tracer::instance();
+    uint32_t traceId = tracer.sample();
+    uint64_t parseStart = 0;
+    if (traceId) {
+        parseStart = Tracer::nowNanos();
+        tracer.record("receive", traceId, lastReadNs_, parseStart);
+    }
+    
+    uint16_t type = Serializer::frameType(frame);
+    if (type == static_cast<uint16_t>(ProtocolMessageType::CLIENT_HELLO)) {
+        handleHello(frame, frameSize);
+        return;
+    }
+    if (type == static_cast<uint16_t>(ProtocolMessageType::STATS_REQUEST)) {
+        handleStatsRequest();
+        return;
+    }
+    // An answered heartbeat; reading it already counted as activity
+    if (type == static_cast<uint16_t>(ProtocolMessageType::HEARTBEAT)) {
+        return;
+    }
+    
+    // Parsed in place; the view is only valid until the next socket read
+    MessageView view;
+    if (!Serializer::deserializeView(frame, frameSize, view)) {
+        return;
+    }
+    if (traceId) {
+        tracer.record("deserialize", traceId, parseStart, Tracer::nowNanos());
+    }
+    
+    // Handle join message
+    if (view.type == MessageType::JOIN && username_.empty() && !view.sender.empty()) {
+        username_.assign(view.sender.data(), view.sender.size());
+        handshakeDone_ = true;
+        if (router_) {
+            router_->onClientJoined(this, username_);
         }
     }
     
+    // Route message through router
+    if (router_) {
+        uint64_t start = Tracer::nowNanos();
+        {
+            // Frames queued while routing carry the trace id
+            Tracer::Scope trace(traceId);
+            router_->routeFrame(this, view, frame, frameSize);
+        }
+        uint64_t end = Tracer::nowNanos();
+        metrics.routeNanos.record(end - start);
+        if (traceId) {
+            tracer.record("route", traceId, start, end);
+        }
+    }
+}
+
+void ClientSession::handleHello(const uint8_t* frame, size_t frameSize) {
+    HelloMessage request;
+    if (!Serializer::deserializeHello(frame, frameSize, request)) {
+        closeWithError(ProtocolError::INVALID_MESSAGE, "Malformed hello");
+        return;
+    }
+    // Only the first frame of a connection may be a hello
+    if (handshakeDone_) {
+        closeWithError(ProtocolError::INVALID_MESSAGE, "Unexpected hello");
+        return;
+    }
+    
+    HelloMessage reply;
+    uint32_t supported = router_ ? router_->getSupportedFeatures() : 0;
+    if (!negotiateHello(request, supported, reply)) {
+        handshakeDone_ = true;
+        closeWithError(ProtocolError::UNSUPPORTED_VERSION,
+                       "Unsupported protocol version " + std::to_string(request.minVersion) + "-" +
+                       std::to_string(request.maxVersion) + ", server speaks " +
+                       std::to_string(MIN_PROTOCOL_VERSION) + "-" + std::to_string(PROTOCOL_VERSION));
+        return;
+    }
+    
+    protocolVersion_ = reply.maxVersion;
+    features_ = reply.features;
+    // After the features: checkIdle() reads both from another thread
+    handshakeDone_ = true;
+    sendMessage(std::make_shared<const std::vector<uint8_t>>(
+        Serializer::serializeHello(ProtocolMessageType::SERVER_HELLO, reply)));
+}
+
+void ClientSession::handleStatsRequest() {
+    // Metrics describe the whole server, so only local clients get them
+    if (!isLoopbackPeer(socket_)) {
+        Message errorMsg(MessageType::ERROR_MSG, "SERVER", "Stats are only available to local clients");
+        errorMsg.messageId = static_cast<uint32_t>(ProtocolError::UNAUTHORIZED);
+        sendMessage(FramePool::instance().encode(errorMsg));
+        return;
+    }
+    sendMessage(std::make_shared<const std::vector<uint8_t>>(
+        Serializer::serializeStats(MetricsRegistry::instance().renderText())));
+}
+
+void ClientSession::closeWithError(ProtocolError code, const std::string& text) {
+    Message errorMsg(MessageType::ERROR_MSG, "SERVER", text);
+    errorMsg.messageId = static_cast<uint32_t>(code);
+    FramePtr errorFrame = FramePool::instance().encode(errorMsg);
+    {
+        std::lock_guard<std::mutex> lock(sendQueueMutex_);
+        if (closeAfterFlush_ || closing_) {
+            return;
+        }
+        // The sender closes once the queue, this frame included, has been
+        // written; frames queued for the session meanwhile are dropped
+        sendQueue_.emplace_back(errorFrame);
+        addQueued(1, errorFrame->size());
+        closing_ = true;
+    }
+    notifySender();
+}
+
+void ClientSession::handleDisconnect() {
     // Notify router of disconnection
-    if (router_ && !username_.empty()) {
+    if (!router_) {
+        return;
+    }
+    
+    if (!username_.empty()) {
         router_->onClientLeft(this, username_);
+    } else {
+        router_->removeClient(this);
+    }
+}
+
+uint64_t ClientSession::checkIdle(uint64_t now, const HeartbeatOptions& options) {
+    if (!connected_) {
+        return 0;
+    }
+    
+    bool heartbeats = acceptsHeartbeats();
+    if (handshakeDone_ && !heartbeats) {
+        // An older client, which would not answer a heartbeat. It may just
+        // be quiet, so rather than timing it out, TCP keepalive finds out
+        // whether the peer is still there.
+        std::lock_guard<std::mutex> lock(sendQueueMutex_);
+        if (!socketClosed_) {
+            enableKeepAlive(socket_, options.timeoutMs, options.intervalMs);
+        }
+        return 0;
+    }
+    
+    uint64_t last = lastReceiveMs_.load(std::memory_order_relaxed);
+    uint64_t silent = now > last ? now - last : 0;
+    if (silent >= options.timeoutMs) {
+        std::cout << "Client " << clientId_ << " silent for " << silent << " ms, disconnecting" << std::endl;
+        ServerMetrics::get().idleDisconnects.add();
+        
+        // The engine sees the connection end and reaps the session as usual
+        std::lock_guard<std::mutex> lock(sendQueueMutex_);
+        shutdownSocket();
+        return 0;
+    }
+    if (silent < options.intervalMs) {
+        return last + options.intervalMs;
     }
+    
+    // One heartbeat per silence; the answer moves lastReceiveMs_ past it
+    if (heartbeats && heartbeatSentMs_ <= last) {
+        heartbeatSentMs_ = now;
+        ServerMetrics::get().heartbeatsSent.add();
+        sendMessage(heartbeatFrame());
+    }
+    return std::min(now + options.intervalMs, last + options.timeoutMs);
+}
+
+HeartbeatStats ClientSession::getHeartbeatStats() {
+    ServerMetrics& metrics = ServerMetrics::get();
+    HeartbeatStats stats;
+    stats.heartbeatsSent = metrics.heartbeatsSent.value();
+    stats.idleDisconnects = metrics.idleDisconnects.value();
+    return stats;
+}
+
+uint64_t ClientSession::monotonicMillis() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
 }
 
 void ClientSession::sendThread() {
+    std::deque<OutboundFrame> batch;
+    
     while (running_ && connected_) {
-        std::vector<uint8_t> data;
-        
         {
-            std::lock_guard<std::mutex> lock(sendQueueMutex_);
-            if (!sendQueue_.empty()) {
-                data = sendQueue_.front();
-                sendQueue_.pop();
+            // Sleep until sendMessage() enqueues something or the session ends
+            std::unique_lock<std::mutex> lock(sendQueueMutex_);
+            sendQueueCv_.wait(lock, [this] {
+                return !sendQueue_.empty() || !running_ || !connected_;
+            });
+            if (sendQueue_.empty()) {
+                break;
+            }
+            // Take one gathered send's worth and write it without the lock.
+            // The rest stays queued, where the slow-consumer policy can
+            // still drop it.
+            size_t batchBytes = 0;
+            while (!sendQueue_.empty() && batch.size() < MAX_BATCH_FRAMES &&
+                   (batch.empty() || batchBytes < MAX_BATCH_BYTES)) {
+                batchBytes += sendQueue_.front().remaining();
+                batch.push_back(std::move(sendQueue_.front()));
+                sendQueue_.pop_front();
             }
         }
         
-        if (!data.empty()) {
-            if (!sendData(data)) {
+        while (!batch.empty()) {
+            long bytesSent = writeBatch(batch);
+            if (bytesSent < 0 && lastErrorInterrupted()) {
+                continue;
+            }
+            if (bytesSent <= 0) {
                 connected_ = false;
-                break;
+                return;
             }
-        } else {
-            // Small sleep to avoid busy waiting
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        
+        if ((closeAfterFlush_ || closing_) && queuedFrames_ == 0) {
+            // Overflow or protocol error delivered; ends the receive thread as well
+            connected_ = false;
+            std::lock_guard<std::mutex> lock(sendQueueMutex_);
+            shutdownSocket();
+            return;
         }
     }
 }
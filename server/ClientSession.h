@@ -5,9 +5,15 @@
 #include <thread>
 #include <atomic>
 #include <mutex>
-#include <queue>
+#include <condition_variable>
+#include <deque>
 #include <vector>
+#include <unordered_set>
+#include <unordered_map>
 #include <cstdint>
+#include "Frame.h"
+#include "TimerWheel.h"
+#include "../shared/FrameDecoder.h"
 
 #ifdef _WIN32
     #include <winsock2.h>
@@ -26,39 +32,211 @@
 #endif
 
 class MessageRouter;
+class EventLoop;
+
+// Gathered-send counters; framesSent / sendCalls is the batching factor
+struct SendStats {
+    uint64_t sendCalls = 0;
+    uint64_t framesSent = 0;
+    uint64_t bytesSent = 0;
+};
+
+// What a session does when a new frame would exceed its send queue limits
+enum class SlowConsumerPolicy {
+    DROP_OLDEST,  // Discard the oldest unsent frames to make room
+    DROP_TEXT,    // Discard new TEXT frames, queue control frames up to twice
+                  // the limits, then DISCONNECT
+    DISCONNECT    // Send ERROR_MSG (ProtocolError::SLOW_CONSUMER) and close
+};
+
+struct SendQueueLimits {
+    size_t maxBytes = 8 * 1024 * 1024;
+    size_t maxFrames = 10000;
+    SlowConsumerPolicy policy = SlowConsumerPolicy::DISCONNECT;
+};
+
+// Idle detection. A session that negotiated FEATURE_HEARTBEAT and has sent
+// nothing for intervalMs gets a HEARTBEAT; one silent for timeoutMs is
+// disconnected, as is any connection that has not sent a hello or JOIN
+// by then. Older clients that joined without heartbeats get TCP keepalive
+// instead: probes start after timeoutMs of silence, every intervalMs, and
+// the connection is dropped after three go unanswered.
+struct HeartbeatOptions {
+    unsigned int intervalMs = 15000; // 0 disables heartbeats and idle timeouts
+    unsigned int timeoutMs = 45000;
+    
+    // Resolution of the timer wheels tracking the deadlines
+    static constexpr unsigned int TICK_MS = 100;
+    
+    bool enabled() const { return intervalMs > 0; }
+};
+
+struct HeartbeatStats {
+    uint64_t heartbeatsSent = 0;
+    uint64_t idleDisconnects = 0;
+};
+
+// Current backlog of one session, for spotting slow consumers
+struct SendQueueDepth {
+    size_t frames = 0;
+    size_t bytes = 0;
+    uint64_t droppedFrames = 0;
+};
 
 class ClientSession {
 public:
-    ClientSession(SocketHandle socket, MessageRouter* router);
+    ClientSession(SocketHandle socket, MessageRouter* router,
+                  const SendQueueLimits& limits = SendQueueLimits());
     ~ClientSession();
     
+    // Reinitializes a stopped session for a new connection, keeping its
+    // buffers; used by SessionPool instead of a fresh allocation
+    void reset(SocketHandle socket, MessageRouter* router, const SendQueueLimits& limits);
+    // Releases queued frames once stopped, before the session goes idle
+    void clearSendQueue();
+    
+    // Threaded engine: spawns a receive and a send thread for this session
     bool start();
+    // Event-loop engine: switches the socket to non-blocking mode and lets
+    // the owning loop drive onReadable()/onWritable()
+    bool attach(EventLoop* loop);
     void stop();
-    void sendMessage(const std::vector<uint8_t>& data);
+    // Queues a shared frame; the buffer itself is never copied
+    void sendMessage(const FramePtr& frame);
+    // Queues the broadcast variant this session negotiated. A compact frame
+    // is preceded by a SENDER frame the first time its sender id is used.
+    // A room's broadcast already covered by the session's replay of that
+    // room is skipped.
+    void sendBroadcast(const BroadcastFrames& frames);
+    // Queues a replay of a room's history holding its messages up to
+    // sequence, before the session can receive the room's messages live
+    void sendReplay(uint32_t roomId, uint64_t sequence, const FramePtr& frame);
+    void forgetReplay(uint32_t roomId);
     std::string getUsername() const { return username_; }
     bool isConnected() const { return connected_; }
     uint32_t getClientId() const { return clientId_; }
+    // Negotiated by the client's CLIENT_HELLO; version 1 and no features
+    // for clients that skip the handshake
+    uint16_t getProtocolVersion() const { return protocolVersion_; }
+    uint32_t getFeatures() const { return features_; }
+    bool acceptsCompression() const { return (features_ & FEATURE_COMPRESSION) != 0; }
+    bool acceptsCompactEncoding() const { return (features_ & FEATURE_COMPACT_ENCODING) != 0; }
+    bool acceptsHeartbeats() const { return (features_ & FEATURE_HEARTBEAT) != 0; }
+    bool acceptsPresence() const { return (features_ & FEATURE_PRESENCE) != 0; }
+    SocketHandle getSocket() const { return socket_; }
+    
+    // Event-loop callbacks, only called from the owning loop thread
+    bool onReadable();
+    bool onWritable();
+    bool hasPendingSend() const;
+    
+    SendQueueDepth getSendQueueDepth() const;
+    SendStats getSendStats() const;
+    static SendStats getTotalSendStats();
+    void markDisconnected() { connected_ = false; }
+    void handleDisconnect();
+    
+    // Idle detection, driven by the engine's timer wheel. The engine owns
+    // the timer; its data points back at this session.
+    TimerWheel::Timer& idleTimer() { return idleTimer_; }
+    // Sends a HEARTBEAT or disconnects as options say, given how long the
+    // client has been silent. Returns when to check again (monotonic ms),
+    // or 0 if the session needs no more checks.
+    uint64_t checkIdle(uint64_t now, const HeartbeatOptions& options);
+    static HeartbeatStats getHeartbeatStats();
+    // Milliseconds on the clock checkIdle() works with
+    static uint64_t monotonicMillis();
     
 private:
     void receiveThread();
     void sendThread();
-    bool receiveData(std::vector<uint8_t>& buffer);
-    bool sendData(const std::vector<uint8_t>& data);
+    bool receiveData(const uint8_t*& frame, size_t& frameSize);
+    int readIntoDecoder(bool* filled);
+    long writeBatch(std::deque<OutboundFrame>& frames);
+    void handleFrame(const uint8_t* frame, size_t frameSize);
+    void handleHello(const uint8_t* frame, size_t frameSize);
+    // Answers with the server's metrics as text
+    void handleStatsRequest();
+    // Queues an ERROR_MSG and closes the connection once it is written
+    void closeWithError(ProtocolError code, const std::string& text);
+    void wakeSender();
+    void shutdownSocket(); // Requires sendQueueMutex_
+    // Requires sendQueueMutex_. senderId and fallback tag compact frames
+    bool enqueue(const FramePtr& frame, uint32_t senderId = 0, const FramePtr& fallback = nullptr);
+    void notifySender();
+    bool makeRoomFor(const FramePtr& frame);
+    bool disconnectSlowConsumer(size_t firstDroppable);
+    void dropQueuedFrame(size_t index);
+    // Queue accounting, mirrored in the server-wide metrics
+    void addQueued(size_t frames, size_t bytes);
+    void removeQueued(size_t frames, size_t bytes);
+    void countDropped();
+    void countOpened();
     
     SocketHandle socket_;
     MessageRouter* router_;
+    EventLoop* loop_;
     std::string username_;
     uint32_t clientId_;
+    std::atomic<uint16_t> protocolVersion_;
+    std::atomic<uint32_t> features_;
+    std::atomic<bool> handshakeDone_;
     std::atomic<bool> connected_;
     std::atomic<bool> running_;
     
     std::thread receiveThread_;
     std::thread sendThread_;
     
-    std::queue<std::vector<uint8_t>> sendQueue_;
-    std::mutex sendQueueMutex_;
+    // A pooled session gives back a receive buffer grown past this
+    static constexpr size_t MAX_RETAINED_DECODER_BYTES = 64 * 1024;
+    
+    // Past this many sender ids, the client is told to forget them all
+    static constexpr size_t MAX_KNOWN_SENDERS = 4096;
+    
+    // Limits for a single gathered send
+    static constexpr size_t MAX_BATCH_FRAMES = 64;
+    static constexpr size_t MAX_BATCH_BYTES = 256 * 1024;
+    
+    std::deque<OutboundFrame> sendQueue_;
+    mutable std::mutex sendQueueMutex_;
+    std::condition_variable sendQueueCv_;
+    
+    // Backlog accounting, including frames the sender has taken but not
+    // finished writing
+    SendQueueLimits limits_;
+    std::atomic<size_t> queuedFrames_;
+    std::atomic<size_t> queuedBytes_;
+    std::atomic<uint64_t> droppedFrames_;
+    std::atomic<bool> closeAfterFlush_;
+    // Set once a protocol error is queued: later frames are dropped, and
+    // the socket is shut down when the queue, error included, is written
+    std::atomic<bool> closing_;
+    bool socketClosed_;
+    // Sender ids named to the client by a queued or sent SENDER frame.
+    // Guarded by sendQueueMutex_.
+    std::unordered_set<uint32_t> knownSenders_;
+    // Newest message of each room included in the session's replay of it.
+    // Guarded by sendQueueMutex_.
+    std::unordered_map<uint32_t, uint64_t> replayedThrough_;
+    
+    // Buffered input, including any partial frame
+    FrameDecoder decoder_;
+    // When the read that filled the decoder last started, while tracing
+    uint64_t lastReadNs_;
+    
+    // When input last arrived, and when the last unanswered HEARTBEAT went
+    // out; the latter only touched by the thread running checkIdle()
+    std::atomic<uint64_t> lastReceiveMs_;
+    uint64_t heartbeatSentMs_;
+    TimerWheel::Timer idleTimer_;
+    
+    std::atomic<bool> flushRequested_;
+    
+    std::atomic<uint64_t> sendCalls_;
+    std::atomic<uint64_t> framesSent_;
+    std::atomic<uint64_t> bytesSent_;
     
-    static uint32_t nextClientId_;
+    static std::atomic<uint32_t> nextClientId_;
 };
 
 #endif // CLIENTSESSION_H
@@ -0,0 +1,358 @@
+#include "EventLoop.h"
+#include "MessageRouter.h"
+#include "SessionPool.h"
+#include <iostream>
+
+#ifdef __linux__
+    #include <sys/epoll.h>
+    #include <sys/eventfd.h>
+    #include <fcntl.h>
+    #include <cerrno>
+#endif
+
+EventLoop::EventLoop(MessageRouter* router, SessionPool* sessionPool,
+                     const SendQueueLimits& limits, const HeartbeatOptions& heartbeat)
+    : router_(router), sessionPool_(sessionPool), limits_(limits), heartbeat_(heartbeat), epollFd_(-1),
+      wakeFd_(-1), listenSocket_(INVALID_SOCKET_VALUE), running_(false), wakePending_(false), sessionCount_(0),
+      idleTimers_(ClientSession::monotonicMillis() / HeartbeatOptions::TICK_MS) {
+}
+
+EventLoop::~EventLoop() {
+    stop();
+}
+
+bool EventLoop::isSupported() {
+#ifdef __linux__
+    return true;
+#else
+    return false;
+#endif
+}
+
+#ifdef __linux__
+
+bool EventLoop::start(SocketHandle listenSocket) {
+    if (running_) {
+        return false;
+    }
+    listenSocket_ = listenSocket;
+    
+    auto fail = [this]() {
+        if (listenSocket_ != INVALID_SOCKET_VALUE) {
+            close(listenSocket_);
+            listenSocket_ = INVALID_SOCKET_VALUE;
+        }
+        if (wakeFd_ >= 0) {
+            close(wakeFd_);
+            wakeFd_ = -1;
+        }
+        if (epollFd_ >= 0) {
+            close(epollFd_);
+            epollFd_ = -1;
+        }
+        return false;
+    };
+    
+    epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd_ < 0) {
+        std::cerr << "Failed to create epoll instance" << std::endl;
+        return fail();
+    }
+    
+    wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeFd_ < 0) {
+        std::cerr << "Failed to create eventfd" << std::endl;
+        return fail();
+    }
+    
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(epollFd_, EPOLL_CTL_ADD, wakeFd_, &ev);
+    
+    if (listenSocket_ != INVALID_SOCKET_VALUE) {
+        // The listener's events are told apart by pointing at listenSocket_
+        int flags = fcntl(listenSocket_, F_GETFL, 0);
+        ev.events = EPOLLIN;
+        ev.data.ptr = &listenSocket_;
+        if (flags < 0 || fcntl(listenSocket_, F_SETFL, flags | O_NONBLOCK) != 0 ||
+            epoll_ctl(epollFd_, EPOLL_CTL_ADD, listenSocket_, &ev) < 0) {
+            std::cerr << "Failed to register listening socket" << std::endl;
+            return fail();
+        }
+    }
+    
+    running_ = true;
+    thread_ = std::thread(&EventLoop::run, this);
+    return true;
+}
+
+void EventLoop::stop() {
+    if (!running_) {
+        return;
+    }
+    
+    running_ = false;
+    wake();
+    
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    
+    for (auto& pair : sessions_) {
+        idleTimers_.cancel(pair.first->idleTimer());
+        closing_.push_back(pair.second.session);
+    }
+    sessions_.clear();
+    reapClosedSessions();
+    
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex_);
+        for (SocketHandle socket : pendingSockets_) {
+            close(socket);
+        }
+        pendingSockets_.clear();
+        pendingFlushes_.clear();
+    }
+    
+    // Connections still in the listener's backlog are reset by the close
+    if (listenSocket_ != INVALID_SOCKET_VALUE) {
+        close(listenSocket_);
+        listenSocket_ = INVALID_SOCKET_VALUE;
+    }
+    close(wakeFd_);
+    close(epollFd_);
+    wakeFd_ = -1;
+    epollFd_ = -1;
+}
+
+void EventLoop::addConnection(SocketHandle socket) {
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex_);
+        pendingSockets_.push_back(socket);
+    }
+    wake();
+}
+
+void EventLoop::requestFlush(ClientSession* session) {
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex_);
+        pendingFlushes_.push_back(session);
+    }
+    wake();
+}
+
+void EventLoop::wake() {
+    if (wakePending_.exchange(true)) {
+        return;
+    }
+    uint64_t one = 1;
+    ssize_t written = write(wakeFd_, &one, sizeof(one));
+    (void)written;
+}
+
+void EventLoop::run() {
+    constexpr int MAX_EVENTS = 256;
+    epoll_event events[MAX_EVENTS];
+    
+    while (running_) {
+        // Wake once per tick while any session has an idle check pending
+        int timeout = idleTimers_.size() > 0 ? static_cast<int>(HeartbeatOptions::TICK_MS) : -1;
+        int count = epoll_wait(epollFd_, events, MAX_EVENTS, timeout);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "epoll_wait failed" << std::endl;
+            break;
+        }
+        
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.ptr == &listenSocket_) {
+                acceptConnections();
+                continue;
+            }
+            
+            ClientSession* session = static_cast<ClientSession*>(events[i].data.ptr);
+            
+            if (!session) {
+                uint64_t value;
+                ssize_t bytesRead = read(wakeFd_, &value, sizeof(value));
+                (void)bytesRead;
+                wakePending_ = false;
+                drainPending();
+                continue;
+            }
+            
+            if (!session->isConnected()) {
+                continue;
+            }
+            
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                if (!session->onReadable()) {
+                    closeSession(session);
+                    continue;
+                }
+            }
+            
+            if (events[i].events & EPOLLOUT) {
+                flushSession(session);
+            }
+        }
+        
+        checkIdleSessions();
+        reapClosedSessions();
+    }
+}
+
+void EventLoop::drainPending() {
+    std::vector<SocketHandle> sockets;
+    std::vector<ClientSession*> flushes;
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex_);
+        sockets.swap(pendingSockets_);
+        flushes.swap(pendingFlushes_);
+    }
+    
+    for (SocketHandle socket : sockets) {
+        registerSession(socket);
+    }
+    
+    for (ClientSession* session : flushes) {
+        // The session may have been closed since the request was queued
+        if (sessions_.count(session) && session->isConnected()) {
+            flushSession(session);
+        }
+    }
+}
+
+void EventLoop::acceptConnections() {
+    // Bounded so a connection storm cannot starve the loop's sessions; the
+    // listener stays readable and the rest are taken on the next pass
+    constexpr int MAX_ACCEPTS = 64;
+    for (int i = 0; i < MAX_ACCEPTS; ++i) {
+        sockaddr_in clientAddr{};
+        socklen_t clientAddrLen = sizeof(clientAddr);
+        SocketHandle socket = accept4(listenSocket_, reinterpret_cast<sockaddr*>(&clientAddr),
+                                      &clientAddrLen, SOCK_CLOEXEC);
+        if (socket < 0) {
+            // EAGAIN: backlog drained. Aborted handshakes and descriptor
+            // exhaustion are left for a later pass as well.
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                std::cerr << "Accept failed" << std::endl;
+            }
+            return;
+        }
+        
+        registerSession(socket);
+        
+        char ipStr[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &clientAddr.sin_addr, ipStr, INET_ADDRSTRLEN);
+        std::cout << "New client connected from " << ipStr << ":" << ntohs(clientAddr.sin_port) << std::endl;
+    }
+}
+
+void EventLoop::registerSession(SocketHandle socket) {
+    std::shared_ptr<ClientSession> session = sessionPool_->acquire(socket, router_, limits_);
+    if (!session->attach(this)) {
+        std::cerr << "Failed to attach client session" << std::endl;
+        return;
+    }
+    
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = session.get();
+    if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, socket, &ev) < 0) {
+        std::cerr << "Failed to register client socket" << std::endl;
+        session->stop();
+        return;
+    }
+    
+    sessions_[session.get()] = LoopSession{session, false};
+    sessionCount_ = sessions_.size();
+    router_->addClient(session);
+    
+    if (heartbeat_.enabled()) {
+        TimerWheel::Timer& timer = session->idleTimer();
+        timer.data = session.get();
+        uint64_t check = ClientSession::monotonicMillis() + heartbeat_.intervalMs;
+        idleTimers_.schedule(timer, check / HeartbeatOptions::TICK_MS + 1);
+    }
+}
+
+void EventLoop::flushSession(ClientSession* session) {
+    if (!session->onWritable()) {
+        closeSession(session);
+        return;
+    }
+    setWriteInterest(session, session->hasPendingSend());
+}
+
+void EventLoop::setWriteInterest(ClientSession* session, bool enabled) {
+    auto it = sessions_.find(session);
+    if (it == sessions_.end() || it->second.writeArmed == enabled) {
+        return;
+    }
+    
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLRDHUP | (enabled ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+    ev.data.ptr = session;
+    epoll_ctl(epollFd_, EPOLL_CTL_MOD, session->getSocket(), &ev);
+    it->second.writeArmed = enabled;
+}
+
+void EventLoop::closeSession(ClientSession* session) {
+    auto it = sessions_.find(session);
+    if (it == sessions_.end()) {
+        return;
+    }
+    
+    epoll_ctl(epollFd_, EPOLL_CTL_DEL, session->getSocket(), nullptr);
+    idleTimers_.cancel(session->idleTimer());
+    closing_.push_back(std::move(it->second.session));
+    sessions_.erase(it);
+    sessionCount_ = sessions_.size();
+    
+    // Teardown is deferred until the current batch of events is processed
+    session->markDisconnected();
+}
+
+void EventLoop::reapClosedSessions() {
+    // Router snapshots may briefly keep a closed session object alive
+    for (const std::shared_ptr<ClientSession>& session : closing_) {
+        session->handleDisconnect();
+        session->stop();
+    }
+    closing_.clear();
+}
+
+void EventLoop::checkIdleSessions() {
+    uint64_t now = ClientSession::monotonicMillis();
+    idleTimers_.advance(now / HeartbeatOptions::TICK_MS, [this, now](TimerWheel::Timer& timer) {
+        // A timed-out session is closed through its hangup event
+        ClientSession* session = static_cast<ClientSession*>(timer.data);
+        uint64_t check = session->checkIdle(now, heartbeat_);
+        if (check > 0) {
+            idleTimers_.schedule(timer, check / HeartbeatOptions::TICK_MS + 1);
+        }
+    });
+}
+
+#else
+
+bool EventLoop::start(SocketHandle) { return false; }
+void EventLoop::stop() {}
+void EventLoop::addConnection(SocketHandle) {}
+void EventLoop::requestFlush(ClientSession*) {}
+void EventLoop::wake() {}
+void EventLoop::run() {}
+void EventLoop::drainPending() {}
+void EventLoop::acceptConnections() {}
+void EventLoop::registerSession(SocketHandle) {}
+void EventLoop::flushSession(ClientSession*) {}
+void EventLoop::setWriteInterest(ClientSession*, bool) {}
+void EventLoop::closeSession(ClientSession*) {}
+void EventLoop::reapClosedSessions() {}
+void EventLoop::checkIdleSessions() {}
+
+#endif
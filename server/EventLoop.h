@@ -0,0 +1,80 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include "ClientSession.h"
+#include "TimerWheel.h"
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+
+class MessageRouter;
+class SessionPool;
+
+// Single-threaded epoll reactor. Each loop owns a set of non-blocking
+// client sessions and drives their reads and writes; the server runs one
+// loop per core instead of two threads per connection. Only available on
+// Linux, use isSupported() before choosing this engine.
+class EventLoop {
+public:
+    EventLoop(MessageRouter* router, SessionPool* sessionPool, const SendQueueLimits& limits,
+              const HeartbeatOptions& heartbeat = HeartbeatOptions());
+    ~EventLoop();
+    
+    static bool isSupported();
+    
+    // With a listening socket, the loop accepts its own connections from
+    // it. The loop owns the socket from then on, even if start() fails.
+    bool start(SocketHandle listenSocket = INVALID_SOCKET_VALUE);
+    void stop();
+    
+    // Thread-safe: hands an accepted socket over to this loop
+    void addConnection(SocketHandle socket);
+    // Thread-safe: asks the loop to flush a session's send queue
+    void requestFlush(ClientSession* session);
+    
+    size_t getSessionCount() const { return sessionCount_; }
+    
+private:
+    void run();
+    void wake();
+    void drainPending();
+    void acceptConnections();
+    void registerSession(SocketHandle socket);
+    void flushSession(ClientSession* session);
+    void setWriteInterest(ClientSession* session, bool enabled);
+    void closeSession(ClientSession* session);
+    void reapClosedSessions();
+    void checkIdleSessions();
+    
+    MessageRouter* router_;
+    SessionPool* sessionPool_;
+    SendQueueLimits limits_;
+    HeartbeatOptions heartbeat_;
+    int epollFd_;
+    int wakeFd_;
+    SocketHandle listenSocket_; // Non-blocking; INVALID_SOCKET_VALUE if the server accepts for us
+    std::atomic<bool> running_;
+    std::atomic<bool> wakePending_;
+    std::atomic<size_t> sessionCount_;
+    std::thread thread_;
+    
+    std::mutex pendingMutex_;
+    std::vector<SocketHandle> pendingSockets_;
+    std::vector<ClientSession*> pendingFlushes_;
+    
+    struct LoopSession {
+        std::shared_ptr<ClientSession> session;
+        bool writeArmed;
+    };
+    
+    // Owned by the loop thread
+    std::unordered_map<ClientSession*, LoopSession> sessions_;
+    std::vector<std::shared_ptr<ClientSession>> closing_;
+    // Each session's next idle check, in HeartbeatOptions::TICK_MS ticks
+    TimerWheel idleTimers_;
+};
+
+#endif // EVENTLOOP_H
@@ -0,0 +1,65 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "../shared/Protocol.h"
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+// A serialized wire frame. Frames are immutable once built, so a broadcast
+// serializes once and every recipient's send queue holds a reference to
+// the same buffer instead of a private copy. Frames are built by FramePool.
+typedef std::shared_ptr<const std::vector<uint8_t>> FramePtr;
+
+// The message type of a serialized frame, without its flag bits
+inline uint16_t frameMessageType(const FramePtr& frame) {
+    if ((*frame)[0] == COMPACT_FRAME_MARKER) {
+        return (*frame)[1];
+    }
+    MessageHeader header;
+    decodeHeader(frame->data(), header);
+    return header.messageType & FRAME_TYPE_MASK;
+}
+
+// One broadcast in each encoding its recipients may have negotiated. Every
+// variant is built once and shared; each session picks the one it
+// supports, falling back to frame.
+struct BroadcastFrames {
+    FramePtr frame;       // v1, understood by every client
+    // Presence broadcasts only: sessions that did not negotiate
+    // FEATURE_PRESENCE get legacy instead of frame. Either may be null to
+    // send that group nothing.
+    FramePtr legacy;
+    bool presence;
+    FramePtr compressed;  // v1 with compressed content, or null
+    FramePtr compact;     // Compact TEXT frame referring to senderId, or null
+    uint32_t senderId;
+    uint32_t traceId;     // Tracer id of the message, 0 if not sampled
+    uint32_t roomId;
+    uint64_t sequence;    // Number in the room's history, 0 if not stored
+    
+    BroadcastFrames(FramePtr f = nullptr)
+        : frame(std::move(f)), presence(false), senderId(0), traceId(0), roomId(0), sequence(0) {}
+};
+
+// Send queue entry: a shared frame plus how much of it this session has
+// already written to its socket. A traced frame also remembers when it
+// was queued.
+struct OutboundFrame {
+    FramePtr frame;
+    size_t offset;
+    uint32_t traceId;
+    uint64_t queuedNs;
+    uint32_t senderId;  // Compact sender a SENDER or compact TEXT frame names
+    FramePtr fallback;  // v1 frame of a compact TEXT frame, for when its
+                        // SENDER frame is dropped first
+    
+    explicit OutboundFrame(FramePtr f, uint32_t trace = 0, uint64_t queued = 0)
+        : frame(std::move(f)), offset(0), traceId(trace), queuedNs(queued), senderId(0) {}
+    
+    const uint8_t* data() const { return frame->data() + offset; }
+    size_t remaining() const { return frame->size() - offset; }
+};
+
+#endif // FRAME_H
@@ -0,0 +1,117 @@
+#include "FramePool.h"
+#include "../shared/Serializer.h"
+#include "../shared/CompactSerializer.h"
+#include <cstring>
+
+constexpr size_t FramePool::SIZE_CLASSES[];
+
+FramePool& FramePool::instance() {
+    // Never destroyed: frames may still be released during static destruction
+    static FramePool* pool = new FramePool();
+    return *pool;
+}
+
+FramePool::FramePool() : acquired_(0), reused_(0), unpooled_(0) {
+}
+
+FramePtr FramePool::copy(const uint8_t* data, size_t size) {
+    std::vector<uint8_t>* buffer = acquire(size);
+    std::memcpy(buffer->data(), data, size);
+    return share(buffer);
+}
+
+FramePtr FramePool::encode(const Message& msg) {
+    std::vector<uint8_t>* buffer = acquire(Serializer::serializedSize(msg));
+    Serializer::serializeInto(msg, buffer->data(), buffer->size());
+    return share(buffer);
+}
+
+FramePtr FramePool::encodeCompressed(const MessageView& view) {
+    std::vector<uint8_t>* buffer = acquire(Serializer::serializedSize(view));
+    size_t size = Serializer::serializeCompressedInto(view, buffer->data(), buffer->size());
+    if (size == 0) {
+        release(buffer);
+        return nullptr;
+    }
+    // Shrinking keeps the capacity, so the buffer returns to its class
+    buffer->resize(size);
+    return share(buffer);
+}
+
+FramePtr FramePool::encodeCompact(const MessageView& view, uint32_t senderId) {
+    std::vector<uint8_t>* buffer = acquire(CompactSerializer::maxTextSize(view));
+    size_t size = CompactSerializer::encodeText(view, senderId, buffer->data(), buffer->size());
+    if (size == 0) {
+        release(buffer);
+        return nullptr;
+    }
+    buffer->resize(size);
+    return share(buffer);
+}
+
+FramePoolStats FramePool::getStats() const {
+    FramePoolStats stats;
+    stats.acquired = acquired_;
+    stats.reused = reused_;
+    stats.unpooled = unpooled_;
+    return stats;
+}
+
+std::vector<uint8_t>* FramePool::acquire(size_t size) {
+    acquired_++;
+    
+    for (size_t i = 0; i < CLASS_COUNT; ++i) {
+        if (size > SIZE_CLASSES[i]) {
+            continue;
+        }
+        
+        SizeClass& sizeClass = classes_[i];
+        std::vector<uint8_t>* buffer = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(sizeClass.mutex);
+            if (!sizeClass.free.empty()) {
+                buffer = sizeClass.free.back();
+                sizeClass.free.pop_back();
+            }
+        }
+        
+        if (buffer) {
+            reused_++;
+        } else {
+            buffer = new std::vector<uint8_t>();
+            buffer->reserve(SIZE_CLASSES[i]);
+        }
+        // Within capacity, so this never reallocates
+        buffer->resize(size);
+        return buffer;
+    }
+    
+    unpooled_++;
+    return new std::vector<uint8_t>(size);
+}
+
+FramePtr FramePool::share(std::vector<uint8_t>* buffer) {
+    return FramePtr(buffer, [this](const std::vector<uint8_t>* frame) {
+        release(const_cast<std::vector<uint8_t>*>(frame));
+    });
+}
+
+void FramePool::release(std::vector<uint8_t>* buffer) {
+    size_t capacity = buffer->capacity();
+    if (capacity >= SIZE_CLASSES[0] && capacity <= SIZE_CLASSES[CLASS_COUNT - 1]) {
+        // The largest class the buffer's capacity can still serve
+        size_t i = CLASS_COUNT - 1;
+        while (capacity < SIZE_CLASSES[i]) {
+            --i;
+        }
+        
+        SizeClass& sizeClass = classes_[i];
+        std::lock_guard<std::mutex> lock(sizeClass.mutex);
+        if (sizeClass.free.size() < MAX_FREE_PER_CLASS) {
+            sizeClass.free.push_back(buffer);
+            return;
+        }
+    }
+    
+    delete buffer;
+}
@@ -0,0 +1,61 @@
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include "Frame.h"
+#include "../shared/Message.h"
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+struct FramePoolStats {
+    uint64_t acquired = 0;  // Frames built through the pool
+    uint64_t reused = 0;    // Of those, served from a recycled buffer
+    uint64_t unpooled = 0;  // Too large for any size class
+};
+
+// Size-classed free lists of frame buffers. A frame built here goes back to
+// its class when the last send queue drops its reference, so steady-state
+// traffic stops hitting the allocator for every message.
+class FramePool {
+public:
+    static FramePool& instance();
+    
+    // Copies an already-encoded frame
+    FramePtr copy(const uint8_t* data, size_t size);
+    // Encodes a message straight into a pooled buffer
+    FramePtr encode(const Message& msg);
+    // Encodes a view with its content compressed; null if that would not
+    // pay off (see Serializer::serializeCompressedInto)
+    FramePtr encodeCompressed(const MessageView& view);
+    // Encodes a TEXT view as a compact frame; null if it has no compact form
+    FramePtr encodeCompact(const MessageView& view, uint32_t senderId);
+    
+    FramePoolStats getStats() const;
+    
+private:
+    FramePool();
+    
+    std::vector<uint8_t>* acquire(size_t size);
+    FramePtr share(std::vector<uint8_t>* buffer);
+    void release(std::vector<uint8_t>* buffer);
+    
+    static constexpr size_t CLASS_COUNT = 5;
+    static constexpr size_t SIZE_CLASSES[CLASS_COUNT] = {256, 1024, 4096, 16 * 1024, 64 * 1024};
+    // Idle buffers kept per class; extra ones are freed
+    static constexpr size_t MAX_FREE_PER_CLASS = 1024;
+    
+    struct SizeClass {
+        std::mutex mutex;
+        std::vector<std::vector<uint8_t>*> free;
+    };
+    
+    SizeClass classes_[CLASS_COUNT];
+    
+    std::atomic<uint64_t> acquired_;
+    std::atomic<uint64_t> reused_;
+    std::atomic<uint64_t> unpooled_;
+};
+
+#endif // FRAMEPOOL_H
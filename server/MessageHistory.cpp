@@ -0,0 +1,138 @@
+#include "MessageHistory.h"
+#include "../shared/Protocol.h"
+
+RoomHistory::RoomHistory(const HistoryLimits& limits, const std::shared_ptr<HistoryTotals>& totals)
+    : limits_(limits), totals_(totals), frames_(INITIAL_CAPACITY), count_(0), lastSequence_(0) {
+    totals_->rooms++;
+    totals_->allocatedBytes += frames_.capacity();
+}
+
+RoomHistory::~RoomHistory() {
+    totals_->rooms--;
+    totals_->messages -= count_;
+    totals_->bytes -= frames_.size();
+    totals_->allocatedBytes -= frames_.capacity();
+}
+
+uint64_t RoomHistory::append(const uint8_t* frame, size_t size) {
+    uint64_t sequence = ++lastSequence_;
+    if (limits_.maxMessages == 0 || size > limits_.maxRoomBytes) {
+        return sequence;
+    }
+    
+    while (count_ > 0 &&
+           (count_ + 1 > limits_.maxMessages ||
+            frames_.size() + size > limits_.maxRoomBytes ||
+            totals_->bytes + size > limits_.maxTotalBytes)) {
+        evictOldest();
+    }
+    // Other rooms hold the whole budget
+    if (totals_->bytes + size > limits_.maxTotalBytes) {
+        totals_->evicted++;
+        return sequence;
+    }
+    
+    size_t capacity = frames_.capacity();
+    frames_.write(frame, size);
+    totals_->allocatedBytes += frames_.capacity() - capacity;
+    
+    count_++;
+    totals_->messages++;
+    totals_->bytes += size;
+    return sequence;
+}
+
+void RoomHistory::copyTo(std::vector<uint8_t>& out) {
+    size_t offset = out.size();
+    out.resize(offset + frames_.size());
+    frames_.peek(0, out.data() + offset, frames_.size());
+    
+    totals_->replays++;
+    totals_->replayedMessages += count_;
+}
+
+void RoomHistory::evictOldest() {
+    uint8_t headerBytes[MESSAGE_HEADER_SIZE];
+    frames_.peek(0, headerBytes, MESSAGE_HEADER_SIZE);
+    MessageHeader header;
+    decodeHeader(headerBytes, header);
+    
+    size_t frameSize = MESSAGE_HEADER_SIZE + header.payloadSize;
+    frames_.consume(frameSize);
+    count_--;
+    totals_->messages--;
+    totals_->bytes -= frameSize;
+    totals_->evicted++;
+}
+
+MessageHistory::MessageHistory(const HistoryLimits& limits)
+    : limits_(limits), totals_(std::make_shared<HistoryTotals>()), idleCount_(0) {
+}
+
+std::shared_ptr<RoomHistory> MessageHistory::createRoom() {
+    return std::make_shared<RoomHistory>(limits_, totals_);
+}
+
+void MessageHistory::retire(const std::string& room, uint32_t roomId,
+                            const std::shared_ptr<RoomHistory>& history) {
+    if (!enabled() || !history) {
+        return;
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(idleMutex_);
+        auto existing = idleByName_.find(room);
+        if (existing != idleByName_.end()) {
+            idle_.erase(existing->second);
+        }
+        idleByName_[room] = idle_.insert(idle_.end(), IdleRoom{room, roomId, history});
+        idleCount_ = idle_.size();
+    }
+    trimIdle(0);
+}
+
+std::shared_ptr<RoomHistory> MessageHistory::reclaim(const std::string& room, uint32_t& roomId) {
+    if (idleCount_ == 0) {
+        return nullptr;
+    }
+    
+    std::lock_guard<std::mutex> lock(idleMutex_);
+    auto it = idleByName_.find(room);
+    if (it == idleByName_.end()) {
+        return nullptr;
+    }
+    std::shared_ptr<RoomHistory> history = std::move(it->second->history);
+    roomId = it->second->roomId;
+    idle_.erase(it->second);
+    idleByName_.erase(it);
+    idleCount_ = idle_.size();
+    return history;
+}
+
+void MessageHistory::trimIdle(size_t size) {
+    if (idleCount_ == 0 || totals_->allocatedBytes + size <= limits_.maxTotalBytes) {
+        return;
+    }
+    
+    // Releasing the last reference gives the history's bytes back to the
+    // totals at once
+    std::lock_guard<std::mutex> lock(idleMutex_);
+    while (!idle_.empty() && totals_->allocatedBytes + size > limits_.maxTotalBytes) {
+        idleByName_.erase(idle_.front().name);
+        idle_.pop_front();
+    }
+    idleCount_ = idle_.size();
+}
+
+HistoryStats MessageHistory::getStats() const {
+    HistoryStats stats;
+    stats.rooms = totals_->rooms;
+    stats.idleRooms = idleCount_;
+    stats.messages = totals_->messages;
+    stats.bytes = totals_->bytes;
+    stats.allocatedBytes = totals_->allocatedBytes;
+    stats.evicted = totals_->evicted;
+    stats.replays = totals_->replays;
+    stats.replayedMessages = totals_->replayedMessages;
+    return stats;
+}
@@ -0,0 +1,116 @@
+#ifndef MESSAGEHISTORY_H
+#define MESSAGEHISTORY_H
+
+#include "../shared/RingBuffer.h"
+#include <vector>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+struct HistoryLimits {
+    size_t maxMessages = 50;                 // Per room; 0 disables history
+    size_t maxRoomBytes = 64 * 1024;         // Per room, as serialized frames
+    size_t maxTotalBytes = 16 * 1024 * 1024; // All rooms together
+};
+
+struct HistoryStats {
+    size_t rooms = 0;
+    size_t idleRooms = 0;      // Kept for rooms that emptied, included in rooms
+    size_t messages = 0;
+    size_t bytes = 0;          // Stored frame bytes
+    size_t allocatedBytes = 0; // Ring capacity held for them
+    uint64_t evicted = 0;      // Dropped to stay within the limits
+    uint64_t replays = 0;
+    uint64_t replayedMessages = 0;
+};
+
+// Counters shared by every room's history
+struct HistoryTotals {
+    std::atomic<size_t> rooms{0};
+    std::atomic<size_t> messages{0};
+    std::atomic<size_t> bytes{0};
+    std::atomic<size_t> allocatedBytes{0};
+    std::atomic<uint64_t> evicted{0};
+    std::atomic<uint64_t> replays{0};
+    std::atomic<uint64_t> replayedMessages{0};
+};
+
+// Recent TEXT frames of one room, kept serialized and packed back to back
+// in a byte ring, so storing a message costs its wire size and replaying
+// the room is a single copy. The oldest frames are evicted once the room
+// exceeds its message or byte limit, or all rooms exceed the total.
+class RoomHistory {
+public:
+    RoomHistory(const HistoryLimits& limits, const std::shared_ptr<HistoryTotals>& totals);
+    ~RoomHistory();
+    
+    // Held by the router while storing a frame, and across replaying the
+    // room and adding a member. A joiner's replay covers every message up
+    // to lastSequence(), and it receives every later one live.
+    std::mutex& mutex() { return mutex_; }
+    
+    // Returns the message's sequence number, which is assigned even if the
+    // limits keep the frame from being stored. Requires mutex().
+    uint64_t append(const uint8_t* frame, size_t size);
+    size_t size() const { return count_; }                   // Requires mutex()
+    uint64_t lastSequence() const { return lastSequence_; }  // Requires mutex()
+    // Appends every stored frame, oldest first, to out. Requires mutex().
+    void copyTo(std::vector<uint8_t>& out);
+    
+private:
+    void evictOldest();
+    
+    // The ring starts small and grows up to the room's byte limit
+    static constexpr size_t INITIAL_CAPACITY = 1024;
+    
+    HistoryLimits limits_;
+    std::shared_ptr<HistoryTotals> totals_;
+    RingBuffer frames_;
+    size_t count_;
+    uint64_t lastSequence_;
+    std::mutex mutex_;
+};
+
+// Creates room histories that share one set of limits and totals. The
+// history of a room that empties is kept, so clients that reconnect still
+// get its context; kept histories are dropped, longest idle first, once
+// the rooms' allocations exceed maxTotalBytes.
+class MessageHistory {
+public:
+    explicit MessageHistory(const HistoryLimits& limits = HistoryLimits());
+    
+    std::shared_ptr<RoomHistory> createRoom();
+    // Keeps the history of an emptied room, with the room's id, which its
+    // stored frames carry
+    void retire(const std::string& room, uint32_t roomId, const std::shared_ptr<RoomHistory>& history);
+    // Hands back a kept history and its room id, or null
+    std::shared_ptr<RoomHistory> reclaim(const std::string& room, uint32_t& roomId);
+    // Drops kept histories until size more bytes fit within maxTotalBytes
+    void trimIdle(size_t size);
+    bool enabled() const { return limits_.maxMessages > 0; }
+    const HistoryLimits& getLimits() const { return limits_; }
+    HistoryStats getStats() const;
+    
+private:
+    struct IdleRoom {
+        std::string name;
+        uint32_t roomId;
+        std::shared_ptr<RoomHistory> history;
+    };
+    
+    HistoryLimits limits_;
+    std::shared_ptr<HistoryTotals> totals_;
+    
+    // Longest idle first
+    std::list<IdleRoom> idle_;
+    std::unordered_map<std::string, std::list<IdleRoom>::iterator> idleByName_;
+    std::atomic<size_t> idleCount_;
+    mutable std::mutex idleMutex_;
+};
+
+#endif // MESSAGEHISTORY_H
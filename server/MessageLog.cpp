@@ -0,0 +1,593 @@
+#include "MessageLog.h"
+#include "../shared/Protocol.h"
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+
+#ifndef _WIN32
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <sys/types.h>
+    #include <dirent.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <cerrno>
+#endif
+
+MessageLog::MessageLog()
+    : logFd_(-1), indexFd_(-1), nextIndexOffset_(0), nextSequence_(1), dirty_(false),
+      queuedBytes_(0), running_(false), records_(0), bytes_(0), writes_(0), syncs_(0),
+      dropped_(0), recovered_(0) {
+}
+
+MessageLog::~MessageLog() {
+    stop();
+}
+
+bool MessageLog::isSupported() {
+#ifndef _WIN32
+    return true;
+#else
+    return false;
+#endif
+}
+
+MessageLogStats MessageLog::getStats() const {
+    MessageLogStats stats;
+    stats.records = records_;
+    stats.bytes = bytes_;
+    stats.writes = writes_;
+    stats.syncs = syncs_;
+    stats.dropped = dropped_;
+    stats.recovered = recovered_;
+    return stats;
+}
+
+#ifndef _WIN32
+
+namespace {
+
+// CRC-32 (IEEE), table-driven
+uint32_t crc32(const uint8_t* data, size_t size) {
+    static const struct Table {
+        uint32_t entries[256];
+        Table() {
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t crc = i;
+                for (int bit = 0; bit < 8; ++bit) {
+                    crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+                }
+                entries[i] = crc;
+            }
+        }
+    } table;
+    
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+// Read-only mapping of a whole file; empty if it is missing or empty
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) : data_(nullptr), size_(0), failed_(false) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            failed_ = errno != ENOENT;
+            return;
+        }
+        
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            failed_ = true;
+        } else if (st.st_size > 0) {
+            void* mapped = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
+                failed_ = true;
+            } else {
+                data_ = static_cast<const uint8_t*>(mapped);
+                size_ = static_cast<size_t>(st.st_size);
+                madvise(mapped, size_, MADV_SEQUENTIAL);
+            }
+        }
+        close(fd);
+    }
+    
+    ~MappedFile() {
+        if (data_) {
+            munmap(const_cast<uint8_t*>(data_), size_);
+        }
+    }
+    
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool failed() const { return failed_; }
+    
+private:
+    const uint8_t* data_;
+    size_t size_;
+    bool failed_;
+};
+
+bool writeAll(int fd, const std::vector<uint8_t>& buffer) {
+    size_t written = 0;
+    while (written < buffer.size()) {
+        ssize_t n = ::write(fd, buffer.data() + written, buffer.size() - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        written += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+int syncData(int fd) {
+#ifdef __APPLE__
+    return fsync(fd);
+#else
+    return fdatasync(fd);
+#endif
+}
+
+} // namespace
+
+bool MessageLog::open(const std::string& dir, const MessageLogOptions& options) {
+    dir_ = dir;
+    options_ = options;
+    options_.maxSegments = std::max<size_t>(1, options_.maxSegments);
+    segments_.clear();
+    
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        std::cerr << "Failed to create log directory " << dir << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    
+    DIR* handle = opendir(dir.c_str());
+    if (!handle) {
+        std::cerr << "Failed to open log directory " << dir << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    while (dirent* entry = readdir(handle)) {
+        // Segments are named by their 20-digit base sequence
+        std::string name = entry->d_name;
+        if (name.size() != 24 || name.compare(20, 4, ".log") != 0 ||
+            !std::all_of(name.begin(), name.begin() + 20,
+                         [](char c) { return c >= '0' && c <= '9'; })) {
+            continue;
+        }
+        
+        Segment segment;
+        segment.baseSequence = std::strtoull(name.c_str(), nullptr, 10);
+        struct stat st;
+        if (stat(segmentPath(segment.baseSequence, ".log").c_str(), &st) != 0) {
+            continue;
+        }
+        segment.size = static_cast<size_t>(st.st_size);
+        segments_.push_back(segment);
+    }
+    closedir(handle);
+    
+    std::sort(segments_.begin(), segments_.end(),
+              [](const Segment& a, const Segment& b) { return a.baseSequence < b.baseSequence; });
+    
+    nextSequence_ = 1;
+    nextIndexOffset_ = 0;
+    if (segments_.empty()) {
+        return true;
+    }
+    
+    // Only the newest segment can end in a torn record: validate it from
+    // its last indexed record on
+    Segment& newest = segments_.back();
+    std::vector<std::pair<uint64_t, size_t>> index = readIndex(newest.baseSequence);
+    while (!index.empty() && index.back().second >= newest.size) {
+        index.pop_back();
+    }
+    
+    size_t offset = index.empty() ? 0 : index.back().second;
+    uint64_t lastSequence = (index.empty() ? newest.baseSequence : index.back().first) - 1;
+    uint64_t count = 0;
+    size_t validSize = 0;
+    if (!scanSegment(newest, offset, nullptr, validSize, lastSequence, count)) {
+        std::cerr << "Failed to read " << segmentPath(newest.baseSequence, ".log") << std::endl;
+        return false;
+    }
+    
+    if (validSize < newest.size) {
+        std::string path = segmentPath(newest.baseSequence, ".log");
+        std::cerr << "Message log: dropping " << newest.size - validSize
+                  << " bytes of torn records from " << path << std::endl;
+        if (truncate(path.c_str(), static_cast<off_t>(validSize)) != 0) {
+            std::cerr << "Failed to truncate " << path << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        newest.size = validSize;
+    }
+    
+    // Drop index entries that point at or past the cut
+    while (!index.empty() && index.back().second >= validSize) {
+        index.pop_back();
+    }
+    if (truncate(segmentPath(newest.baseSequence, ".idx").c_str(),
+                 static_cast<off_t>(index.size() * INDEX_ENTRY_SIZE)) != 0 && errno != ENOENT) {
+        std::cerr << "Failed to truncate index of " << segmentPath(newest.baseSequence, ".log") << std::endl;
+        return false;
+    }
+    
+    nextSequence_ = lastSequence + 1;
+    nextIndexOffset_ = index.empty() ? 0 : index.back().second + INDEX_INTERVAL_BYTES;
+    return true;
+}
+
+uint64_t MessageLog::recover(size_t maxBytes, const RecoverCallback& callback) {
+    // Walk back from the newest segment until the window is covered
+    size_t first = segments_.size();
+    size_t startOffset = 0;
+    size_t needed = maxBytes;
+    while (first > 0 && needed > 0) {
+        const Segment& segment = segments_[--first];
+        if (segment.size > needed) {
+            // Start at the first indexed record inside the window
+            size_t target = segment.size - needed;
+            startOffset = segment.size;
+            for (const auto& entry : readIndex(segment.baseSequence)) {
+                if (entry.second >= target) {
+                    startOffset = entry.second;
+                    break;
+                }
+            }
+            break;
+        }
+        needed -= segment.size;
+    }
+    
+    uint64_t count = 0;
+    for (size_t i = first; i < segments_.size(); ++i) {
+        size_t end = 0;
+        uint64_t lastSequence = 0;
+        if (!scanSegment(segments_[i], i == first ? startOffset : 0, &callback, end, lastSequence, count)) {
+            std::cerr << "Failed to read " << segmentPath(segments_[i].baseSequence, ".log") << std::endl;
+        }
+    }
+    
+    recovered_ += count;
+    return count;
+}
+
+bool MessageLog::start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_ || dir_.empty()) {
+        return false;
+    }
+    
+    running_ = true;
+    thread_ = std::thread(&MessageLog::writerThread, this);
+    return true;
+}
+
+void MessageLog::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!running_) {
+            return;
+        }
+        running_ = false;
+    }
+    cv_.notify_all();
+    
+    // The writer drains the queue and syncs before it exits
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    closeActiveSegment();
+}
+
+void MessageLog::append(const std::string& room, const FramePtr& frame) {
+    size_t size = room.size() + frame->size();
+    bool wasEmpty;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!running_ || queuedBytes_ + size > options_.maxPendingBytes) {
+            dropped_++;
+            return;
+        }
+        wasEmpty = queue_.empty();
+        queue_.push_back(PendingRecord{room, frame});
+        queuedBytes_ += size;
+    }
+    
+    if (wasEmpty) {
+        cv_.notify_one();
+    }
+}
+
+void MessageLog::writerThread() {
+    const std::chrono::milliseconds syncInterval(options_.syncIntervalMs);
+    std::chrono::steady_clock::time_point lastSync = std::chrono::steady_clock::now();
+    std::deque<PendingRecord> batch;
+    
+    while (true) {
+        bool stopping;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            auto ready = [this] { return !running_ || !queue_.empty(); };
+            if (dirty_ && syncInterval.count() > 0) {
+                // Unsynced data: wake up for the sync deadline at the latest
+                cv_.wait_until(lock, lastSync + syncInterval, ready);
+            } else {
+                cv_.wait(lock, ready);
+            }
+            batch.swap(queue_);
+            queuedBytes_ = 0;
+            stopping = !running_;
+        }
+        
+        if (!batch.empty()) {
+            writeBatch(batch);
+            batch.clear();
+        }
+        
+        // Group commit: one sync covers every batch written since the last
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (dirty_ && (stopping || syncInterval.count() == 0 || now - lastSync >= syncInterval)) {
+            sync();
+            lastSync = now;
+        }
+        
+        if (stopping) {
+            break;
+        }
+    }
+}
+
+bool MessageLog::writeBatch(std::deque<PendingRecord>& batch) {
+    if (logFd_ < 0) {
+        if (segments_.empty() || segments_.back().size >= options_.segmentBytes) {
+            segments_.push_back(Segment{nextSequence_, 0});
+            nextIndexOffset_ = 0;
+        }
+        if (!openActiveSegment()) {
+            dropped_ += batch.size();
+            return false;
+        }
+    }
+    
+    recordBuffer_.clear();
+    indexBuffer_.clear();
+    size_t offset = segments_.back().size;
+    size_t buffered = 0;
+    size_t written = 0;
+    
+    for (const PendingRecord& record : batch) {
+        size_t roomSize = std::min<size_t>(record.room.size(), UINT16_MAX);
+        size_t length = RECORD_FIXED_SIZE + roomSize + record.frame->size();
+        
+        if (offset > 0 && offset + RECORD_PREFIX_SIZE + length > options_.segmentBytes) {
+            if (!flushBuffers(buffered)) {
+                dropped_ += batch.size() - written;
+                return false;
+            }
+            written += buffered;
+            if (!rollSegment()) {
+                dropped_ += batch.size() - written;
+                return false;
+            }
+            offset = 0;
+            buffered = 0;
+        }
+        
+        if (offset >= nextIndexOffset_) {
+            size_t entry = indexBuffer_.size();
+            indexBuffer_.resize(entry + INDEX_ENTRY_SIZE);
+            writeLE64(indexBuffer_.data() + entry, nextSequence_);
+            writeLE64(indexBuffer_.data() + entry + 8, offset);
+            nextIndexOffset_ = offset + INDEX_INTERVAL_BYTES;
+        }
+        
+        size_t start = recordBuffer_.size();
+        recordBuffer_.resize(start + RECORD_PREFIX_SIZE + length);
+        uint8_t* out = recordBuffer_.data() + start;
+        uint8_t* body = out + RECORD_PREFIX_SIZE;
+        writeLE64(body, nextSequence_);
+        writeLE16(body + 8, static_cast<uint16_t>(roomSize));
+        std::memcpy(body + RECORD_FIXED_SIZE, record.room.data(), roomSize);
+        std::memcpy(body + RECORD_FIXED_SIZE + roomSize, record.frame->data(), record.frame->size());
+        writeLE32(out, static_cast<uint32_t>(length));
+        writeLE32(out + 4, crc32(body, length));
+        
+        offset += RECORD_PREFIX_SIZE + length;
+        nextSequence_++;
+        buffered++;
+    }
+    
+    if (!flushBuffers(buffered)) {
+        dropped_ += batch.size() - written;
+        return false;
+    }
+    return true;
+}
+
+bool MessageLog::flushBuffers(size_t records) {
+    if (recordBuffer_.empty()) {
+        return true;
+    }
+    
+    if (!writeAll(logFd_, recordBuffer_)) {
+        std::cerr << "Message log write failed: " << std::strerror(errno) << std::endl;
+        // Drop whatever part made it, so the segment ends on a record boundary
+        if (ftruncate(logFd_, static_cast<off_t>(segments_.back().size)) != 0) {
+            std::cerr << "Failed to truncate message log segment" << std::endl;
+        }
+        recordBuffer_.clear();
+        indexBuffer_.clear();
+        return false;
+    }
+    
+    // The index is only a hint: open() validates the data it points at
+    if (!indexBuffer_.empty() && !writeAll(indexFd_, indexBuffer_)) {
+        std::cerr << "Message log index write failed: " << std::strerror(errno) << std::endl;
+    }
+    
+    segments_.back().size += recordBuffer_.size();
+    records_ += records;
+    bytes_ += recordBuffer_.size();
+    writes_++;
+    dirty_ = true;
+    recordBuffer_.clear();
+    indexBuffer_.clear();
+    return true;
+}
+
+bool MessageLog::openActiveSegment() {
+    const Segment& active = segments_.back();
+    std::string logPath = segmentPath(active.baseSequence, ".log");
+    logFd_ = ::open(logPath.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    indexFd_ = ::open(segmentPath(active.baseSequence, ".idx").c_str(),
+                      O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (logFd_ < 0 || indexFd_ < 0) {
+        std::cerr << "Failed to open " << logPath << ": " << std::strerror(errno) << std::endl;
+        closeActiveSegment();
+        return false;
+    }
+    
+    // Make a new segment's directory entry durable
+    if (active.size == 0) {
+        int dirFd = ::open(dir_.c_str(), O_RDONLY | O_CLOEXEC);
+        if (dirFd >= 0) {
+            fsync(dirFd);
+            close(dirFd);
+        }
+    }
+    return true;
+}
+
+bool MessageLog::rollSegment() {
+    closeActiveSegment();
+    segments_.push_back(Segment{nextSequence_, 0});
+    nextIndexOffset_ = 0;
+    removeOldSegments();
+    return openActiveSegment();
+}
+
+void MessageLog::closeActiveSegment() {
+    if (dirty_) {
+        sync();
+    }
+    if (logFd_ >= 0) {
+        close(logFd_);
+        logFd_ = -1;
+    }
+    if (indexFd_ >= 0) {
+        close(indexFd_);
+        indexFd_ = -1;
+    }
+}
+
+void MessageLog::sync() {
+    // Only the data is synced; a stale index is repaired on open()
+    if (logFd_ >= 0 && syncData(logFd_) != 0) {
+        std::cerr << "Message log sync failed: " << std::strerror(errno) << std::endl;
+    }
+    syncs_++;
+    dirty_ = false;
+}
+
+void MessageLog::removeOldSegments() {
+    while (segments_.size() > options_.maxSegments) {
+        uint64_t baseSequence = segments_.front().baseSequence;
+        unlink(segmentPath(baseSequence, ".log").c_str());
+        unlink(segmentPath(baseSequence, ".idx").c_str());
+        segments_.erase(segments_.begin());
+    }
+}
+
+std::string MessageLog::segmentPath(uint64_t baseSequence, const char* extension) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%020llu", static_cast<unsigned long long>(baseSequence));
+    return dir_ + "/" + name + extension;
+}
+
+std::vector<std::pair<uint64_t, size_t>> MessageLog::readIndex(uint64_t baseSequence) const {
+    std::vector<std::pair<uint64_t, size_t>> entries;
+    MappedFile file(segmentPath(baseSequence, ".idx"));
+    size_t count = file.size() / INDEX_ENTRY_SIZE;
+    entries.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        const uint8_t* entry = file.data() + i * INDEX_ENTRY_SIZE;
+        entries.emplace_back(readLE64(entry), static_cast<size_t>(readLE64(entry + 8)));
+    }
+    return entries;
+}
+
+bool MessageLog::scanSegment(const Segment& segment, size_t offset, const RecoverCallback* callback,
+                             size_t& end, uint64_t& lastSequence, uint64_t& count) const {
+    MappedFile file(segmentPath(segment.baseSequence, ".log"));
+    if (file.failed()) {
+        return false;
+    }
+    
+    const uint8_t* data = file.data();
+    size_t size = std::min(file.size(), segment.size);
+    while (offset + RECORD_PREFIX_SIZE <= size) {
+        uint32_t length = readLE32(data + offset);
+        if (length < RECORD_FIXED_SIZE || length > size - offset - RECORD_PREFIX_SIZE) {
+            break;
+        }
+        
+        const uint8_t* body = data + offset + RECORD_PREFIX_SIZE;
+        if (crc32(body, length) != readLE32(data + offset + 4)) {
+            break;
+        }
+        
+        uint16_t roomSize = readLE16(body + 8);
+        if (RECORD_FIXED_SIZE + roomSize > length) {
+            break;
+        }
+        
+        if (callback) {
+            std::string room(reinterpret_cast<const char*>(body + RECORD_FIXED_SIZE), roomSize);
+            const uint8_t* frame = body + RECORD_FIXED_SIZE + roomSize;
+            (*callback)(room, frame, length - RECORD_FIXED_SIZE - roomSize);
+        }
+        lastSequence = readLE64(body);
+        count++;
+        offset += RECORD_PREFIX_SIZE + length;
+    }
+    
+    end = std::min(offset, size);
+    return true;
+}
+
+#else
+
+bool MessageLog::open(const std::string& dir, const MessageLogOptions&) {
+    std::cerr << "Message log not supported on this platform, not opening " << dir << std::endl;
+    return false;
+}
+
+uint64_t MessageLog::recover(size_t, const RecoverCallback&) {
+    return 0;
+}
+
+bool MessageLog::start() {
+    return false;
+}
+
+void MessageLog::stop() {
+}
+
+void MessageLog::append(const std::string&, const FramePtr&) {
+}
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef MESSAGELOG_H
+#define MESSAGELOG_H
+
+#include "Frame.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+struct MessageLogOptions {
+    size_t segmentBytes = 64 * 1024 * 1024;    // Roll to a new segment past this size
+    size_t maxSegments = 16;                    // Older segments are deleted
+    unsigned int syncIntervalMs = 20;           // Group-commit window; 0 syncs every batch
+    size_t maxPendingBytes = 64 * 1024 * 1024;  // Records queued beyond this are dropped
+};
+
+struct MessageLogStats {
+    uint64_t records = 0;
+    uint64_t bytes = 0;
+    uint64_t writes = 0;    // Batches written, one write call each
+    uint64_t syncs = 0;
+    uint64_t dropped = 0;   // Rejected because the writer fell behind
+    uint64_t recovered = 0;
+};
+
+// Durable, append-only log of routed messages. Records go to size-rolled
+// segment files named after their first sequence number, each with a
+// sparse index of (sequence, offset) pairs every INDEX_INTERVAL_BYTES.
+// append() only queues: a writer thread writes each batch with one call
+// and syncs at most once per sync interval, so routing never waits on
+// disk. POSIX only, use isSupported() first.
+//
+// Record layout (little-endian): u32 length of the rest, u32 CRC-32 of
+// the rest, u64 sequence, u16 room name length, room name, frame bytes.
+class MessageLog {
+public:
+    typedef std::function<void(const std::string& room, const uint8_t* frame, size_t size)> RecoverCallback;
+    
+    MessageLog();
+    ~MessageLog();
+    
+    static bool isSupported();
+    
+    // Opens or creates dir and validates the newest segment, cutting off a
+    // record torn by a crash
+    bool open(const std::string& dir, const MessageLogOptions& options = MessageLogOptions());
+    // Hands the records in roughly the last maxBytes of the log to
+    // callback, oldest first, reading the segments through mmap. Call
+    // between open() and start(). Returns the number of records.
+    uint64_t recover(size_t maxBytes, const RecoverCallback& callback);
+    bool start();
+    // Writes and syncs everything queued, then stops the writer
+    void stop();
+    
+    // Queues a frame for the writer; the room is "" for the lobby
+    void append(const std::string& room, const FramePtr& frame);
+    
+    MessageLogStats getStats() const;
+    
+private:
+    struct Segment {
+        uint64_t baseSequence;
+        size_t size;
+    };
+    
+    struct PendingRecord {
+        std::string room;
+        FramePtr frame;
+    };
+    
+    void writerThread();
+    bool writeBatch(std::deque<PendingRecord>& batch);
+    bool openActiveSegment();
+    bool rollSegment();
+    void closeActiveSegment();
+    bool flushBuffers(size_t records);
+    void sync();
+    void removeOldSegments();
+    std::string segmentPath(uint64_t baseSequence, const char* extension) const;
+    
+    // Record boundaries listed in a segment's index
+    std::vector<std::pair<uint64_t, size_t>> readIndex(uint64_t baseSequence) const;
+    // Parses records from offset on, stopping at the first invalid one;
+    // end is set just past the last valid record. Returns false if the
+    // segment cannot be read at all.
+    bool scanSegment(const Segment& segment, size_t offset, const RecoverCallback* callback,
+                     size_t& end, uint64_t& lastSequence, uint64_t& count) const;
+    
+    static constexpr size_t INDEX_INTERVAL_BYTES = 4096;
+    static constexpr size_t INDEX_ENTRY_SIZE = 16;
+    static constexpr size_t RECORD_PREFIX_SIZE = 8;   // Length and CRC
+    static constexpr size_t RECORD_FIXED_SIZE = 10;   // Sequence and room name length
+    
+    std::string dir_;
+    MessageLogOptions options_;
+    
+    // Writer state, owned by open()/recover() and then by the writer thread
+    std::vector<Segment> segments_; // Oldest first; the last one is appended to
+    int logFd_;
+    int indexFd_;
+    size_t nextIndexOffset_; // Index the first record starting at or past this
+    uint64_t nextSequence_;
+    bool dirty_;             // Written since the last sync
+    std::vector<uint8_t> recordBuffer_;
+    std::vector<uint8_t> indexBuffer_;
+    
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<PendingRecord> queue_;
+    size_t queuedBytes_;     // Guarded by mutex_
+    bool running_;           // Guarded by mutex_
+    
+    std::atomic<uint64_t> records_;
+    std::atomic<uint64_t> bytes_;
+    std::atomic<uint64_t> writes_;
+    std::atomic<uint64_t> syncs_;
+    std::atomic<uint64_t> dropped_;
+    std::atomic<uint64_t> recovered_;
+};
+
+#endif // MESSAGELOG_H
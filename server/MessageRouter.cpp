@@ -1,103 +1,598 @@
 #include "MessageRouter.h"
+#include "FramePool.h"
+#include "Tracer.h"
 #include "../shared/Serializer.h"
 #include "../shared/Message.h"
 #include <iostream>
 #include <algorithm>
+#include <chrono>
 
-MessageRouter::MessageRouter() {
+MessageRouter::MessageRouter(size_t shardCount, unsigned int presenceWindowMs,
+                             const HistoryLimits& historyLimits)
+    : presenceVersion_(0), presenceStopping_(false), presenceWindowMs_(presenceWindowMs),
+      presenceChanges_(0), presenceBroadcasts_(0), nextRoomId_(LOBBY_ROOM_ID + 1),
+      history_(historyLimits), lobbyHistory_(history_.createRoom()), log_(nullptr),
+      supportedFeatures_(FEATURE_COMPRESSION | FEATURE_COMPACT_ENCODING | FEATURE_PRESENCE), compressedFrames_(0), compressionInputBytes_(0),
+      compressionOutputBytes_(0), compressionSkipped_(0), compressionDecoded_(0),
+      compactFrames_(0), compactInputBytes_(0), compactOutputBytes_(0) {
+    std::shared_ptr<Membership> membership = std::make_shared<Membership>();
+    membership->clients = ShardedSessions(shardCount);
+    membership->lobby = ShardedSessions(shardCount);
+    membership_ = std::move(membership);
+    
+    for (size_t i = 0; i < shardCount; ++i) {
+        std::unique_ptr<RouterShard> shard(new RouterShard());
+        shard->start();
+        shards_.push_back(std::move(shard));
+    }
+    
+    if (presenceWindowMs_ > 0) {
+        presenceThread_ = std::thread(&MessageRouter::presenceThread, this);
+    }
 }
 
 MessageRouter::~MessageRouter() {
-    std::lock_guard<std::mutex> lock(clientsMutex_);
-    clients_.clear();
-    usernameToClient_.clear();
+    {
+        std::lock_guard<std::mutex> lock(presenceMutex_);
+        presenceStopping_ = true;
+    }
+    presenceCv_.notify_all();
+    if (presenceThread_.joinable()) {
+        presenceThread_.join();
+    }
+    
+    for (auto& shard : shards_) {
+        shard->stop();
+    }
+    std::atomic_store(&membership_, std::make_shared<const Membership>());
+}
+
+std::shared_ptr<const MessageRouter::Membership> MessageRouter::loadMembership() const {
+    return std::atomic_load(&membership_);
 }
 
-void MessageRouter::addClient(ClientSession* client) {
-    std::lock_guard<std::mutex> lock(clientsMutex_);
-    clients_.push_back(client);
+template <typename Update>
+void MessageRouter::updateMembership(Update update) {
+    std::lock_guard<std::mutex> lock(membershipMutex_);
+    std::shared_ptr<Membership> next = std::make_shared<Membership>(*membership_);
+    update(*next);
+    std::atomic_store(&membership_, std::shared_ptr<const Membership>(std::move(next)));
+}
+
+void MessageRouter::addClient(const std::shared_ptr<ClientSession>& client) {
+    updateMembership([&](Membership& membership) {
+        membership.clients.add(client);
+    });
 }
 
 void MessageRouter::removeClient(ClientSession* client) {
-    std::lock_guard<std::mutex> lock(clientsMutex_);
-    clients_.erase(std::remove(clients_.begin(), clients_.end(), client), clients_.end());
-    if (client && !client->getUsername().empty()) {
-        usernameToClient_.erase(client->getUsername());
+    if (!client) return;
+    
+    std::lock_guard<std::mutex> presenceLock(presenceMutex_);
+    std::string username = client->getUsername();
+    bool wentOffline = false;
+    updateMembership([&](Membership& membership) {
+        membership.clients.remove(client);
+        membership.lobby.remove(client);
+        
+        // Only drop the name if it still maps to this session
+        auto it = membership.usernameToClient.find(username);
+        if (it != membership.usernameToClient.end() && it->second == client) {
+            membership.usernameToClient.erase(it);
+            wentOffline = true;
+        }
+        
+        auto rooms = membership.sessionRooms.find(client);
+        if (rooms != membership.sessionRooms.end()) {
+            std::vector<uint32_t> roomIds = rooms->second;
+            for (uint32_t roomId : roomIds) {
+                removeFromRoom(membership, client, roomId);
+            }
+        }
+    });
+    
+    if (wentOffline) {
+        recordPresence(username, false, nullptr);
     }
 }
 
 void MessageRouter::routeMessage(ClientSession* sender, const Message& msg) {
     if (msg.type == MessageType::TEXT) {
-        // Broadcast text message to all clients
-        broadcastMessage(msg, sender);
+        // Broadcast text message to the room it was sent to
+        if (checkRoomSender(sender, msg.roomId)) {
+            relayText(sender, msg.roomId, FramePool::instance().encode(msg));
+        }
+    } else if (msg.type == MessageType::ROOM_JOIN) {
+        handleRoomJoin(sender, msg);
+    } else if (msg.type == MessageType::ROOM_PART) {
+        handleRoomPart(sender, msg);
     } else if (msg.type == MessageType::USER_LIST) {
-        // Send user list to requesting client
+        // Send a presence snapshot to the requesting client, e.g. to resync
+        // after it detected a gap in the deltas
         if (sender) {
-            Message userListMsg(MessageType::USER_LIST, "SERVER", "");
-            std::vector<std::string> users = getUserList();
-            std::string userListStr;
-            for (size_t i = 0; i < users.size(); ++i) {
-                userListStr += users[i];
-                if (i < users.size() - 1) {
-                    userListStr += ",";
+            std::lock_guard<std::mutex> presenceLock(presenceMutex_);
+            sendUserListSnapshot(sender);
+        }
+    }
+}
+
+void MessageRouter::routeFrame(ClientSession* sender, const MessageView& view,
+                               const uint8_t* frame, size_t frameSize) {
+    if (view.type == MessageType::TEXT) {
+        if (!checkRoomSender(sender, view.roomId)) {
+            return;
+        }
+        if (!view.compressed) {
+            // The received bytes are already a valid frame: copy once, relay as is
+            relayText(sender, view.roomId, FramePool::instance().copy(frame, frameSize));
+            return;
+        }
+        
+        // Compressed by the sender: relay those bytes to the recipients that
+        // negotiated compression and decode once for everyone else
+        Message msg;
+        if (!Serializer::toMessage(view, msg)) {
+            if (sender) {
+                sendError(sender, ProtocolError::INVALID_MESSAGE, "Invalid compressed message");
+            }
+            return;
+        }
+        compressionDecoded_++;
+        BroadcastFrames frames(FramePool::instance().encode(msg));
+        frames.compressed = FramePool::instance().copy(frame, frameSize);
+        relayText(sender, view.roomId, frames);
+        return;
+    }
+    
+    Message msg;
+    if (Serializer::toMessage(view, msg)) {
+        routeMessage(sender, msg);
+    }
+}
+
+void MessageRouter::broadcastMessage(const Message& msg, ClientSession* exclude) {
+    // One pooled buffer per broadcast, shared by every recipient
+    broadcastFrame(FramePool::instance().encode(msg), exclude);
+}
+
+void MessageRouter::broadcastFrame(const BroadcastFrames& frames, ClientSession* exclude) {
+    // Iterate a snapshot without locking; joins and leaves are not blocked
+    std::shared_ptr<const Membership> membership = loadMembership();
+    deliver(membership->clients, frames, exclude);
+}
+
+void MessageRouter::broadcastToRoom(uint32_t roomId, const BroadcastFrames& frames,
+                                    ClientSession* exclude) {
+    std::shared_ptr<const Membership> membership = loadMembership();
+    if (roomId == LOBBY_ROOM_ID) {
+        deliver(membership->lobby, frames, exclude);
+        return;
+    }
+    
+    auto it = membership->rooms.find(roomId);
+    if (it == membership->rooms.end()) {
+        return;
+    }
+    
+    deliver(it->second->members, frames, exclude);
+}
+
+void MessageRouter::deliver(const ShardedSessions& recipients, const BroadcastFrames& frames,
+                            ClientSession* exclude) {
+    for (size_t i = 0; i < recipients.shardCount(); ++i) {
+        const SessionListPtr& part = recipients.part(i);
+        if (part->empty()) {
+            continue;
+        }
+        
+        if (!shards_.empty()) {
+            shards_[i]->post(frames, part, exclude);
+            continue;
+        }
+        
+        for (const std::shared_ptr<ClientSession>& client : *part) {
+            if (client.get() != exclude && client->isConnected()) {
+                client->sendBroadcast(frames);
+            }
+        }
+    }
+}
+
+uint32_t MessageRouter::joinRoom(ClientSession* client, const std::string& name) {
+    while (true) {
+        // Hold the existing room's history lock across the membership
+        // change, so no message falls between the replay and live delivery
+        std::shared_ptr<RoomHistory> history;
+        {
+            std::shared_ptr<const Membership> membership = loadMembership();
+            auto existing = membership->roomIds.find(name);
+            if (existing != membership->roomIds.end()) {
+                history = membership->rooms.at(existing->second)->history;
+            }
+        }
+        std::unique_lock<std::mutex> historyLock;
+        if (history) {
+            historyLock = std::unique_lock<std::mutex>(history->mutex());
+        }
+        
+        uint32_t joinedId = LOBBY_ROOM_ID;
+        bool raced = false;
+        bool rejoined = false;
+        updateMembership([&](Membership& membership) {
+            // Rooms may only reference sessions the snapshot keeps alive
+            std::shared_ptr<ClientSession> member = membership.clients.find(client);
+            if (!member) {
+                return;
+            }
+            
+            // The room was created or replaced since we looked it up
+            auto existing = membership.roomIds.find(name);
+            std::shared_ptr<RoomHistory> current;
+            if (existing != membership.roomIds.end()) {
+                current = membership.rooms[existing->second]->history;
+            }
+            if (current != history) {
+                raced = true;
+                return;
+            }
+            
+            std::vector<uint32_t>& joined = membership.sessionRooms[client];
+            if (existing != membership.roomIds.end() &&
+                std::find(joined.begin(), joined.end(), existing->second) != joined.end()) {
+                joinedId = existing->second;
+                rejoined = true;
+                return;
+            }
+            if (joined.size() >= MAX_ROOMS_PER_SESSION) {
+                return;
+            }
+            
+            std::shared_ptr<Room> room;
+            uint32_t roomId;
+            if (existing != membership.roomIds.end()) {
+                roomId = existing->second;
+                room = std::make_shared<Room>(*membership.rooms[roomId]);
+            } else {
+                // A room that emptied earlier keeps its id and history
+                room = std::make_shared<Room>();
+                room->history = history_.reclaim(name, roomId);
+                if (!room->history) {
+                    roomId = nextRoomId_++;
+                    room->history = history_.createRoom();
+                }
+                room->name = name;
+                room->members = ShardedSessions(shards_.size());
+                membership.roomIds[name] = roomId;
+                
+                // The room is not published yet, so its lock is at most held
+                // briefly by a late message to the room it was retired from
+                history = room->history;
+                historyLock = std::unique_lock<std::mutex>(history->mutex());
+                
+                // Messages from a previous run, stamped with the new id
+                auto restored = restoredHistory_.find(name);
+                if (restored != restoredHistory_.end()) {
+                    for (Message& message : restored->second) {
+                        message.roomId = roomId;
+                        FramePtr frame = FramePool::instance().encode(message);
+                        room->history->append(frame->data(), frame->size());
+                    }
+                    restoredHistory_.erase(restored);
                 }
             }
-            userListMsg.content = userListStr;
             
-            std::vector<uint8_t> data = Serializer::serialize(userListMsg);
-            sender->sendMessage(data);
+            // Queued before the snapshot naming the new member is published.
+            // The confirmation goes first so the client knows the room's id
+            // before any replayed message tagged with it.
+            Message confirmation(MessageType::ROOM_JOIN, client->getUsername(), name);
+            confirmation.roomId = roomId;
+            replayHistory(client, roomId, *history, "#" + name,
+                          FramePool::instance().encode(confirmation));
+            
+            room->members.add(member);
+            membership.rooms[roomId] = std::move(room);
+            joined.push_back(roomId);
+            joinedId = roomId;
+        });
+        if (raced) {
+            continue;
         }
+        if (rejoined) {
+            // Already a member: just confirm, it has the history
+            Message confirmation(MessageType::ROOM_JOIN, client->getUsername(), name);
+            confirmation.roomId = joinedId;
+            client->sendMessage(FramePool::instance().encode(confirmation));
+        }
+        return joinedId;
     }
 }
 
-void MessageRouter::broadcastMessage(const Message& msg, ClientSession* exclude) {
-    std::vector<uint8_t> data = Serializer::serialize(msg);
+bool MessageRouter::partRoom(ClientSession* client, uint32_t roomId) {
+    bool parted = false;
+    updateMembership([&](Membership& membership) {
+        parted = removeFromRoom(membership, client, roomId);
+    });
+    return parted;
+}
+
+size_t MessageRouter::getRoomCount() const {
+    return loadMembership()->rooms.size();
+}
+
+bool MessageRouter::removeFromRoom(Membership& membership, ClientSession* client, uint32_t roomId) {
+    auto joined = membership.sessionRooms.find(client);
+    if (joined == membership.sessionRooms.end()) {
+        return false;
+    }
+    
+    std::vector<uint32_t>& ids = joined->second;
+    auto id = std::find(ids.begin(), ids.end(), roomId);
+    if (id == ids.end()) {
+        return false;
+    }
+    ids.erase(id);
+    if (ids.empty()) {
+        membership.sessionRooms.erase(joined);
+    }
+    
+    auto it = membership.rooms.find(roomId);
+    if (it == membership.rooms.end()) {
+        return true;
+    }
+    
+    std::shared_ptr<Room> room = std::make_shared<Room>(*it->second);
+    room->members.remove(client);
+    
+    if (room->members.empty()) {
+        history_.retire(room->name, roomId, room->history);
+        membership.roomIds.erase(room->name);
+        membership.rooms.erase(it);
+    } else {
+        it->second = std::move(room);
+    }
+    return true;
+}
+
+void MessageRouter::handleRoomJoin(ClientSession* sender, const Message& msg) {
+    if (!sender) return;
+    
+    const std::string& name = msg.content;
+    if (name.empty() || name.size() > MAX_ROOM_NAME_LENGTH) {
+        sendError(sender, ProtocolError::INVALID_ROOM, "Invalid room name");
+        return;
+    }
+    
+    std::string username = sender->getUsername();
+    if (username.empty()) {
+        sendError(sender, ProtocolError::UNAUTHORIZED, "Join the chat before joining a room");
+        return;
+    }
     
-    std::lock_guard<std::mutex> lock(clientsMutex_);
-    for (ClientSession* client : clients_) {
-        if (client != exclude && client->isConnected()) {
-            client->sendMessage(data);
+    uint32_t roomId = joinRoom(sender, name);
+    if (roomId == LOBBY_ROOM_ID) {
+        sendError(sender, ProtocolError::INVALID_ROOM, "Cannot join room " + name);
+        return;
+    }
+    
+    // The joiner already has its confirmation; tell the other members
+    Message joined(MessageType::ROOM_JOIN, username, name);
+    joined.roomId = roomId;
+    broadcastToRoom(roomId, FramePool::instance().encode(joined), sender);
+}
+
+void MessageRouter::handleRoomPart(ClientSession* sender, const Message& msg) {
+    if (!sender) return;
+    
+    std::shared_ptr<const Membership> membership = loadMembership();
+    auto it = membership->rooms.find(msg.roomId);
+    if (msg.roomId == LOBBY_ROOM_ID || it == membership->rooms.end()) {
+        sendError(sender, ProtocolError::INVALID_ROOM, "Unknown room");
+        return;
+    }
+    
+    // Built before parting so the leaver gets its own confirmation
+    Message parted(MessageType::ROOM_PART, sender->getUsername(), it->second->name);
+    parted.roomId = msg.roomId;
+    FramePtr frame = FramePool::instance().encode(parted);
+    
+    ShardedSessions members = it->second->members;
+    if (!partRoom(sender, msg.roomId)) {
+        sendError(sender, ProtocolError::NOT_IN_ROOM, "Not a member of room " + it->second->name);
+        return;
+    }
+    sender->forgetReplay(msg.roomId);
+    
+    deliver(members, frame, nullptr);
+}
+
+bool MessageRouter::checkRoomSender(ClientSession* sender, uint32_t roomId) {
+    if (roomId == LOBBY_ROOM_ID || !sender) {
+        return true;
+    }
+    
+    std::shared_ptr<const Membership> membership = loadMembership();
+    auto joined = membership->sessionRooms.find(sender);
+    if (joined != membership->sessionRooms.end() &&
+        std::find(joined->second.begin(), joined->second.end(), roomId) != joined->second.end()) {
+        return true;
+    }
+    
+    sendError(sender, ProtocolError::NOT_IN_ROOM, "Not a member of room " + std::to_string(roomId));
+    return false;
+}
+
+void MessageRouter::relayText(ClientSession* sender, uint32_t roomId, BroadcastFrames frames) {
+    // The other encodings are built once here, outside the history lock,
+    // however many recipients share them
+    const FramePtr& frame = frames.frame;
+    frames.traceId = Tracer::current(); // Carried to the shards' threads
+    uint32_t features = supportedFeatures_;
+    MessageView view;
+    if ((features & (FEATURE_COMPRESSION | FEATURE_COMPACT_ENCODING)) &&
+        Serializer::deserializeView(frame->data(), frame->size(), view)) {
+        if (!frames.compressed && (features & FEATURE_COMPRESSION) &&
+            view.content.size() >= Compression::MIN_INPUT_SIZE) {
+            frames.compressed = FramePool::instance().encodeCompressed(view);
+            if (!frames.compressed) {
+                compressionSkipped_++;
+            }
+        }
+        if (frames.compressed) {
+            compressedFrames_++;
+            compressionInputBytes_ += frame->size();
+            compressionOutputBytes_ += frames.compressed->size();
+        }
+        
+        // Compact frames name the sender by its session, so only for
+        // messages sent under the session's own name. Compressed messages
+        // are large enough that the v1 header hardly matters.
+        if (!frames.compressed && (features & FEATURE_COMPACT_ENCODING) && sender &&
+            view.sender == sender->getUsername()) {
+            frames.compact = FramePool::instance().encodeCompact(view, sender->getClientId());
+            frames.senderId = sender->getClientId();
+            if (frames.compact) {
+                compactFrames_++;
+                compactInputBytes_ += frame->size();
+                compactOutputBytes_ += frames.compact->size();
+            }
         }
     }
+    
+    if (!history_.enabled() && !log_) {
+        broadcastToRoom(roomId, frames, sender);
+        return;
+    }
+    
+    std::shared_ptr<RoomHistory> history = lobbyHistory_;
+    std::string roomName;
+    if (roomId != LOBBY_ROOM_ID) {
+        std::shared_ptr<const Membership> membership = loadMembership();
+        auto it = membership->rooms.find(roomId);
+        if (it == membership->rooms.end()) {
+            return;
+        }
+        history = it->second->history;
+        roomName = it->second->name;
+    }
+    
+    // Only storing the message is serialized. It is delivered after the
+    // lock is released; its sequence number lets a member that joined in
+    // the meantime skip it if it was already in the member's replay.
+    history_.trimIdle(frame->size());
+    {
+        std::lock_guard<std::mutex> historyLock(history->mutex());
+        frames.sequence = history->append(frame->data(), frame->size());
+        if (log_) {
+            log_->append(roomName, frame);
+        }
+    }
+    frames.roomId = roomId;
+    broadcastToRoom(roomId, frames, sender);
+}
+
+void MessageRouter::restoreHistory(const std::string& room, const uint8_t* frame, size_t frameSize) {
+    MessageView view;
+    if (!history_.enabled() || !Serializer::deserializeView(frame, frameSize, view) ||
+        view.type != MessageType::TEXT) {
+        return;
+    }
+    
+    if (room.empty()) {
+        std::lock_guard<std::mutex> historyLock(lobbyHistory_->mutex());
+        lobbyHistory_->append(frame, frameSize);
+        return;
+    }
+    
+    // Room ids are assigned per run, so keep the message and encode it
+    // again once the room exists
+    Message message;
+    if (!Serializer::toMessage(view, message)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(membershipMutex_);
+    std::deque<Message>& messages = restoredHistory_[room];
+    messages.push_back(std::move(message));
+    if (messages.size() > history_.getLimits().maxMessages) {
+        messages.pop_front();
+    }
+}
+
+void MessageRouter::replayHistory(ClientSession* client, uint32_t roomId, RoomHistory& history,
+                                  const std::string& label, const FramePtr& leading) {
+    if (history.size() == 0) {
+        if (leading) {
+            client->sendReplay(roomId, history.lastSequence(), leading);
+        }
+        return;
+    }
+    
+    Message notice(MessageType::SYSTEM, "SERVER",
+                   "Last " + std::to_string(history.size()) + " messages in " + label);
+    FramePtr noticeFrame = FramePool::instance().encode(notice);
+    
+    // One buffer, so the whole replay is queued and written as one frame
+    std::shared_ptr<std::vector<uint8_t>> batch = std::make_shared<std::vector<uint8_t>>();
+    if (leading) {
+        batch->insert(batch->end(), leading->begin(), leading->end());
+    }
+    batch->insert(batch->end(), noticeFrame->begin(), noticeFrame->end());
+    history.copyTo(*batch);
+    client->sendReplay(roomId, history.lastSequence(), batch);
+}
+
+void MessageRouter::sendError(ClientSession* client, ProtocolError code, const std::string& text) {
+    Message errorMsg(MessageType::ERROR_MSG, "SERVER", text);
+    errorMsg.messageId = static_cast<uint32_t>(code);
+    client->sendMessage(FramePool::instance().encode(errorMsg));
 }
 
 void MessageRouter::onClientJoined(ClientSession* client, const std::string& username) {
     if (!client) return;
     
     {
-        std::lock_guard<std::mutex> lock(clientsMutex_);
-        usernameToClient_[username] = client;
+        std::lock_guard<std::mutex> presenceLock(presenceMutex_);
+        bool added = false;
+        {
+            // Lobby messages start with the replay, as for a room
+            std::lock_guard<std::mutex> historyLock(lobbyHistory_->mutex());
+            updateMembership([&](Membership& membership) {
+                // Names may only refer to sessions the snapshot keeps alive
+                std::shared_ptr<ClientSession> member = membership.clients.find(client);
+                if (!member) {
+                    return;
+                }
+                membership.usernameToClient[username] = client;
+                replayHistory(client, LOBBY_ROOM_ID, *lobbyHistory_, "the lobby", nullptr);
+                membership.lobby.add(member);
+                added = true;
+            });
+        }
+        if (!added) {
+            return;
+        }
+        
+        // Everyone gets a delta, the new client the full list once; the
+        // snapshot already includes any change still waiting to be sent
+        recordPresence(username, true, client);
+        sendUserListSnapshot(client);
     }
     
-    // Broadcast join message
-    Message joinMsg(MessageType::JOIN, username, username + " joined the chat");
-    broadcastMessage(joinMsg, client);
-    
-    // Send user list update
-    sendUserListUpdate();
-    
     std::cout << "Client " << username << " joined (ID: " << client->getClientId() << ")" << std::endl;
 }
 
 void MessageRouter::onClientLeft(ClientSession* client, const std::string& username) {
     if (!client) return;
     
+    // Sends the LEAVE notice or PRESENCE delta
     removeClient(client);
     
-    // Broadcast leave message
-    Message leaveMsg(MessageType::LEAVE, username, username + " left the chat");
-    broadcastMessage(leaveMsg);
-    
-    // Send user list update
-    sendUserListUpdate();
-    
     std::cout << "Client " << username << " left (ID: " << client->getClientId() << ")" << std::endl;
 }
 
 std::vector<std::string> MessageRouter::getUserList() const {
-    std::lock_guard<std::mutex> lock(clientsMutex_);
+    std::shared_ptr<const Membership> membership = loadMembership();
     std::vector<std::string> users;
-    for (const auto& pair : usernameToClient_) {
+    for (const auto& pair : membership->usernameToClient) {
         if (pair.second && pair.second->isConnected()) {
             users.push_back(pair.first);
         }
@@ -105,17 +600,149 @@ std::vector<std::string> MessageRouter::getUserList() const {
     return users;
 }
 
-void MessageRouter::sendUserListUpdate() {
-    std::vector<std::string> users = getUserList();
+std::vector<SessionQueueInfo> MessageRouter::getSendQueueDepths() const {
+    std::shared_ptr<const Membership> membership = loadMembership();
+    std::vector<SessionQueueInfo> depths;
+    depths.reserve(membership->clients.size());
+    membership->clients.forEach([&depths](const std::shared_ptr<ClientSession>& client) {
+        depths.push_back({client->getClientId(), client->getUsername(), client->getSendQueueDepth()});
+    });
+    std::sort(depths.begin(), depths.end(),
+              [](const SessionQueueInfo& a, const SessionQueueInfo& b) {
+                  return a.depth.bytes > b.depth.bytes;
+              });
+    return depths;
+}
+
+void MessageRouter::sendUserListSnapshot(ClientSession* client) {
+    FramePtr snapshot = encodeUserList();
+    if (shards_.empty()) {
+        client->sendMessage(snapshot);
+        return;
+    }
+    
+    // Through the client's own shard, behind the deltas already posted to it
+    std::shared_ptr<ClientSession> member = loadMembership()->clients.find(client);
+    if (!member) {
+        return;
+    }
+    BroadcastFrames frames(snapshot);
+    frames.presence = true;
+    frames.legacy = snapshot;
+    shards_[ShardedSessions::shardOf(client, shards_.size())]->post(
+        frames, std::make_shared<const SessionList>(1, member), nullptr);
+}
+
+FramePtr MessageRouter::encodeUserList() {
+    std::shared_ptr<const Membership> membership = loadMembership();
     std::string userListStr;
-    for (size_t i = 0; i < users.size(); ++i) {
-        userListStr += users[i];
-        if (i < users.size() - 1) {
+    for (const auto& pair : membership->usernameToClient) {
+        if (!userListStr.empty()) {
             userListStr += ",";
         }
+        userListStr += pair.first;
     }
     
     Message userListMsg(MessageType::USER_LIST, "SERVER", userListStr);
-    broadcastMessage(userListMsg);
+    userListMsg.messageId = presenceVersion_;
+    return FramePool::instance().encode(userListMsg);
+}
+
+void MessageRouter::recordPresence(const std::string& username, bool online,
+                                   ClientSession* exclude) {
+    presenceChanges_++;
+    
+    // The notices older clients show as they happen
+    Message notice(online ? MessageType::JOIN : MessageType::LEAVE, username,
+                   username + (online ? " joined the chat" : " left the chat"));
+    BroadcastFrames legacyNotice;
+    legacyNotice.presence = true;
+    legacyNotice.legacy = FramePool::instance().encode(notice);
+    broadcastFrame(legacyNotice, exclude);
+    
+    auto it = pendingPresence_.find(username);
+    if (it == pendingPresence_.end()) {
+        pendingPresence_.emplace(username, online);
+        pendingPresenceOrder_.push_back(username);
+    } else {
+        // A join and a leave in the same window merge into the final state
+        it->second = online;
+    }
+    
+    if (presenceWindowMs_ == 0) {
+        flushPresence();
+    } else if (pendingPresenceOrder_.size() == 1) {
+        // First change of a new window starts the timer
+        presenceCv_.notify_all();
+    }
 }
 
+void MessageRouter::flushPresence() {
+    if (pendingPresenceOrder_.empty()) {
+        return;
+    }
+    
+    // Final state of every name touched since the last update; applying it
+    // is idempotent for clients whose snapshot already reflects it
+    std::string changes;
+    for (const std::string& username : pendingPresenceOrder_) {
+        if (!changes.empty()) {
+            changes += ",";
+        }
+        changes += pendingPresence_[username] ? '+' : '-';
+        changes += username;
+    }
+    pendingPresence_.clear();
+    pendingPresenceOrder_.clear();
+    
+    Message delta(MessageType::PRESENCE, "SERVER", changes);
+    delta.messageId = ++presenceVersion_;
+    presenceBroadcasts_++;
+    BroadcastFrames frames(FramePool::instance().encode(delta));
+    frames.presence = true;
+    frames.legacy = encodeUserList();
+    broadcastFrame(frames);
+}
+
+void MessageRouter::presenceThread() {
+    std::unique_lock<std::mutex> lock(presenceMutex_);
+    while (true) {
+        presenceCv_.wait(lock, [this] {
+            return presenceStopping_ || !pendingPresenceOrder_.empty();
+        });
+        if (presenceStopping_) {
+            break;
+        }
+        
+        // Collect everything else that changes within the window
+        auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(presenceWindowMs_);
+        presenceCv_.wait_until(lock, deadline, [this] { return presenceStopping_; });
+        flushPresence();
+    }
+}
+
+PresenceStats MessageRouter::getPresenceStats() const {
+    PresenceStats stats;
+    stats.changes = presenceChanges_;
+    stats.broadcasts = presenceBroadcasts_;
+    return stats;
+}
+
+CompressionStats MessageRouter::getCompressionStats() const {
+    CompressionStats stats;
+    stats.frames = compressedFrames_;
+    stats.inputBytes = compressionInputBytes_;
+    stats.outputBytes = compressionOutputBytes_;
+    stats.skipped = compressionSkipped_;
+    stats.decoded = compressionDecoded_;
+    return stats;
+}
+
+CompactStats MessageRouter::getCompactStats() const {
+    CompactStats stats;
+    stats.frames = compactFrames_;
+    stats.inputBytes = compactInputBytes_;
+    stats.outputBytes = compactOutputBytes_;
+    return stats;
+}
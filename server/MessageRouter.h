@@ -2,31 +2,204 @@
 #define MESSAGEROUTER_H
 
 #include "ClientSession.h"
+#include "RouterShard.h"
+#include "MessageHistory.h"
+#include "MessageLog.h"
 #include "../shared/Message.h"
+#include "../shared/Protocol.h"
 #include <vector>
 #include <unordered_map>
+#include <deque>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
 #include <string>
+#include <memory>
+
+// Presence coalescing: individual join/leave changes versus the PRESENCE
+// broadcasts that carried them; changes - broadcasts were merged
+struct PresenceStats {
+    uint64_t changes = 0;
+    uint64_t broadcasts = 0;
+};
+
+// Large TEXT broadcasts compressed once for every capable recipient
+struct CompressionStats {
+    uint64_t frames = 0;       // Broadcasts sent with a compressed variant
+    uint64_t inputBytes = 0;   // Their plain frame sizes
+    uint64_t outputBytes = 0;  // Their compressed frame sizes
+    uint64_t skipped = 0;      // Large enough to try, but did not compress well
+    uint64_t decoded = 0;      // Received compressed, decoded for other recipients
+};
+
+// Short TEXT broadcasts also sent as compact frames
+struct CompactStats {
+    uint64_t frames = 0;
+    uint64_t inputBytes = 0;   // Their v1 frame sizes
+    uint64_t outputBytes = 0;  // Their compact frame sizes
+};
+
+struct SessionQueueInfo {
+    uint32_t clientId;
+    std::string username;
+    SendQueueDepth depth;
+};
 
 class MessageRouter {
 public:
-    MessageRouter();
+    // shardCount delivery threads fan broadcasts out in parallel; with 0,
+    // broadcasts are delivered inline on the calling thread. Presence
+    // changes within presenceWindowMs are sent as one combined update;
+    // with 0, each change is sent on its own.
+    explicit MessageRouter(size_t shardCount = 0, unsigned int presenceWindowMs = 0,
+                           const HistoryLimits& historyLimits = HistoryLimits());
     ~MessageRouter();
     
-    void addClient(ClientSession* client);
+    // The client gets lobby messages, starting with the recent ones, once
+    // it joins the chat (onClientJoined)
+    void addClient(const std::shared_ptr<ClientSession>& client);
     void removeClient(ClientSession* client);
     void routeMessage(ClientSession* sender, const Message& msg);
+    // Routes a received frame; TEXT frames are relayed byte-for-byte
+    // without being decoded into a Message and re-encoded
+    void routeFrame(ClientSession* sender, const MessageView& view,
+                    const uint8_t* frame, size_t frameSize);
     void broadcastMessage(const Message& msg, ClientSession* exclude = nullptr);
+    // Each recipient gets the variant of frames it negotiated
+    void broadcastFrame(const BroadcastFrames& frames, ClientSession* exclude = nullptr);
+    // Delivers only to the room's members; the lobby means every client
+    // that joined the chat
+    void broadcastToRoom(uint32_t roomId, const BroadcastFrames& frames, ClientSession* exclude = nullptr);
+    // Adds the client to the named room, creating it on first use, and
+    // sends it a ROOM_JOIN confirmation followed by the room's recent
+    // messages. Returns the room id, or LOBBY_ROOM_ID if the client cannot
+    // join.
+    uint32_t joinRoom(ClientSession* client, const std::string& name);
+    // Empty rooms are deleted, though their history is kept for when the
+    // room is joined again; returns false if the client was not a member
+    bool partRoom(ClientSession* client, uint32_t roomId);
+    size_t getRoomCount() const;
+    size_t getShardCount() const { return shards_.size(); }
+    PresenceStats getPresenceStats() const;
+    HistoryStats getHistoryStats() const { return history_.getStats(); }
+    CompressionStats getCompressionStats() const;
+    CompactStats getCompactStats() const;
+    // FEATURE_* bits clients may negotiate; compression, compact encoding
+    // and presence deltas by default
+    void setSupportedFeatures(uint32_t features) { supportedFeatures_ = features; }
+    uint32_t getSupportedFeatures() const { return supportedFeatures_; }
+    // Relayed TEXT frames are appended to log from now on; set before
+    // clients connect
+    void setMessageLog(MessageLog* log) { log_ = log; }
+    // Feeds a frame recovered from the message log into history: the
+    // lobby's directly, a room's once a room with that name is created
+    void restoreHistory(const std::string& room, const uint8_t* frame, size_t frameSize);
     void onClientJoined(ClientSession* client, const std::string& username);
     void onClientLeft(ClientSession* client, const std::string& username);
     std::vector<std::string> getUserList() const;
+    // Send backlog of every session, deepest first
+    std::vector<SessionQueueInfo> getSendQueueDepths() const;
     
 private:
-    std::vector<ClientSession*> clients_;
-    std::unordered_map<std::string, ClientSession*> usernameToClient_;
-    mutable std::mutex clientsMutex_;
+    // Immutable membership snapshot. Readers (broadcasts, user lists) load
+    // the current one without locking; membership changes copy it, modify
+    // the copy and publish it under membershipMutex_. Sessions stay alive
+    // for as long as any snapshot still references them.
+    // Rooms are immutable as well, so a membership update only copies the
+    // rooms it touches; the rest are shared with the previous snapshot.
+    struct Room {
+        std::string name;
+        ShardedSessions members;
+        std::shared_ptr<RoomHistory> history;
+    };
+    
+    struct Membership {
+        ShardedSessions clients;
+        ShardedSessions lobby; // Clients that joined the chat
+        std::unordered_map<std::string, ClientSession*> usernameToClient;
+        std::unordered_map<uint32_t, std::shared_ptr<const Room>> rooms;
+        std::unordered_map<std::string, uint32_t> roomIds;
+        std::unordered_map<ClientSession*, std::vector<uint32_t>> sessionRooms;
+    };
+    
+    static constexpr size_t MAX_ROOM_NAME_LENGTH = 64;
+    static constexpr size_t MAX_ROOMS_PER_SESSION = 64;
+    
+    std::shared_ptr<const Membership> loadMembership() const;
+    template <typename Update>
+    void updateMembership(Update update);
+    
+    bool removeFromRoom(Membership& membership, ClientSession* client, uint32_t roomId);
+    // Hands each shard its part of the recipients, or delivers inline
+    void deliver(const ShardedSessions& recipients, const BroadcastFrames& frames, ClientSession* exclude);
+    
+    std::shared_ptr<const Membership> membership_;
+    std::mutex membershipMutex_;
+    // Held from a presence change until its delta is queued or posted to
+    // the router shards. Snapshots are sent under it too, through the
+    // recipient's shard when there are shards, so every recipient sees
+    // deltas and snapshots in version order.
+    std::mutex presenceMutex_;
+    
+    // Presence changes not yet broadcast: whether each touched name is
+    // online now, in the order they were first touched. Guarded by
+    // presenceMutex_, as is the version, which counts PRESENCE broadcasts.
+    std::unordered_map<std::string, bool> pendingPresence_;
+    std::vector<std::string> pendingPresenceOrder_;
+    uint32_t presenceVersion_;
+    bool presenceStopping_;
+    unsigned int presenceWindowMs_;
+    std::thread presenceThread_;
+    std::condition_variable presenceCv_;
+    std::atomic<uint64_t> presenceChanges_;
+    std::atomic<uint64_t> presenceBroadcasts_;
+    uint32_t nextRoomId_; // Guarded by membershipMutex_
+    
+    MessageHistory history_;
+    std::shared_ptr<RoomHistory> lobbyHistory_;
+    // Recovered messages of rooms that do not exist yet, by room name.
+    // Guarded by membershipMutex_.
+    std::unordered_map<std::string, std::deque<Message>> restoredHistory_;
+    MessageLog* log_;
+    
+    std::atomic<uint32_t> supportedFeatures_;
+    std::atomic<uint64_t> compressedFrames_;
+    std::atomic<uint64_t> compressionInputBytes_;
+    std::atomic<uint64_t> compressionOutputBytes_;
+    std::atomic<uint64_t> compressionSkipped_;
+    std::atomic<uint64_t> compressionDecoded_;
+    std::atomic<uint64_t> compactFrames_;
+    std::atomic<uint64_t> compactInputBytes_;
+    std::atomic<uint64_t> compactOutputBytes_;
+    
+    std::vector<std::unique_ptr<RouterShard>> shards_;
     
-    void sendUserListUpdate();
+    void handleRoomJoin(ClientSession* sender, const Message& msg);
+    void handleRoomPart(ClientSession* sender, const Message& msg);
+    bool checkRoomSender(ClientSession* sender, uint32_t roomId);
+    // Stores a TEXT frame in its room's history, then delivers it: large
+    // ones compressed, the rest compact encoded, for the recipients that
+    // support it. frames.compressed is set if the sender supplied it.
+    void relayText(ClientSession* sender, uint32_t roomId, BroadcastFrames frames);
+    // Sends leading (if any) and the stored messages as one frame batch.
+    // Requires history.mutex(), held until the client is published as a
+    // recipient of the room.
+    void replayHistory(ClientSession* client, uint32_t roomId, RoomHistory& history,
+                       const std::string& label, const FramePtr& leading);
+    void sendError(ClientSession* client, ProtocolError code, const std::string& text);
+    // Requires presenceMutex_. Goes through the client's shard, if any,
+    // so it stays in order with the deltas
+    void sendUserListSnapshot(ClientSession* client);
+    FramePtr encodeUserList(); // Requires presenceMutex_
+    // Sends clients without FEATURE_PRESENCE a JOIN or LEAVE notice at
+    // once; for the others the change waits for the next delta
+    void recordPresence(const std::string& username, bool online,
+                        ClientSession* exclude); // Requires presenceMutex_
+    // PRESENCE delta, or for clients without FEATURE_PRESENCE the full
+    // USER_LIST. Requires presenceMutex_.
+    void flushPresence();
+    void presenceThread();
 };
 
 #endif // MESSAGEROUTER_H
@@ -0,0 +1,180 @@
+#include "Metrics.h"
+#include <sstream>
+
+#ifdef _MSC_VER
+    #include <intrin.h>
+#endif
+
+namespace {
+
+unsigned highestBit(uint64_t value) {
+    #ifdef _MSC_VER
+        unsigned long index;
+        _BitScanReverse64(&index, value);
+        return static_cast<unsigned>(index);
+    #else
+        return 63 - static_cast<unsigned>(__builtin_clzll(value));
+    #endif
+}
+
+} // namespace
+
+uint64_t Counter::value() const {
+    uint64_t total = 0;
+    for (const Shard& shard : shards_) {
+        total += shard.value.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+int64_t Gauge::value() const {
+    int64_t total = 0;
+    for (const Shard& shard : shards_) {
+        total += shard.value.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+size_t Histogram::bucketOf(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+        return static_cast<size_t>(value);
+    }
+    unsigned exponent = highestBit(value);
+    if (exponent >= MAX_BITS) {
+        return BUCKETS - 1;
+    }
+    unsigned shift = exponent - SUB_BITS;
+    return static_cast<size_t>((shift + 1) * SUB_BUCKETS + ((value >> shift) - SUB_BUCKETS));
+}
+
+uint64_t Histogram::lowerBound(size_t bucket) {
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    unsigned shift = static_cast<unsigned>(bucket / SUB_BUCKETS) - 1;
+    return (SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+}
+
+uint64_t Histogram::upperBound(size_t bucket) {
+    if (bucket < SUB_BUCKETS) {
+        return bucket + 1;
+    }
+    unsigned shift = static_cast<unsigned>(bucket / SUB_BUCKETS) - 1;
+    return lowerBound(bucket) + (uint64_t(1) << shift);
+}
+
+HistogramSnapshot Histogram::snapshot() const {
+    HistogramSnapshot snapshot;
+    snapshot.buckets.assign(BUCKETS, 0);
+    for (const Shard& shard : shards_) {
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            uint64_t count = shard.buckets[i].load(std::memory_order_relaxed);
+            snapshot.buckets[i] += count;
+            snapshot.count += count;
+        }
+        snapshot.sum += shard.sum.load(std::memory_order_relaxed);
+    }
+    return snapshot;
+}
+
+double HistogramSnapshot::quantile(double q) const {
+    if (count == 0) {
+        return 0.0;
+    }
+    uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(count - 1)) + 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return (static_cast<double>(Histogram::lowerBound(i)) +
+                    static_cast<double>(Histogram::upperBound(i))) / 2.0;
+        }
+    }
+    return static_cast<double>(Histogram::upperBound(buckets.size() - 1));
+}
+
+MetricsRegistry& MetricsRegistry::instance() {
+    static MetricsRegistry registry;
+    return registry;
+}
+
+MetricsRegistry::Entry& MetricsRegistry::add(const std::string& name, const std::string& help, Kind kind) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unique_ptr<Entry> entry(new Entry());
+    entry->name = name;
+    entry->help = help;
+    entry->kind = kind;
+    entries_.push_back(std::move(entry));
+    return *entries_.back();
+}
+
+Counter& MetricsRegistry::counter(const std::string& name, const std::string& help) {
+    Entry& entry = add(name, help, Kind::COUNTER);
+    entry.counter.reset(new Counter());
+    return *entry.counter;
+}
+
+Gauge& MetricsRegistry::gauge(const std::string& name, const std::string& help) {
+    Entry& entry = add(name, help, Kind::GAUGE);
+    entry.gauge.reset(new Gauge());
+    return *entry.gauge;
+}
+
+Histogram& MetricsRegistry::histogram(const std::string& name, const std::string& help) {
+    Entry& entry = add(name, help, Kind::HISTOGRAM);
+    entry.histogram.reset(new Histogram());
+    return *entry.histogram;
+}
+
+std::string MetricsRegistry::renderText() const {
+    std::ostringstream out;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const std::unique_ptr<Entry>& entry : entries_) {
+        out << "# HELP " << entry->name << " " << entry->help << "\n";
+        switch (entry->kind) {
+            case Kind::COUNTER:
+                out << "# TYPE " << entry->name << " counter\n";
+                out << entry->name << " " << entry->counter->value() << "\n";
+                break;
+            case Kind::GAUGE:
+                out << "# TYPE " << entry->name << " gauge\n";
+                out << entry->name << " " << entry->gauge->value() << "\n";
+                break;
+            case Kind::HISTOGRAM: {
+                HistogramSnapshot snapshot = entry->histogram->snapshot();
+                out << "# TYPE " << entry->name << " summary\n";
+                for (double q : {0.5, 0.9, 0.99, 0.999}) {
+                    out << entry->name << "{quantile=\"" << q << "\"} "
+                        << static_cast<uint64_t>(snapshot.quantile(q)) << "\n";
+                }
+                out << entry->name << "_sum " << snapshot.sum << "\n";
+                out << entry->name << "_count " << snapshot.count << "\n";
+                break;
+            }
+        }
+    }
+    return out.str();
+}
+
+ServerMetrics& ServerMetrics::get() {
+    static ServerMetrics metrics = [] {
+        MetricsRegistry& registry = MetricsRegistry::instance();
+        return ServerMetrics{
+            registry.counter("chat_connections_opened_total", "Connections accepted"),
+            registry.counter("chat_connections_closed_total", "Connections closed"),
+            registry.gauge("chat_connections", "Open connections"),
+            registry.counter("chat_frames_received_total", "Frames received from clients"),
+            registry.counter("chat_bytes_received_total", "Bytes of frames received from clients"),
+            registry.counter("chat_frames_sent_total", "Frames written to clients"),
+            registry.counter("chat_bytes_sent_total", "Bytes written to clients"),
+            registry.counter("chat_send_calls_total", "Gathered send calls"),
+            registry.gauge("chat_queued_frames", "Frames waiting in send queues"),
+            registry.gauge("chat_queued_bytes", "Bytes waiting in send queues"),
+            registry.counter("chat_dropped_frames_total", "Frames discarded for slow consumers"),
+            registry.counter("chat_heartbeats_sent_total", "HEARTBEAT frames sent to silent clients"),
+            registry.counter("chat_idle_disconnects_total", "Connections closed for silence"),
+            registry.histogram("chat_route_nanoseconds", "Time to route one received frame"),
+        };
+    }();
+    return metrics;
+}
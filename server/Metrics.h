@@ -0,0 +1,149 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Runtime metrics, cheap enough for every frame. Counters, gauges and
+// histograms are split into METRIC_SHARDS cache lines; a thread only
+// updates its own shard, with a relaxed atomic add, and readers sum the
+// shards. Values can be read at any time without stopping traffic. Each
+// value is exact, but a read is not a snapshot across metrics.
+constexpr size_t METRIC_SHARDS = 16;
+
+// The calling thread's shard, assigned round-robin on first use
+inline size_t metricShard() {
+    static std::atomic<size_t> nextShard(0);
+    thread_local const size_t shard = nextShard.fetch_add(1, std::memory_order_relaxed) % METRIC_SHARDS;
+    return shard;
+}
+
+class Counter {
+public:
+    void add(uint64_t n = 1) {
+        shards_[metricShard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+    uint64_t value() const;
+    
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> value{0};
+    };
+    Shard shards_[METRIC_SHARDS];
+};
+
+// A level that goes up and down, such as open connections; the sum of
+// every add() so far
+class Gauge {
+public:
+    void add(int64_t delta) {
+        shards_[metricShard()].value.fetch_add(delta, std::memory_order_relaxed);
+    }
+    void sub(int64_t delta) { add(-delta); }
+    int64_t value() const;
+    
+private:
+    struct alignas(64) Shard {
+        std::atomic<int64_t> value{0};
+    };
+    Shard shards_[METRIC_SHARDS];
+};
+
+struct HistogramSnapshot {
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    std::vector<uint64_t> buckets;
+    
+    // Midpoint of the bucket holding the value at quantile q (0..1)
+    double quantile(double q) const;
+};
+
+// Log-linear histogram: SUB_BUCKETS equal buckets per power of two, so a
+// reported quantile is within 1/SUB_BUCKETS of the recorded value. Values
+// of 2^MAX_BITS and up land in the last bucket.
+class Histogram {
+public:
+    static constexpr unsigned SUB_BITS = 3;
+    static constexpr uint64_t SUB_BUCKETS = uint64_t(1) << SUB_BITS;
+    static constexpr unsigned MAX_BITS = 40;
+    static constexpr size_t BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS;
+    
+    void record(uint64_t value) {
+        Shard& shard = shards_[metricShard()];
+        shard.buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        shard.sum.fetch_add(value, std::memory_order_relaxed);
+    }
+    HistogramSnapshot snapshot() const;
+    
+    static size_t bucketOf(uint64_t value);
+    static uint64_t lowerBound(size_t bucket);
+    static uint64_t upperBound(size_t bucket);
+    
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> buckets[BUCKETS] = {};
+        std::atomic<uint64_t> sum{0};
+    };
+    Shard shards_[METRIC_SHARDS];
+};
+
+// Named metrics, rendered together as text. Metrics are registered once
+// and live as long as the process; the references handed out stay valid.
+class MetricsRegistry {
+public:
+    static MetricsRegistry& instance();
+    
+    Counter& counter(const std::string& name, const std::string& help);
+    Gauge& gauge(const std::string& name, const std::string& help);
+    Histogram& histogram(const std::string& name, const std::string& help);
+    
+    // Prometheus text format: counters and gauges as one sample each,
+    // histograms as a summary with p50/p90/p99/p999, sum and count
+    std::string renderText() const;
+    
+private:
+    MetricsRegistry() = default;
+    
+    enum class Kind { COUNTER, GAUGE, HISTOGRAM };
+    struct Entry {
+        std::string name;
+        std::string help;
+        Kind kind;
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::unique_ptr<Histogram> histogram;
+    };
+    
+    Entry& add(const std::string& name, const std::string& help, Kind kind);
+    
+    // Guards the list, not the values
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<Entry>> entries_;
+};
+
+// The server's own metrics
+struct ServerMetrics {
+    Counter& connectionsOpened;
+    Counter& connectionsClosed;
+    Gauge& connections;
+    Counter& framesReceived;
+    Counter& bytesReceived;
+    Counter& framesSent;
+    Counter& bytesSent;
+    Counter& sendCalls;
+    Gauge& queuedFrames;    // Across every session's send queue
+    Gauge& queuedBytes;
+    Counter& droppedFrames; // Discarded by slow-consumer policies
+    Counter& heartbeatsSent;
+    Counter& idleDisconnects;
+    Histogram& routeNanos;  // Time to route one received frame
+    
+    static ServerMetrics& get();
+};
+
+#endif // METRICS_H
@@ -1,3 +1,15 @@
 #include "Protocol.h"
-// Protocol implementation if needed
+#include <algorithm>
 
+bool negotiateHello(const HelloMessage& request, uint32_t serverFeatures, HelloMessage& reply) {
+    uint16_t version = std::min(request.maxVersion, PROTOCOL_VERSION);
+    if (version < std::max(request.minVersion, MIN_PROTOCOL_VERSION)) {
+        return false;
+    }
+    
+    reply.minVersion = version;
+    reply.maxVersion = version;
+    reply.features = request.features & serverFeatures;
+    reply.agent = "chat-server";
+    return true;
+}
@@ -3,7 +3,9 @@
 
 #include "../shared/Protocol.h"
 
-// Server-specific protocol extensions can go here
+// Builds the SERVER_HELLO answer to a client's hello: the highest version
+// both sides speak and the requested features among serverFeatures.
+// Returns false if the version ranges do not overlap.
+bool negotiateHello(const HelloMessage& request, uint32_t serverFeatures, HelloMessage& reply);
 
 #endif // SERVER_PROTOCOL_H
-
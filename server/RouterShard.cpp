@@ -0,0 +1,131 @@
+#include "RouterShard.h"
+#include "ClientSession.h"
+#include "Tracer.h"
+#include <algorithm>
+
+ShardedSessions::ShardedSessions(size_t shardCount)
+    : parts_(std::max<size_t>(1, shardCount), std::make_shared<const SessionList>()), size_(0) {
+}
+
+void ShardedSessions::add(const std::shared_ptr<ClientSession>& session) {
+    SessionListPtr& part = parts_[shardOf(session.get(), parts_.size())];
+    std::shared_ptr<SessionList> next = std::make_shared<SessionList>(*part);
+    next->push_back(session);
+    part = std::move(next);
+    size_++;
+}
+
+bool ShardedSessions::remove(ClientSession* session) {
+    SessionListPtr& part = parts_[shardOf(session, parts_.size())];
+    auto it = std::find_if(part->begin(), part->end(),
+                           [session](const std::shared_ptr<ClientSession>& s) {
+                               return s.get() == session;
+                           });
+    if (it == part->end()) {
+        return false;
+    }
+    
+    std::shared_ptr<SessionList> next = std::make_shared<SessionList>();
+    next->reserve(part->size() - 1);
+    next->insert(next->end(), part->begin(), it);
+    next->insert(next->end(), it + 1, part->end());
+    part = std::move(next);
+    size_--;
+    return true;
+}
+
+std::shared_ptr<ClientSession> ShardedSessions::find(ClientSession* session) const {
+    const SessionListPtr& part = parts_[shardOf(session, parts_.size())];
+    for (const std::shared_ptr<ClientSession>& s : *part) {
+        if (s.get() == session) {
+            return s;
+        }
+    }
+    return nullptr;
+}
+
+size_t ShardedSessions::shardOf(const ClientSession* session, size_t shardCount) {
+    return session->getClientId() % shardCount;
+}
+
+RouterShard::RouterShard() : running_(false), delivered_(0) {
+}
+
+RouterShard::~RouterShard() {
+    stop();
+}
+
+bool RouterShard::start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_) {
+        return false;
+    }
+    
+    running_ = true;
+    thread_ = std::thread(&RouterShard::run, this);
+    return true;
+}
+
+void RouterShard::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!running_) {
+            return;
+        }
+        running_ = false;
+    }
+    cv_.notify_all();
+    
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    queue_.clear();
+}
+
+void RouterShard::post(const BroadcastFrames& frames, const SessionListPtr& recipients,
+                       ClientSession* exclude) {
+    bool wasEmpty;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        wasEmpty = queue_.empty();
+        queue_.push_back(Delivery{frames, recipients, exclude});
+    }
+    
+    // A non-empty queue means the shard is already awake and will drain it
+    if (wasEmpty) {
+        cv_.notify_one();
+    }
+}
+
+void RouterShard::run() {
+    std::deque<Delivery> batch;
+    
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return !running_ || !queue_.empty(); });
+            if (!running_) {
+                break;
+            }
+            batch.swap(queue_);
+        }
+        
+        uint64_t delivered = 0;
+        for (const Delivery& delivery : batch) {
+            uint32_t traceId = delivery.frames.traceId;
+            Tracer::Scope trace(traceId);
+            uint64_t start = traceId ? Tracer::nowNanos() : 0;
+            for (const std::shared_ptr<ClientSession>& client : *delivery.recipients) {
+                if (client.get() != delivery.exclude && client->isConnected()) {
+                    client->sendBroadcast(delivery.frames);
+                    delivered++;
+                }
+            }
+            if (traceId) {
+                Tracer::instance().record("deliver", traceId, start, Tracer::nowNanos());
+            }
+        }
+        delivered_ += delivered;
+        batch.clear();
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef ROUTERSHARD_H
+#define ROUTERSHARD_H
+
+#include "Frame.h"
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+class ClientSession;
+
+typedef std::vector<std::shared_ptr<ClientSession>> SessionList;
+typedef std::shared_ptr<const SessionList> SessionListPtr;
+
+// A set of sessions split by shard (client id modulo the shard count) into
+// immutable lists. Adding or removing a session copies only its own list;
+// copying the whole set copies just the list pointers.
+class ShardedSessions {
+public:
+    explicit ShardedSessions(size_t shardCount = 1);
+    
+    void add(const std::shared_ptr<ClientSession>& session);
+    bool remove(ClientSession* session);
+    std::shared_ptr<ClientSession> find(ClientSession* session) const;
+    
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    size_t shardCount() const { return parts_.size(); }
+    const SessionListPtr& part(size_t shard) const { return parts_[shard]; }
+    
+    template <typename Fn>
+    void forEach(Fn fn) const {
+        for (const SessionListPtr& part : parts_) {
+            for (const std::shared_ptr<ClientSession>& session : *part) {
+                fn(session);
+            }
+        }
+    }
+    
+    static size_t shardOf(const ClientSession* session, size_t shardCount);
+    
+private:
+    std::vector<SessionListPtr> parts_;
+    size_t size_;
+};
+
+// Delivery thread for one shard. Broadcasts post one entry per shard, and
+// each shard pushes the frame into its own sessions' send queues, so the
+// per-recipient fan-out runs on all shards in parallel instead of on the
+// sender's thread. A recipient belongs to exactly one shard, which keeps
+// its frames in the order they were posted.
+class RouterShard {
+public:
+    RouterShard();
+    ~RouterShard();
+    
+    bool start();
+    void stop();
+    
+    void post(const BroadcastFrames& frames, const SessionListPtr& recipients, ClientSession* exclude);
+    
+    uint64_t getDeliveredFrames() const { return delivered_; }
+    
+private:
+    struct Delivery {
+        BroadcastFrames frames;
+        SessionListPtr recipients;
+        ClientSession* exclude;
+    };
+    
+    void run();
+    
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Delivery> queue_;
+    bool running_; // Guarded by mutex_
+    
+    std::atomic<uint64_t> delivered_;
+};
+
+#endif // ROUTERSHARD_H
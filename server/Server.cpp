@@ -1,4 +1,7 @@
 #include "Server.h"
+#include "FramePool.h"
+#include "Metrics.h"
+#include "Tracer.h"
 #include <iostream>
 #include <algorithm>
 #include <thread>
@@ -10,7 +13,32 @@
     #pragma comment(lib, "ws2_32.lib")
 #endif
 
-Server::Server(uint16_t port) : port_(port), listenSocket_(INVALID_SOCKET), running_(false) {
+namespace {
+
+ServerConfig configForPort(uint16_t port) {
+    ServerConfig config;
+    config.port = port;
+    return config;
+}
+
+} // namespace
+
+Server::Server(uint16_t port) : Server(configForPort(port)) {
+}
+
+Server::Server(const ServerConfig& config)
+    : config_(config), port_(config.port), loopsAccept_(false),
+      running_(false), router_(config.routerShards, config.presenceWindowMs, config.historyLimits),
+      idleTimers_(ClientSession::monotonicMillis() / HeartbeatOptions::TICK_MS), nextEventLoop_(0) {
+    if (config_.engine == ServerEngine::EVENT_LOOP && !EventLoop::isSupported()) {
+        std::cerr << "Event-loop engine not supported on this platform, using threaded engine" << std::endl;
+        config_.engine = ServerEngine::THREADED;
+    }
+    router_.setSupportedFeatures((config_.compression ? FEATURE_COMPRESSION : 0) |
+                                 (config_.compactEncoding ? FEATURE_COMPACT_ENCODING : 0) |
+                                 (config_.heartbeat.enabled() ? FEATURE_HEARTBEAT : 0) |
+                                 FEATURE_PRESENCE);
+    
     #ifdef _WIN32
         WSADATA wsaData;
         if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
@@ -21,26 +49,36 @@ Server::Server(uint16_t port) : port_(port), listenSocket_(INVALID_SOCKET), runn
 
 Server::~Server() {
     stop();
-    cleanupSocket();
+    cleanupSockets();
     
     #ifdef _WIN32
         WSACleanup();
     #endif
 }
 
-bool Server::initializeSocket() {
-    listenSocket_ = socket(AF_INET, SOCK_STREAM, 0);
-    if (listenSocket_ == INVALID_SOCKET_VALUE) {
+SocketHandle Server::openListenSocket(bool reusePort) {
+    SocketHandle listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenSocket == INVALID_SOCKET_VALUE) {
         std::cerr << "Failed to create socket" << std::endl;
-        return false;
+        return INVALID_SOCKET_VALUE;
     }
     
     // Set socket options
     int opt = 1;
     #ifdef _WIN32
-        setsockopt(listenSocket_, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&opt), sizeof(opt));
+        setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&opt), sizeof(opt));
+        (void)reusePort;
     #else
-        setsockopt(listenSocket_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        #ifdef SO_REUSEPORT
+            if (reusePort && setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) != 0) {
+                std::cerr << "Failed to set SO_REUSEPORT" << std::endl;
+                close(listenSocket);
+                return INVALID_SOCKET_VALUE;
+            }
+        #else
+            (void)reusePort;
+        #endif
     #endif
     
     // Bind socket
@@ -49,31 +87,76 @@ bool Server::initializeSocket() {
     serverAddr.sin_addr.s_addr = INADDR_ANY;
     serverAddr.sin_port = htons(port_);
     
-    if (bind(listenSocket_, reinterpret_cast<sockaddr*>(&serverAddr), sizeof(serverAddr)) == SOCKET_ERROR_VALUE) {
-        std::cerr << "Failed to bind socket to port " << port_ << std::endl;
-        cleanupSocket();
-        return false;
+    const char* failure = nullptr;
+    if (bind(listenSocket, reinterpret_cast<sockaddr*>(&serverAddr), sizeof(serverAddr)) == SOCKET_ERROR_VALUE) {
+        failure = "Failed to bind socket to port ";
+    } else if (listen(listenSocket, SOMAXCONN) == SOCKET_ERROR_VALUE) {
+        failure = "Failed to listen on port ";
     }
     
-    // Listen
-    if (listen(listenSocket_, SOMAXCONN) == SOCKET_ERROR_VALUE) {
-        std::cerr << "Failed to listen on socket" << std::endl;
-        cleanupSocket();
-        return false;
+    if (failure) {
+        std::cerr << failure << port_ << std::endl;
+        #ifdef _WIN32
+            closesocket(listenSocket);
+        #else
+            close(listenSocket);
+        #endif
+        return INVALID_SOCKET_VALUE;
     }
+    return listenSocket;
+}
+
+bool Server::initializeSockets() {
+    // Each listener has its own accept queue, so a burst of reconnects is
+    // accepted on several cores instead of overflowing one backlog
+    unsigned int count = config_.acceptors;
+    loopsAccept_ = count == 0 && config_.engine == ServerEngine::EVENT_LOOP;
+    if (loopsAccept_) {
+        count = eventLoopCount();
+    }
+    count = std::max(1u, count);
+    
+    #ifndef SO_REUSEPORT
+        if (count > 1) {
+            std::cerr << "SO_REUSEPORT not supported on this platform, using one listening socket" << std::endl;
+            count = 1;
+            loopsAccept_ = false;
+        }
+    #endif
     
+    for (unsigned int i = 0; i < count; ++i) {
+        SocketHandle listenSocket = openListenSocket(count > 1);
+        if (listenSocket == INVALID_SOCKET_VALUE) {
+            cleanupSockets();
+            return false;
+        }
+        listenSockets_.push_back(listenSocket);
+        
+        // The rest must join the port the kernel picked for the first
+        if (port_ == 0) {
+            sockaddr_in boundAddr{};
+            socklen_t boundAddrLen = sizeof(boundAddr);
+            getsockname(listenSocket, reinterpret_cast<sockaddr*>(&boundAddr), &boundAddrLen);
+            port_ = ntohs(boundAddr.sin_port);
+        }
+    }
     return true;
 }
 
-void Server::cleanupSocket() {
-    if (listenSocket_ != INVALID_SOCKET_VALUE) {
+void Server::cleanupSockets() {
+    for (SocketHandle listenSocket : listenSockets_) {
+        if (listenSocket == INVALID_SOCKET_VALUE) {
+            continue;
+        }
         #ifdef _WIN32
-            closesocket(listenSocket_);
+            closesocket(listenSocket);
         #else
-            close(listenSocket_);
+            // close() alone does not wake a thread blocked in accept() on Linux
+            shutdown(listenSocket, SHUT_RDWR);
+            close(listenSocket);
         #endif
-        listenSocket_ = INVALID_SOCKET_VALUE;
     }
+    listenSockets_.clear();
 }
 
 bool Server::start() {
@@ -81,17 +164,115 @@ bool Server::start() {
         return false;
     }
     
-    if (!initializeSocket()) {
+    if (!config_.logDir.empty() && !openMessageLog()) {
+        return false;
+    }
+    
+    if (!initializeSockets()) {
+        messageLog_.stop();
+        return false;
+    }
+    
+    if (config_.engine == ServerEngine::EVENT_LOOP && !startEventLoops()) {
+        cleanupSockets();
+        messageLog_.stop();
         return false;
     }
     
+    Tracer::instance().setSampleEvery(config_.traceSampleEvery);
+    
     running_ = true;
-    acceptThread_ = std::thread(&Server::acceptThread, this);
+    for (SocketHandle listenSocket : listenSockets_) {
+        acceptThreads_.emplace_back(&Server::acceptThread, this, listenSocket);
+    }
+    if (config_.engine == ServerEngine::THREADED) {
+        reaperThread_ = std::thread(&Server::reaperThread, this);
+    }
     
-    std::cout << "Server started on port " << port_ << std::endl;
+    std::cout << "Server started on port " << port_;
+    if (config_.engine == ServerEngine::EVENT_LOOP) {
+        std::cout << " (event-loop engine, " << eventLoops_.size() << " loops";
+        if (loopsAccept_) {
+            std::cout << (eventLoops_.size() > 1 ? ", each accepting on its own listener" : "");
+        }
+        std::cout << ")";
+    } else {
+        std::cout << " (threaded engine)";
+    }
+    if (acceptThreads_.size() > 1) {
+        std::cout << ", " << acceptThreads_.size() << " acceptors";
+    }
+    if (router_.getShardCount() > 0) {
+        std::cout << ", " << router_.getShardCount() << " router shards";
+    }
+    std::cout << std::endl;
     return true;
 }
 
+bool Server::openMessageLog() {
+    if (!MessageLog::isSupported()) {
+        std::cerr << "Message log not supported on this platform, history will not be persisted" << std::endl;
+        return true;
+    }
+    
+    if (!messageLog_.open(config_.logDir, config_.logOptions)) {
+        return false;
+    }
+    
+    // The history budget bounds how much of the log is worth reading back
+    uint64_t recovered = 0;
+    if (config_.historyLimits.maxMessages > 0) {
+        recovered = messageLog_.recover(config_.historyLimits.maxTotalBytes,
+            [this](const std::string& room, const uint8_t* frame, size_t size) {
+                router_.restoreHistory(room, frame, size);
+            });
+    }
+    std::cout << "Message log " << config_.logDir << ": recovered " << recovered << " messages" << std::endl;
+    
+    if (!messageLog_.start()) {
+        return false;
+    }
+    router_.setMessageLog(&messageLog_);
+    return true;
+}
+
+unsigned int Server::eventLoopCount() const {
+    if (config_.eventLoopThreads > 0) {
+        return config_.eventLoopThreads;
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+bool Server::startEventLoops() {
+    unsigned int count = eventLoopCount();
+    for (unsigned int i = 0; i < count; ++i) {
+        std::unique_ptr<EventLoop> loop(new EventLoop(&router_, &sessionPool_, config_.sendQueueLimits,
+                                                     config_.heartbeat));
+        // Handed over either way; the loop closes it if it fails to start
+        SocketHandle listenSocket = INVALID_SOCKET_VALUE;
+        if (loopsAccept_) {
+            std::swap(listenSocket, listenSockets_[i]);
+        }
+        if (!loop->start(listenSocket)) {
+            stopEventLoops();
+            return false;
+        }
+        eventLoops_.push_back(std::move(loop));
+    }
+    
+    if (loopsAccept_) {
+        listenSockets_.clear();
+    }
+    return true;
+}
+
+void Server::stopEventLoops() {
+    for (auto& loop : eventLoops_) {
+        loop->stop();
+    }
+    eventLoops_.clear();
+}
+
 void Server::stop() {
     if (!running_) {
         return;
@@ -99,50 +280,186 @@ void Server::stop() {
     
     running_ = false;
     
-    // Close listen socket to unblock accept
-    cleanupSocket();
+    // Close listen sockets to unblock accept; the event loops close their
+    // own when they stop
+    cleanupSockets();
+    
+    for (std::thread& thread : acceptThreads_) {
+        thread.join();
+    }
+    acceptThreads_.clear();
     
-    if (acceptThread_.joinable()) {
-        acceptThread_.join();
+    {
+        std::lock_guard<std::mutex> lock(reaperMutex_);
+        reaperCv_.notify_all();
+    }
+    if (reaperThread_.joinable()) {
+        reaperThread_.join();
     }
     
+    stopEventLoops();
+    
     // Stop all client sessions
     {
         std::lock_guard<std::mutex> lock(clientsMutex_);
-        for (ClientSession* client : clients_) {
-            if (client) {
-                client->stop();
-                delete client;
-            }
+        std::lock_guard<std::mutex> timersLock(idleTimersMutex_);
+        for (const std::shared_ptr<ClientSession>& client : clients_) {
+            idleTimers_.cancel(client->idleTimer());
+            router_.removeClient(client.get());
+            client->stop();
         }
         clients_.clear();
     }
     
+    // Everything routed is queued by now; flush it to disk
+    messageLog_.stop();
+    
+    dumpTrace();
+    Tracer::instance().setSampleEvery(0);
+    
+    SendStats sendStats = ClientSession::getTotalSendStats();
+    if (sendStats.sendCalls > 0) {
+        std::cout << "Sent " << sendStats.framesSent << " frames (" << sendStats.bytesSent
+                  << " bytes) in " << sendStats.sendCalls << " send calls, "
+                  << static_cast<double>(sendStats.framesSent) / sendStats.sendCalls
+                  << " frames/call" << std::endl;
+    }
+    
+    HistogramSnapshot routeLatency = ServerMetrics::get().routeNanos.snapshot();
+    if (routeLatency.count > 0) {
+        std::cout << "Routed " << routeLatency.count << " frames, p50 "
+                  << routeLatency.quantile(0.5) / 1000.0 << " us, p99 "
+                  << routeLatency.quantile(0.99) / 1000.0 << " us" << std::endl;
+    }
+    
+    HeartbeatStats heartbeatStats = ClientSession::getHeartbeatStats();
+    if (heartbeatStats.heartbeatsSent > 0 || heartbeatStats.idleDisconnects > 0) {
+        std::cout << "Heartbeats: " << heartbeatStats.heartbeatsSent << " sent, "
+                  << heartbeatStats.idleDisconnects << " idle connections closed" << std::endl;
+    }
+    
+    FramePoolStats frameStats = FramePool::instance().getStats();
+    SessionPoolStats sessionStats = sessionPool_.getStats();
+    std::cout << "Frame pool: " << frameStats.reused << " of " << frameStats.acquired
+              << " frames reused, " << frameStats.unpooled << " oversized; session pool: "
+              << sessionStats.reused << " reused, " << sessionStats.created << " created"
+              << std::endl;
+    
+    PresenceStats presenceStats = router_.getPresenceStats();
+    if (presenceStats.changes > 0) {
+        std::cout << "Presence: " << presenceStats.changes << " changes in "
+                  << presenceStats.broadcasts << " updates, "
+                  << presenceStats.changes - presenceStats.broadcasts << " merged" << std::endl;
+    }
+    
+    HistoryStats historyStats = router_.getHistoryStats();
+    if (historyStats.replays > 0 || historyStats.messages > 0) {
+        std::cout << "History: " << historyStats.messages << " messages (" << historyStats.bytes
+                  << " bytes, " << historyStats.allocatedBytes << " allocated) in "
+                  << historyStats.rooms << " rooms (" << historyStats.idleRooms << " emptied), "
+                  << historyStats.evicted << " evicted, "
+                  << historyStats.replayedMessages << " replayed in " << historyStats.replays
+                  << " replays" << std::endl;
+    }
+    
+    CompressionStats compressionStats = router_.getCompressionStats();
+    if (compressionStats.frames > 0 || compressionStats.skipped > 0) {
+        std::cout << "Compression: " << compressionStats.frames << " broadcasts, "
+                  << compressionStats.inputBytes << " -> " << compressionStats.outputBytes
+                  << " bytes, " << compressionStats.skipped << " not worth it, "
+                  << compressionStats.decoded << " decoded for plain recipients" << std::endl;
+    }
+    
+    CompactStats compactStats = router_.getCompactStats();
+    if (compactStats.frames > 0) {
+        std::cout << "Compact encoding: " << compactStats.frames << " broadcasts, "
+                  << compactStats.inputBytes << " -> " << compactStats.outputBytes << " bytes" << std::endl;
+    }
+    
+    MessageLogStats logStats = messageLog_.getStats();
+    if (logStats.records > 0) {
+        std::cout << "Message log: " << logStats.records << " records (" << logStats.bytes
+                  << " bytes) in " << logStats.writes << " writes, " << logStats.syncs
+                  << " syncs, " << logStats.dropped << " dropped" << std::endl;
+    }
+    
     std::cout << "Server stopped" << std::endl;
 }
 
+void Server::dumpTrace() {
+    if (!Tracer::instance().enabled()) {
+        return;
+    }
+    
+    long events = Tracer::instance().writeChromeTrace(config_.traceFile);
+    if (events < 0) {
+        std::cerr << "Failed to write trace to " << config_.traceFile << std::endl;
+    } else {
+        std::cout << "Wrote " << events << " trace events to " << config_.traceFile << std::endl;
+    }
+}
+
 void Server::cleanupDisconnectedClients() {
-    std::lock_guard<std::mutex> lock(clientsMutex_);
-    clients_.erase(
-        std::remove_if(clients_.begin(), clients_.end(),
-            [](ClientSession* client) {
-                if (client && !client->isConnected()) {
-                    client->stop();
-                    delete client;
-                    return true;
-                }
-                return false;
-            }),
-        clients_.end()
-    );
-}
-
-void Server::acceptThread() {
+    std::vector<std::shared_ptr<ClientSession>> disconnected;
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex_);
+        auto split = std::partition(clients_.begin(), clients_.end(),
+            [](const std::shared_ptr<ClientSession>& client) {
+                return client->isConnected();
+            });
+        disconnected.assign(std::make_move_iterator(split),
+                            std::make_move_iterator(clients_.end()));
+        clients_.erase(split, clients_.end());
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(idleTimersMutex_);
+        for (const std::shared_ptr<ClientSession>& client : disconnected) {
+            idleTimers_.cancel(client->idleTimer());
+        }
+    }
+    
+    // Joining session threads happens outside clientsMutex_, so accept never
+    // waits on it. The references are held until the join finishes, which
+    // keeps a session's own thread from ever releasing it.
+    for (const std::shared_ptr<ClientSession>& client : disconnected) {
+        router_.removeClient(client.get());
+        client->stop();
+    }
+}
+
+void Server::reaperThread() {
+    std::unique_lock<std::mutex> lock(reaperMutex_);
+    while (running_) {
+        reaperCv_.wait_for(lock, REAP_INTERVAL);
+        
+        lock.unlock();
+        cleanupDisconnectedClients();
+        checkIdleClients();
+        lock.lock();
+    }
+}
+
+void Server::checkIdleClients() {
+    // Sessions stay in clients_ until cleanupDisconnectedClients() has
+    // cancelled their timers, so every timer here has a live session
+    std::lock_guard<std::mutex> lock(idleTimersMutex_);
+    uint64_t now = ClientSession::monotonicMillis();
+    idleTimers_.advance(now / HeartbeatOptions::TICK_MS, [this, now](TimerWheel::Timer& timer) {
+        ClientSession* client = static_cast<ClientSession*>(timer.data);
+        uint64_t check = client->checkIdle(now, config_.heartbeat);
+        if (check > 0) {
+            idleTimers_.schedule(timer, check / HeartbeatOptions::TICK_MS + 1);
+        }
+    });
+}
+
+void Server::acceptThread(SocketHandle listenSocket) {
     while (running_) {
         sockaddr_in clientAddr{};
         socklen_t clientAddrLen = sizeof(clientAddr);
         
-        SocketHandle clientSocket = accept(listenSocket_, 
+        SocketHandle clientSocket = accept(listenSocket, 
                                           reinterpret_cast<sockaddr*>(&clientAddr), 
                                           &clientAddrLen);
         
@@ -153,26 +470,47 @@ void Server::acceptThread() {
             break;
         }
         
+        if (config_.engine == ServerEngine::EVENT_LOOP) {
+            dispatchConnection(clientSocket);
+            
+            char ipStr[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &clientAddr.sin_addr, ipStr, INET_ADDRSTRLEN);
+            std::cout << "New client connected from " << ipStr << ":" << ntohs(clientAddr.sin_port) << std::endl;
+            continue;
+        }
+        
         // Create new client session
-        ClientSession* client = new ClientSession(clientSocket, &router_);
+        std::shared_ptr<ClientSession> client = sessionPool_.acquire(clientSocket, &router_, config_.sendQueueLimits);
         router_.addClient(client);
         
-        {
-            std::lock_guard<std::mutex> lock(clientsMutex_);
-            clients_.push_back(client);
-        }
-        
         if (client->start()) {
+            // Scheduled before the reaper can see the session, so its
+            // cleanup always cancels the timer
+            if (config_.heartbeat.enabled()) {
+                std::lock_guard<std::mutex> lock(idleTimersMutex_);
+                TimerWheel::Timer& timer = client->idleTimer();
+                timer.data = client.get();
+                uint64_t check = ClientSession::monotonicMillis() + config_.heartbeat.intervalMs;
+                idleTimers_.schedule(timer, check / HeartbeatOptions::TICK_MS + 1);
+            }
+            {
+                std::lock_guard<std::mutex> lock(clientsMutex_);
+                clients_.push_back(client);
+            }
+            
             char ipStr[INET_ADDRSTRLEN];
             inet_ntop(AF_INET, &clientAddr.sin_addr, ipStr, INET_ADDRSTRLEN);
             std::cout << "New client connected from " << ipStr << ":" << ntohs(clientAddr.sin_port) << std::endl;
         } else {
             std::cerr << "Failed to start client session" << std::endl;
-            delete client;
+            router_.removeClient(client.get());
         }
-        
-        // Cleanup disconnected clients periodically
-        cleanupDisconnectedClients();
     }
 }
 
+
+void Server::dispatchConnection(SocketHandle clientSocket) {
+    // Round-robin new connections across the loops
+    size_t next = nextEventLoop_.fetch_add(1, std::memory_order_relaxed);
+    eventLoops_[next % eventLoops_.size()]->addConnection(clientSocket);
+}
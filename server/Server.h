@@ -3,10 +3,16 @@
 
 #include "ClientSession.h"
 #include "MessageRouter.h"
+#include "EventLoop.h"
+#include "SessionPool.h"
 #include <string>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <vector>
+#include <memory>
 
 #ifdef _WIN32
     #include <winsock2.h>
@@ -22,29 +28,87 @@
     #define SOCKET_ERROR -1
 #endif
 
+// Connection handling strategy
+enum class ServerEngine {
+    THREADED,   // Two threads per client session (receive + send)
+    EVENT_LOOP  // Non-blocking sessions multiplexed over one epoll loop per core
+};
+
+struct ServerConfig {
+    uint16_t port = 8080;
+    ServerEngine engine = ServerEngine::THREADED;
+    unsigned int eventLoopThreads = 0; // 0 = one per hardware thread
+    unsigned int routerShards = 0;     // 0 = deliver broadcasts on the sender's thread
+    unsigned int acceptors = 0;        // Accept threads, each on its own SO_REUSEPORT listener;
+                                       // 0 = every event loop accepts on its own listener
+                                       // (one accept thread for the threaded engine)
+    unsigned int presenceWindowMs = 50; // 0 = send every presence change on its own
+    SendQueueLimits sendQueueLimits;
+    HeartbeatOptions heartbeat;
+    HistoryLimits historyLimits;
+    bool compression = true;           // Offer compression to clients that ask for it
+    bool compactEncoding = true;       // Offer compact frames to clients that ask for them
+    std::string logDir;                // Empty = no message log
+    MessageLogOptions logOptions;
+    unsigned int traceSampleEvery = 0; // Trace 1 in N received frames; 0 = off
+    std::string traceFile = "chat-trace.json";
+};
+
 class Server {
 public:
     Server(uint16_t port = 8080);
+    explicit Server(const ServerConfig& config);
     ~Server();
     
     bool start();
     void stop();
     bool isRunning() const { return running_; }
+    // Writes the sampled message traces to config.traceFile as Chrome
+    // trace JSON; does nothing with tracing off
+    void dumpTrace();
     
 private:
-    void acceptThread();
-    bool initializeSocket();
-    void cleanupSocket();
+    void acceptThread(SocketHandle listenSocket);
+    void reaperThread();
+    SocketHandle openListenSocket(bool reusePort);
+    bool initializeSockets();
+    void cleanupSockets();
     void cleanupDisconnectedClients();
+    void checkIdleClients();
+    bool openMessageLog();
+    unsigned int eventLoopCount() const;
+    bool startEventLoops();
+    void stopEventLoops();
+    void dispatchConnection(SocketHandle clientSocket);
     
+    ServerConfig config_;
     uint16_t port_;
-    SocketHandle listenSocket_;
+    // Bound to the same port with SO_REUSEPORT when there are several, so
+    // the kernel spreads incoming connections across them
+    std::vector<SocketHandle> listenSockets_;
+    bool loopsAccept_; // Each event loop owns one of listenSockets_
     std::atomic<bool> running_;
-    std::thread acceptThread_;
+    std::vector<std::thread> acceptThreads_;
+    
+    // Frees disconnected threaded-engine sessions off the accept path, and
+    // runs their idle checks
+    static constexpr std::chrono::milliseconds REAP_INTERVAL{HeartbeatOptions::TICK_MS};
+    std::thread reaperThread_;
+    std::mutex reaperMutex_;
+    std::condition_variable reaperCv_;
     
+    // Declared before everything holding sessions so it is destroyed last
+    SessionPool sessionPool_;
+    MessageLog messageLog_;
     MessageRouter router_;
-    std::vector<ClientSession*> clients_;
+    std::vector<std::shared_ptr<ClientSession>> clients_;
     std::mutex clientsMutex_;
+    // Idle checks of the threaded engine's sessions
+    TimerWheel idleTimers_;
+    std::mutex idleTimersMutex_;
+    
+    std::vector<std::unique_ptr<EventLoop>> eventLoops_;
+    std::atomic<size_t> nextEventLoop_;
 };
 
 #endif // SERVER_H
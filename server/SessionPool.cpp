@@ -0,0 +1,60 @@
+#include "SessionPool.h"
+
+SessionPool::SessionPool(size_t maxIdle)
+    : maxIdle_(maxIdle), created_(0), reused_(0) {
+}
+
+SessionPool::~SessionPool() {
+    for (ClientSession* session : idle_) {
+        delete session;
+    }
+}
+
+std::shared_ptr<ClientSession> SessionPool::acquire(SocketHandle socket, MessageRouter* router,
+                                                    const SendQueueLimits& limits) {
+    ClientSession* session = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!idle_.empty()) {
+            session = idle_.back();
+            idle_.pop_back();
+        }
+    }
+    
+    if (session) {
+        session->reset(socket, router, limits);
+        reused_++;
+    } else {
+        session = new ClientSession(socket, router, limits);
+        created_++;
+    }
+    
+    return std::shared_ptr<ClientSession>(session, [this](ClientSession* s) {
+        release(s);
+    });
+}
+
+SessionPoolStats SessionPool::getStats() const {
+    SessionPoolStats stats;
+    stats.created = created_;
+    stats.reused = reused_;
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats.idle = idle_.size();
+    return stats;
+}
+
+void SessionPool::release(ClientSession* session) {
+    // Joins the session's threads and closes its socket if still running
+    session->stop();
+    session->clearSendQueue();
+    
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (idle_.size() < maxIdle_) {
+            idle_.push_back(session);
+            return;
+        }
+    }
+    
+    delete session;
+}
@@ -0,0 +1,44 @@
+#ifndef SESSIONPOOL_H
+#define SESSIONPOOL_H
+
+#include "ClientSession.h"
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+class MessageRouter;
+
+struct SessionPoolStats {
+    uint64_t created = 0;  // Sessions allocated from scratch
+    uint64_t reused = 0;   // Sessions recycled from the idle list
+    size_t idle = 0;
+};
+
+// Recycles ClientSession objects, with their receive buffer and send
+// queue, across connections. A session handed out by acquire() is stopped
+// and returned to the idle list when its last reference is dropped, so the
+// pool must outlive every session it creates.
+class SessionPool {
+public:
+    explicit SessionPool(size_t maxIdle = 1024);
+    ~SessionPool();
+    
+    std::shared_ptr<ClientSession> acquire(SocketHandle socket, MessageRouter* router,
+                                           const SendQueueLimits& limits);
+    
+    SessionPoolStats getStats() const;
+    
+private:
+    void release(ClientSession* session);
+    
+    size_t maxIdle_;
+    mutable std::mutex mutex_;
+    std::vector<ClientSession*> idle_;
+    
+    std::atomic<uint64_t> created_;
+    std::atomic<uint64_t> reused_;
+};
+
+#endif // SESSIONPOOL_H
@@ -0,0 +1,87 @@
+#include "TimerWheel.h"
+
+TimerWheel::TimerWheel(uint64_t now) : now_(now), size_(0) {
+    for (auto& level : slots_) {
+        for (Timer& head : level) {
+            head.prev = &head;
+            head.next = &head;
+        }
+    }
+}
+
+TimerWheel::~TimerWheel() {
+    // Leave pending timers unscheduled rather than pointing into freed slots
+    for (auto& level : slots_) {
+        for (Timer& head : level) {
+            while (head.next != &head) {
+                unlink(*head.next);
+            }
+        }
+    }
+}
+
+void TimerWheel::schedule(Timer& timer, uint64_t expiry) {
+    if (timer.isScheduled()) {
+        unlink(timer);
+    }
+    timer.expiry = expiry > now_ ? expiry : now_ + 1;
+    insert(timer);
+}
+
+void TimerWheel::cancel(Timer& timer) {
+    if (timer.isScheduled()) {
+        unlink(timer);
+    }
+}
+
+void TimerWheel::insert(Timer& timer) {
+    uint64_t delta = timer.expiry - now_;
+    unsigned level = 0;
+    while (level + 1 < LEVELS && delta >= (uint64_t(1) << ((level + 1) * SLOT_BITS))) {
+        level++;
+    }
+    
+    // Past the top level's reach, wait in its farthest slot and be re-filed
+    // when the wheel gets there
+    uint64_t slotTick = timer.expiry;
+    uint64_t span = uint64_t(1) << (LEVELS * SLOT_BITS);
+    if (delta >= span) {
+        slotTick = now_ + span - 1;
+    }
+    
+    Timer& head = slots_[level][(slotTick >> (level * SLOT_BITS)) & SLOT_MASK];
+    timer.prev = head.prev;
+    timer.next = &head;
+    head.prev->next = &timer;
+    head.prev = &timer;
+    size_++;
+}
+
+void TimerWheel::unlink(Timer& timer) {
+    timer.prev->next = timer.next;
+    timer.next->prev = timer.prev;
+    timer.prev = nullptr;
+    timer.next = nullptr;
+    size_--;
+}
+
+void TimerWheel::cascade(unsigned level) {
+    Timer& head = slots_[level][(now_ >> (level * SLOT_BITS)) & SLOT_MASK];
+    if (head.next == &head) {
+        return;
+    }
+    
+    // Detach the whole list first. A timer due this very tick lands in the
+    // level-0 slot that advance() expires next.
+    Timer* timer = head.next;
+    head.prev->next = nullptr;
+    head.prev = &head;
+    head.next = &head;
+    
+    while (timer) {
+        Timer* next = timer->next;
+        size_--;
+        insert(*timer);
+        timer = next;
+    }
+}
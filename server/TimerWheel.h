@@ -0,0 +1,80 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <cstdint>
+#include <cstddef>
+
+// Hierarchical timing wheel. Time advances in whole ticks; each of the
+// LEVELS levels has SLOTS slots, a slot on level n spanning SLOTS^n ticks.
+// A timer sits in the slot of the coarsest level its expiry needs and is
+// moved down a level each time the wheel reaches that slot, so schedule,
+// cancel and each tick cost O(1) however many timers are pending.
+//
+// Timers are intrusive: the object being timed embeds a Timer and the
+// wheel only links it into a list. Not thread-safe; a timer must be
+// cancelled before its memory is freed or reused.
+class TimerWheel {
+public:
+    struct Timer {
+        Timer* prev = nullptr;
+        Timer* next = nullptr;
+        uint64_t expiry = 0;   // Tick it fires at
+        void* data = nullptr;  // For the owner, ignored by the wheel
+        
+        bool isScheduled() const { return next != nullptr; }
+    };
+    
+    explicit TimerWheel(uint64_t now = 0);
+    ~TimerWheel();
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+    
+    uint64_t now() const { return now_; }
+    size_t size() const { return size_; }
+    
+    // Fires the timer at tick expiry, or on the next tick if that has
+    // passed; a scheduled timer is moved
+    void schedule(Timer& timer, uint64_t expiry);
+    void cancel(Timer& timer);
+    
+    // Moves time forward to tick, calling expired(Timer&) for every timer
+    // that is due. Each timer is unlinked before its call, which may
+    // schedule it again or cancel others.
+    template <typename Fn>
+    void advance(uint64_t tick, Fn expired) {
+        while (now_ < tick) {
+            now_++;
+            for (unsigned level = 1; level < LEVELS; ++level) {
+                if ((now_ & ((uint64_t(1) << (level * SLOT_BITS)) - 1)) != 0) {
+                    break;
+                }
+                cascade(level);
+            }
+            
+            Timer& head = slots_[0][now_ & SLOT_MASK];
+            while (head.next != &head) {
+                Timer* timer = head.next;
+                unlink(*timer);
+                expired(*timer);
+            }
+        }
+    }
+    
+private:
+    static constexpr unsigned SLOT_BITS = 6;
+    static constexpr size_t SLOTS = size_t(1) << SLOT_BITS;
+    static constexpr uint64_t SLOT_MASK = SLOTS - 1;
+    static constexpr unsigned LEVELS = 4; // 2^24 ticks before timers wait in the top level
+    
+    void insert(Timer& timer);
+    void unlink(Timer& timer);
+    // Re-files the timers of the level's current slot one level down
+    void cascade(unsigned level);
+    
+    // Each slot is the sentinel of a circular list
+    Timer slots_[LEVELS][SLOTS];
+    uint64_t now_;
+    size_t size_;
+};
+
+#endif // TIMERWHEEL_H
@@ -0,0 +1,138 @@
+#include "Tracer.h"
+#include <fstream>
+#include <chrono>
+#include <thread>
+#include <functional>
+#include <iomanip>
+
+thread_local uint32_t Tracer::currentTrace_ = 0;
+
+// Holds the calling thread's ring and hands it back when the thread exits
+class Tracer::RingLease {
+public:
+    ~RingLease() {
+        if (ring) {
+            Tracer::instance().releaseRing(ring);
+        }
+    }
+    
+    Ring* ring = nullptr;
+};
+
+Tracer::Tracer() : sampleEvery_(0), nextTraceId_(0) {
+}
+
+Tracer& Tracer::instance() {
+    static Tracer tracer;
+    return tracer;
+}
+
+uint64_t Tracer::nowNanos() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+uint32_t Tracer::sample() {
+    uint32_t every = sampleEvery_.load(std::memory_order_relaxed);
+    if (every == 0) {
+        return 0;
+    }
+    
+    // Counted per thread, so sampling adds no shared write per frame. Each
+    // thread starts at its own offset rather than tracing its first frame.
+    thread_local uint64_t countdown = std::hash<std::thread::id>()(std::this_thread::get_id());
+    if (countdown >= every) {
+        countdown %= every;
+    }
+    if (countdown > 0) {
+        countdown--;
+        return 0;
+    }
+    countdown = every - 1;
+    
+    uint32_t id = nextTraceId_.fetch_add(1, std::memory_order_relaxed) + 1;
+    return id != 0 ? id : nextTraceId_.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+Tracer::Ring& Tracer::localRing() {
+    thread_local RingLease lease;
+    if (lease.ring) {
+        return *lease.ring;
+    }
+    
+    std::lock_guard<std::mutex> lock(ringsMutex_);
+    if (!freeRings_.empty()) {
+        lease.ring = freeRings_.back();
+        freeRings_.pop_back();
+    } else {
+        rings_.emplace_back(new Ring());
+        rings_.back()->id = static_cast<uint32_t>(rings_.size());
+        lease.ring = rings_.back().get();
+    }
+    return *lease.ring;
+}
+
+void Tracer::releaseRing(Ring* ring) {
+    std::lock_guard<std::mutex> lock(ringsMutex_);
+    freeRings_.push_back(ring);
+}
+
+void Tracer::record(const char* stage, uint32_t traceId, uint64_t startNs, uint64_t endNs) {
+    Ring& ring = localRing();
+    std::lock_guard<std::mutex> lock(ring.mutex);
+    Event event{stage, traceId, startNs, endNs};
+    if (ring.events.size() < EVENTS_PER_RING) {
+        ring.events.push_back(event);
+    } else {
+        ring.events[ring.next] = event;
+    }
+    ring.next = (ring.next + 1) % EVENTS_PER_RING;
+}
+
+long Tracer::writeChromeTrace(const std::string& path) const {
+    std::ofstream out(path);
+    if (!out) {
+        return -1;
+    }
+    
+    out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+    out << std::fixed << std::setprecision(3);
+    long written = 0;
+    bool first = true;
+    
+    // Rings are never freed, so the list can be walked without the lock,
+    // and threads claiming their first ring do not wait for the file
+    std::vector<Ring*> rings;
+    {
+        std::lock_guard<std::mutex> lock(ringsMutex_);
+        rings.reserve(rings_.size());
+        for (const std::unique_ptr<Ring>& ring : rings_) {
+            rings.push_back(ring.get());
+        }
+    }
+    
+    for (Ring* ring : rings) {
+        std::unique_lock<std::mutex> ringLock(ring->mutex);
+        std::vector<Event> events(ring->events);
+        size_t oldest = events.size() < EVENTS_PER_RING ? 0 : ring->next;
+        ringLock.unlock();
+        if (events.empty()) {
+            continue;
+        }
+        
+        out << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+            << ring->id << ", \"args\": {\"name\": \"thread " << ring->id << "\"}}";
+        first = false;
+        for (size_t i = 0; i < events.size(); ++i) {
+            const Event& event = events[(oldest + i) % events.size()];
+            uint64_t duration = event.endNs > event.startNs ? event.endNs - event.startNs : 0;
+            out << ",\n{\"name\": \"" << event.stage << "\", \"cat\": \"message\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+                << ring->id << ", \"ts\": " << event.startNs / 1000.0 << ", \"dur\": " << duration / 1000.0
+                << ", \"args\": {\"trace\": " << event.traceId << "}}";
+            written++;
+        }
+    }
+    
+    out << "\n]}\n";
+    return out ? written : -1;
+}
@@ -0,0 +1,92 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Sampled tracing of a message's path through the server. One in every N
+// received frames gets a trace id, and each stage it passes through
+// (receive, deserialize, route, deliver, send queue wait, send) is
+// timestamped with a monotonic clock into the recording thread's ring
+// buffer. The rings can be written out as Chrome trace JSON at any time,
+// for chrome://tracing or Perfetto.
+//
+// With sampling off, sample() and enabled() cost one relaxed load and
+// nothing is recorded.
+class Tracer {
+public:
+    static Tracer& instance();
+    
+    // Trace one in every n received frames; 0 turns tracing off
+    void setSampleEvery(uint32_t n) { sampleEvery_.store(n, std::memory_order_relaxed); }
+    bool enabled() const { return sampleEvery_.load(std::memory_order_relaxed) != 0; }
+    // A new trace id for the sampled calls, 0 for the rest
+    uint32_t sample();
+    
+    // Records a finished stage of a traced message
+    void record(const char* stage, uint32_t traceId, uint64_t startNs, uint64_t endNs);
+    // Writes every buffered event; returns the number written, or -1 if
+    // the file could not be written
+    long writeChromeTrace(const std::string& path) const;
+    
+    static uint64_t nowNanos();
+    
+    // The trace id of the message the calling thread is routing, so frames
+    // queued on its behalf carry it; 0 if none
+    static uint32_t current() { return currentTrace_; }
+    
+    // Makes traceId the calling thread's current trace while in scope
+    class Scope {
+    public:
+        explicit Scope(uint32_t traceId) : previous_(currentTrace_) { currentTrace_ = traceId; }
+        ~Scope() { currentTrace_ = previous_; }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    
+    private:
+        uint32_t previous_;
+    };
+    
+private:
+    Tracer();
+    
+    struct Event {
+        const char* stage; // A string literal
+        uint32_t traceId;
+        uint64_t startNs;
+        uint64_t endNs;
+    };
+    
+    // One thread's ring. A thread that exits hands its ring back for the
+    // next thread, events included, so the threaded engine's per-session
+    // threads do not leave a ring each behind.
+    struct Ring {
+        std::mutex mutex; // Uncontended except while a trace is written
+        std::vector<Event> events;
+        size_t next = 0;
+        uint32_t id = 0;  // Reported as the thread id
+    };
+    
+    class RingLease;
+    Ring& localRing();
+    void releaseRing(Ring* ring);
+    
+    // Per ring; older events are overwritten
+    static constexpr size_t EVENTS_PER_RING = 4096;
+    
+    std::atomic<uint32_t> sampleEvery_;
+    std::atomic<uint32_t> nextTraceId_;
+    
+    mutable std::mutex ringsMutex_;
+    std::vector<std::unique_ptr<Ring>> rings_;
+    std::vector<Ring*> freeRings_;
+    
+    static thread_local uint32_t currentTrace_;
+};
+
+#endif // TRACER_H
@@ -4,23 +4,118 @@
 #include <atomic>
 #include <thread>
 #include <chrono>
+#include <string>
+#include <cstdlib>
 
 std::atomic<bool> g_running(true);
+std::atomic<bool> g_dumpTrace(false);
 
 void signalHandler(int signal) {
     if (signal == SIGINT || signal == SIGTERM) {
         g_running = false;
     }
+    #ifndef _WIN32
+        if (signal == SIGUSR1) {
+            g_dumpTrace = true;
+        }
+    #endif
+}
+
+void printUsage(const char* program) {
+    std::cout << "Usage: " << program << " [port] [--engine=threaded|epoll] [--threads=N] [--acceptors=N]" << std::endl;
+    std::cout << "       [--router-shards=N]" << std::endl;
+    std::cout << "       [--presence-window-ms=N] [--history=N] [--history-bytes=N] [--no-compression]" << std::endl;
+    std::cout << "       [--no-compact] [--heartbeat-ms=N] [--idle-timeout-ms=N]" << std::endl;
+    std::cout << "       [--log-dir=PATH] [--log-segment-bytes=N] [--log-segments=N] [--log-sync-ms=N]" << std::endl;
+    std::cout << "       [--queue-bytes=N] [--queue-frames=N] [--slow-consumer=drop-oldest|drop-text|disconnect]" << std::endl;
+    std::cout << "       [--trace-sample=N] [--trace-file=PATH]" << std::endl;
 }
 
 int main(int argc, char* argv[]) {
-    uint16_t port = 8080;
+    ServerConfig config;
     
-    if (argc > 1) {
-        port = static_cast<uint16_t>(std::atoi(argv[1]));
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--engine=", 0) == 0) {
+            std::string engine = arg.substr(9);
+            if (engine == "threaded") {
+                config.engine = ServerEngine::THREADED;
+            } else if (engine == "epoll") {
+                config.engine = ServerEngine::EVENT_LOOP;
+            } else {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if (arg.rfind("--threads=", 0) == 0) {
+            config.eventLoopThreads = static_cast<unsigned int>(std::atoi(arg.c_str() + 10));
+        } else if (arg.rfind("--acceptors=", 0) == 0) {
+            config.acceptors = static_cast<unsigned int>(std::atoi(arg.c_str() + 12));
+        } else if (arg.rfind("--router-shards=", 0) == 0) {
+            config.routerShards = static_cast<unsigned int>(std::atoi(arg.c_str() + 16));
+        } else if (arg.rfind("--presence-window-ms=", 0) == 0) {
+            config.presenceWindowMs = static_cast<unsigned int>(std::atoi(arg.c_str() + 21));
+        } else if (arg.rfind("--history=", 0) == 0) {
+            config.historyLimits.maxMessages = static_cast<size_t>(std::atoll(arg.c_str() + 10));
+        } else if (arg.rfind("--history-bytes=", 0) == 0) {
+            config.historyLimits.maxTotalBytes = static_cast<size_t>(std::atoll(arg.c_str() + 16));
+        } else if (arg == "--no-compression") {
+            config.compression = false;
+        } else if (arg == "--no-compact") {
+            config.compactEncoding = false;
+        } else if (arg.rfind("--heartbeat-ms=", 0) == 0) {
+            config.heartbeat.intervalMs = static_cast<unsigned int>(std::atoi(arg.c_str() + 15));
+        } else if (arg.rfind("--idle-timeout-ms=", 0) == 0) {
+            config.heartbeat.timeoutMs = static_cast<unsigned int>(std::atoi(arg.c_str() + 18));
+        } else if (arg.rfind("--log-dir=", 0) == 0) {
+            config.logDir = arg.substr(10);
+        } else if (arg.rfind("--log-segment-bytes=", 0) == 0) {
+            config.logOptions.segmentBytes = static_cast<size_t>(std::atoll(arg.c_str() + 20));
+        } else if (arg.rfind("--log-segments=", 0) == 0) {
+            config.logOptions.maxSegments = static_cast<size_t>(std::atoll(arg.c_str() + 15));
+        } else if (arg.rfind("--log-sync-ms=", 0) == 0) {
+            config.logOptions.syncIntervalMs = static_cast<unsigned int>(std::atoi(arg.c_str() + 14));
+        } else if (arg.rfind("--queue-bytes=", 0) == 0) {
+            config.sendQueueLimits.maxBytes = static_cast<size_t>(std::atoll(arg.c_str() + 14));
+        } else if (arg.rfind("--queue-frames=", 0) == 0) {
+            config.sendQueueLimits.maxFrames = static_cast<size_t>(std::atoll(arg.c_str() + 15));
+        } else if (arg.rfind("--slow-consumer=", 0) == 0) {
+            std::string policy = arg.substr(16);
+            if (policy == "drop-oldest") {
+                config.sendQueueLimits.policy = SlowConsumerPolicy::DROP_OLDEST;
+            } else if (policy == "drop-text") {
+                config.sendQueueLimits.policy = SlowConsumerPolicy::DROP_TEXT;
+            } else if (policy == "disconnect") {
+                config.sendQueueLimits.policy = SlowConsumerPolicy::DISCONNECT;
+            } else {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if (arg.rfind("--trace-sample=", 0) == 0) {
+            config.traceSampleEvery = static_cast<unsigned int>(std::atoi(arg.c_str() + 15));
+        } else if (arg.rfind("--trace-file=", 0) == 0) {
+            config.traceFile = arg.substr(13);
+        } else if (arg == "--help" || arg == "-h") {
+            printUsage(argv[0]);
+            return 0;
+        } else {
+            config.port = static_cast<uint16_t>(std::atoi(arg.c_str()));
+        }
     }
     
-    Server server(port);
+    // The client needs time to answer a heartbeat before it counts as gone
+    if (config.heartbeat.enabled() && config.heartbeat.timeoutMs <= config.heartbeat.intervalMs) {
+        std::cerr << "--idle-timeout-ms must be longer than --heartbeat-ms" << std::endl;
+        return 1;
+    }
+    
+    uint16_t port = config.port;
+    
+    // Writes to a peer that already hung up must not kill the server
+    #ifndef _WIN32
+        signal(SIGPIPE, SIG_IGN);
+    #endif
+    
+    Server server(config);
     
     if (!server.start()) {
         std::cerr << "Failed to start server" << std::endl;
@@ -31,6 +126,7 @@ int main(int argc, char* argv[]) {
     #ifndef _WIN32
         signal(SIGINT, signalHandler);
         signal(SIGTERM, signalHandler);
+        signal(SIGUSR1, signalHandler);
     #endif
     
     std::cout << "Chat server running on port " << port << std::endl;
@@ -39,6 +135,9 @@ int main(int argc, char* argv[]) {
     // Main loop
     while (g_running && server.isRunning()) {
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (g_dumpTrace.exchange(false)) {
+            server.dumpTrace();
+        }
     }
     
     server.stop();
@@ -0,0 +1,158 @@
+#ifndef COMPACTSERIALIZER_H
+#define COMPACTSERIALIZER_H
+
+#include "Message.h"
+#include "Protocol.h"
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <cstring>
+
+// Names of the sender ids a connection has been told about
+typedef std::unordered_map<uint32_t, std::string> SenderTable;
+
+// Compact (v2) frames: COMPACT_FRAME_MARKER, the MessageType byte and a
+// varint payload length, followed by
+//   TEXT:   varint messageId, varint sender id, varint timestamp (seconds),
+//           varint roomId, then the content as the rest of the payload
+//   SENDER: varint sender id, then the name as the rest of the payload;
+//           id 0 with no name clears the receiver's table
+// Instead of the sender's name, a TEXT frame carries an id that the server
+// names with a SENDER frame ahead of the first TEXT frame using it on each
+// connection. The TEXT frame is the same for every recipient, so a
+// broadcast is still encoded once.
+class CompactSerializer {
+public:
+    static bool isCompact(const uint8_t* data, size_t size) {
+        return size > 0 && data[0] == COMPACT_FRAME_MARKER;
+    }
+    
+    // Upper bound for encodeText's output
+    static size_t maxTextSize(const MessageView& view) {
+        return COMPACT_HEADER_MAX_SIZE + 3 * varintSize(UINT32_MAX) + MAX_VARINT_SIZE +
+               view.content.size();
+    }
+    
+    // Encode a TEXT message into caller-provided memory. Returns the number
+    // of bytes written, or 0 if capacity is below maxTextSize(view) or the
+    // message has no compact form: compressed content, or a timestamp that
+    // is not a plain decimal number.
+    static size_t encodeText(const MessageView& view, uint32_t senderId, uint8_t* out, size_t capacity) {
+        uint64_t timestamp;
+        if (capacity < maxTextSize(view) || view.compressed || !parseTimestamp(view.timestamp, timestamp)) {
+            return 0;
+        }
+        
+        size_t payload = varintSize(view.messageId) + varintSize(senderId) + varintSize(timestamp) +
+                         varintSize(view.roomId) + view.content.size();
+        if (payload > MAX_PAYLOAD_SIZE) {
+            return 0;
+        }
+        
+        uint8_t* cursor = writeHeader(out, MessageType::TEXT, payload);
+        cursor += writeVarint(cursor, view.messageId);
+        cursor += writeVarint(cursor, senderId);
+        cursor += writeVarint(cursor, timestamp);
+        cursor += writeVarint(cursor, view.roomId);
+        std::memcpy(cursor, view.content.data(), view.content.size());
+        return static_cast<size_t>(cursor - out) + view.content.size();
+    }
+    
+    // Names senderId; id 0 with an empty name resets the table
+    static std::vector<uint8_t> encodeSender(uint32_t senderId, std::string_view name) {
+        size_t payload = varintSize(senderId) + name.size();
+        std::vector<uint8_t> buffer(COMPACT_HEADER_MAX_SIZE + payload);
+        uint8_t* cursor = writeHeader(buffer.data(), MessageType::SENDER, payload);
+        cursor += writeVarint(cursor, senderId);
+        std::memcpy(cursor, name.data(), name.size());
+        buffer.resize(static_cast<size_t>(cursor - buffer.data()) + name.size());
+        return buffer;
+    }
+    
+    // Parse a complete compact frame. Returns true if msg now holds a
+    // message; SENDER frames update senders and return false, as do
+    // invalid frames and TEXT from a sender the table does not know.
+    static bool decode(const uint8_t* data, size_t size, SenderTable& senders, Message& msg) {
+        if (size < 3 || data[0] != COMPACT_FRAME_MARKER) {
+            return false;
+        }
+        MessageType type = static_cast<MessageType>(data[1]);
+        
+        uint64_t payload;
+        size_t offset = 2;
+        size_t used = readVarint(data + offset, size - offset, payload);
+        if (used == 0 || payload != size - offset - used) {
+            return false;
+        }
+        offset += used;
+        
+        uint64_t senderId;
+        if (type == MessageType::SENDER) {
+            if (!readField(data, size, offset, UINT32_MAX, senderId)) {
+                return false;
+            }
+            std::string name(reinterpret_cast<const char*>(data + offset), size - offset);
+            if (senderId == 0) {
+                senders.clear();
+            } else {
+                senders[static_cast<uint32_t>(senderId)] = std::move(name);
+            }
+            return false;
+        }
+        if (type != MessageType::TEXT) {
+            return false;
+        }
+        
+        uint64_t messageId, timestamp, roomId;
+        if (!readField(data, size, offset, UINT32_MAX, messageId) ||
+            !readField(data, size, offset, UINT32_MAX, senderId) ||
+            !readField(data, size, offset, UINT64_MAX, timestamp) ||
+            !readField(data, size, offset, UINT32_MAX, roomId)) {
+            return false;
+        }
+        auto sender = senders.find(static_cast<uint32_t>(senderId));
+        if (sender == senders.end()) {
+            return false;
+        }
+        
+        msg.type = type;
+        msg.sender = sender->second;
+        msg.content.assign(reinterpret_cast<const char*>(data + offset), size - offset);
+        msg.timestamp = std::to_string(timestamp);
+        msg.messageId = static_cast<uint32_t>(messageId);
+        msg.roomId = static_cast<uint32_t>(roomId);
+        return true;
+    }
+    
+private:
+    // Returns the position just past the header
+    static uint8_t* writeHeader(uint8_t* out, MessageType type, size_t payload) {
+        out[0] = COMPACT_FRAME_MARKER;
+        out[1] = static_cast<uint8_t>(type);
+        return out + 2 + writeVarint(out + 2, payload);
+    }
+    
+    static bool readField(const uint8_t* data, size_t size, size_t& offset, uint64_t max, uint64_t& value) {
+        size_t used = readVarint(data + offset, size - offset, value);
+        offset += used;
+        return used > 0 && value <= max;
+    }
+    
+    // Only the canonical form, so decoding restores the exact string
+    static bool parseTimestamp(std::string_view text, uint64_t& value) {
+        if (text.empty() || text.size() > 19 || (text[0] == '0' && text.size() > 1)) {
+            return false;
+        }
+        value = 0;
+        for (char c : text) {
+            if (c < '0' || c > '9') {
+                return false;
+            }
+            value = value * 10 + static_cast<uint64_t>(c - '0');
+        }
+        return true;
+    }
+};
+
+#endif // COMPACTSERIALIZER_H
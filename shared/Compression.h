@@ -0,0 +1,203 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+// Small LZ77 block codec in the style of LZ4: greedy hash-chain-free
+// matching over a 64 KiB window, byte-aligned output, no entropy stage.
+// It trades ratio for speed, which suits repetitive text such as logs and
+// stack traces that are compressed once and fanned out many times.
+//
+// A block is a series of sequences: a token byte (literal count in the
+// high nibble, match length - 4 in the low nibble, 15 meaning more length
+// bytes follow, each adding up to 255), the literals, then a 2-byte
+// little-endian match offset and any extra match length bytes. The last
+// sequence has literals only.
+class Compression {
+public:
+    // Content shorter than this is sent as is
+    static constexpr size_t MIN_INPUT_SIZE = 512;
+    
+    // Returns the block size, or 0 if it would exceed capacity
+    static size_t compress(const uint8_t* in, size_t size, uint8_t* out, size_t capacity) {
+        uint32_t table[HASH_SIZE];
+        std::memset(table, 0, sizeof(table));
+        
+        uint8_t* op = out;
+        uint8_t* const outEnd = out + capacity;
+        size_t anchor = 0;
+        size_t ip = 0;
+        
+        if (size > MIN_MATCH_INPUT) {
+            // Matches may not start in the last 12 bytes or reach the last 5
+            const size_t matchStartLimit = size - MIN_MATCH_INPUT;
+            const size_t matchEndLimit = size - LAST_LITERALS;
+            
+            while (ip < matchStartLimit) {
+                uint32_t sequence = read32(in + ip);
+                uint32_t& slot = table[hash(sequence)];
+                size_t candidate = slot;
+                slot = static_cast<uint32_t>(ip + 1);
+                
+                if (candidate == 0 || ip + 1 - candidate > MAX_OFFSET ||
+                    read32(in + candidate - 1) != sequence) {
+                    // Skip faster through data that does not compress
+                    ip += 1 + ((ip - anchor) >> SKIP_SHIFT);
+                    continue;
+                }
+                
+                size_t match = candidate - 1;
+                size_t length = MIN_MATCH;
+                while (ip + length < matchEndLimit && in[match + length] == in[ip + length]) {
+                    length++;
+                }
+                
+                op = writeSequence(op, outEnd, in + anchor, ip - anchor, ip - match, length);
+                if (!op) {
+                    return 0;
+                }
+                
+                ip += length;
+                anchor = ip;
+                if (ip - 2 < matchStartLimit) {
+                    table[hash(read32(in + ip - 2))] = static_cast<uint32_t>(ip - 1);
+                }
+            }
+        }
+        
+        op = writeSequence(op, outEnd, in + anchor, size - anchor, 0, 0);
+        return op ? static_cast<size_t>(op - out) : 0;
+    }
+    
+    // Decodes a block that must expand to exactly size bytes
+    static bool decompress(const uint8_t* in, size_t inSize, uint8_t* out, size_t size) {
+        const uint8_t* ip = in;
+        const uint8_t* const inEnd = in + inSize;
+        uint8_t* op = out;
+        uint8_t* const outEnd = out + size;
+        
+        while (ip < inEnd) {
+            uint8_t token = *ip++;
+            
+            size_t literals = token >> 4;
+            if (literals == 15 && !readLength(ip, inEnd, literals)) {
+                return false;
+            }
+            if (literals > static_cast<size_t>(inEnd - ip) || literals > static_cast<size_t>(outEnd - op)) {
+                return false;
+            }
+            std::memcpy(op, ip, literals);
+            ip += literals;
+            op += literals;
+            
+            if (ip == inEnd) {
+                break;
+            }
+            
+            if (inEnd - ip < 2) {
+                return false;
+            }
+            size_t offset = static_cast<size_t>(ip[0]) | (static_cast<size_t>(ip[1]) << 8);
+            ip += 2;
+            if (offset == 0 || offset > static_cast<size_t>(op - out)) {
+                return false;
+            }
+            
+            size_t length = token & 15;
+            if (length == 15 && !readLength(ip, inEnd, length)) {
+                return false;
+            }
+            length += MIN_MATCH;
+            if (length > static_cast<size_t>(outEnd - op)) {
+                return false;
+            }
+            
+            // An overlapping match repeats what it produces, byte by byte
+            const uint8_t* match = op - offset;
+            if (offset >= length) {
+                std::memcpy(op, match, length);
+            } else {
+                for (size_t i = 0; i < length; ++i) {
+                    op[i] = match[i];
+                }
+            }
+            op += length;
+        }
+        
+        return op == outEnd;
+    }
+    
+private:
+    static constexpr size_t MIN_MATCH = 4;
+    static constexpr size_t LAST_LITERALS = 5;
+    static constexpr size_t MIN_MATCH_INPUT = 12;
+    static constexpr size_t MAX_OFFSET = 65535;
+    static constexpr unsigned HASH_BITS = 12;
+    static constexpr size_t HASH_SIZE = size_t(1) << HASH_BITS;
+    static constexpr unsigned SKIP_SHIFT = 6;
+    
+    static uint32_t read32(const uint8_t* p) {
+        uint32_t value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
+    }
+    
+    static uint32_t hash(uint32_t sequence) {
+        return (sequence * 2654435761u) >> (32 - HASH_BITS);
+    }
+    
+    // Writes one sequence; a zero length means literals only. Returns
+    // null if it does not fit.
+    static uint8_t* writeSequence(uint8_t* op, uint8_t* outEnd, const uint8_t* literals,
+                                  size_t literalCount, size_t offset, size_t length) {
+        size_t matchCode = length > 0 ? length - MIN_MATCH : 0;
+        size_t needed = 1 + literalCount / 255 + 1 + literalCount +
+                        (length > 0 ? 2 + matchCode / 255 + 1 : 0);
+        if (needed > static_cast<size_t>(outEnd - op)) {
+            return nullptr;
+        }
+        
+        uint8_t* token = op++;
+        *token = static_cast<uint8_t>((literalCount < 15 ? literalCount : 15) << 4);
+        if (literalCount >= 15) {
+            op = writeLength(op, literalCount - 15);
+        }
+        std::memcpy(op, literals, literalCount);
+        op += literalCount;
+        
+        if (length > 0) {
+            *op++ = static_cast<uint8_t>(offset);
+            *op++ = static_cast<uint8_t>(offset >> 8);
+            *token |= static_cast<uint8_t>(matchCode < 15 ? matchCode : 15);
+            if (matchCode >= 15) {
+                op = writeLength(op, matchCode - 15);
+            }
+        }
+        return op;
+    }
+    
+    static uint8_t* writeLength(uint8_t* op, size_t remaining) {
+        while (remaining >= 255) {
+            *op++ = 255;
+            remaining -= 255;
+        }
+        *op++ = static_cast<uint8_t>(remaining);
+        return op;
+    }
+    
+    static bool readLength(const uint8_t*& ip, const uint8_t* inEnd, size_t& length) {
+        uint8_t byte;
+        do {
+            if (ip == inEnd) {
+                return false;
+            }
+            byte = *ip++;
+            length += byte;
+        } while (byte == 255);
+        return true;
+    }
+};
+
+#endif // COMPRESSION_H
@@ -0,0 +1,130 @@
+#ifndef FRAMEDECODER_H
+#define FRAMEDECODER_H
+
+#include "Protocol.h"
+#include "RingBuffer.h"
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+// Incremental decoder for the MessageHeader + payload framing, and for
+// compact (v2) frames if enabled. Callers read whatever the socket has into
+// buffer(), then call next() until it stops returning FRAME. A partial
+// frame stays buffered for the next read, no matter how TCP split it.
+class FrameDecoder {
+public:
+    enum class Result {
+        FRAME,       // A complete frame was written to the output
+        INCOMPLETE,  // Need more bytes from the socket
+        INVALID      // Bad magic or oversized payload, drop the connection
+    };
+    
+    // Only clients accept compact frames; the server treats them as invalid
+    explicit FrameDecoder(size_t initialCapacity = 64 * 1024, bool acceptCompact = false)
+        : buffer_(initialCapacity), acceptCompact_(acceptCompact) {
+    }
+    
+    RingBuffer& buffer() { return buffer_; }
+    
+    // Discard buffered input so the decoder can serve a new connection
+    void reset() {
+        buffer_.clear();
+    }
+    
+    Result next(std::vector<uint8_t>& frame) {
+        size_t frameSize;
+        Result result = completeFrameSize(frameSize);
+        if (result != Result::FRAME) {
+            return result;
+        }
+        
+        frame.resize(frameSize);
+        buffer_.peek(0, frame.data(), frameSize);
+        buffer_.consume(frameSize);
+        return Result::FRAME;
+    }
+    
+    // Like next(), but without copying: data points straight into the ring
+    // (or into a scratch buffer if the frame wraps around its end). Valid
+    // until the next write into buffer().
+    Result nextView(const uint8_t*& data, size_t& size) {
+        size_t frameSize;
+        Result result = completeFrameSize(frameSize);
+        if (result != Result::FRAME) {
+            return result;
+        }
+        
+        data = buffer_.contiguousRead(frameSize);
+        if (!data) {
+            scratch_.resize(frameSize);
+            buffer_.peek(0, scratch_.data(), frameSize);
+            data = scratch_.data();
+        }
+        size = frameSize;
+        buffer_.consume(frameSize);
+        return Result::FRAME;
+    }
+    
+private:
+    // Validates the buffered header and reports whether the whole frame is in
+    Result completeFrameSize(size_t& frameSize) {
+        if (buffer_.size() == 0) {
+            return Result::INCOMPLETE;
+        }
+        uint8_t first;
+        buffer_.peek(0, &first, 1);
+        if (first == COMPACT_FRAME_MARKER) {
+            return acceptCompact_ ? completeCompactFrameSize(frameSize) : Result::INVALID;
+        }
+        
+        if (buffer_.size() < MESSAGE_HEADER_SIZE) {
+            return Result::INCOMPLETE;
+        }
+        
+        uint8_t raw[MESSAGE_HEADER_SIZE];
+        buffer_.peek(0, raw, MESSAGE_HEADER_SIZE);
+        MessageHeader header;
+        decodeHeader(raw, header);
+        
+        if (header.magic != PROTOCOL_MAGIC || header.payloadSize > MAX_PAYLOAD_SIZE) {
+            return Result::INVALID;
+        }
+        
+        frameSize = MESSAGE_HEADER_SIZE + header.payloadSize;
+        return frameBuffered(frameSize);
+    }
+    
+    Result completeCompactFrameSize(size_t& frameSize) {
+        uint8_t raw[COMPACT_HEADER_MAX_SIZE];
+        size_t available = std::min(buffer_.size(), COMPACT_HEADER_MAX_SIZE);
+        buffer_.peek(0, raw, available);
+        
+        uint64_t payloadSize;
+        size_t used = available > 2 ? readVarint(raw + 2, available - 2, payloadSize) : 0;
+        if (used == 0) {
+            // A length longer than COMPACT_LENGTH_MAX_SIZE bytes is invalid
+            return available < COMPACT_HEADER_MAX_SIZE ? Result::INCOMPLETE : Result::INVALID;
+        }
+        if (payloadSize > MAX_PAYLOAD_SIZE) {
+            return Result::INVALID;
+        }
+        
+        frameSize = 2 + used + static_cast<size_t>(payloadSize);
+        return frameBuffered(frameSize);
+    }
+    
+    Result frameBuffered(size_t frameSize) {
+        if (buffer_.size() < frameSize) {
+            // Make room for the rest of a frame larger than the ring
+            buffer_.reserve(frameSize - buffer_.size());
+            return Result::INCOMPLETE;
+        }
+        return Result::FRAME;
+    }
+    
+    RingBuffer buffer_;
+    std::vector<uint8_t> scratch_;
+    bool acceptCompact_;
+};
+
+#endif // FRAMEDECODER_H
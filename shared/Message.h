@@ -2,6 +2,7 @@
 #define MESSAGE_H
 
 #include <string>
+#include <string_view>
 #include <chrono>
 #include <cstdint>
 
@@ -11,25 +12,63 @@ enum class MessageType : uint8_t {
     LEAVE = 2,
     ERROR_MSG = 3,
     SYSTEM = 4,
-    USER_LIST = 5
+    USER_LIST = 5,
+    ROOM_JOIN = 6,  // content: room name; the server's reply carries the room id
+    ROOM_PART = 7,  // roomId of the room to leave
+    PRESENCE = 8,   // content: "+name" or "-name"; messageId: presence version
+    SENDER = 9      // Compact frames only: names the sender id that compact TEXT frames use
 };
 
+// Room 0 is the lobby every session belongs to
+constexpr uint32_t LOBBY_ROOM_ID = 0;
+
 struct Message {
     MessageType type;
     std::string sender;
     std::string content;
     std::string timestamp;
     uint32_t messageId;
+    uint32_t roomId;
     
-    Message() : type(MessageType::TEXT), messageId(0) {}
+    Message() : type(MessageType::TEXT), messageId(0), roomId(LOBBY_ROOM_ID) {}
     
     Message(MessageType t, const std::string& s, const std::string& c)
-        : type(t), sender(s), content(c), messageId(0) {
+        : type(t), sender(s), content(c), messageId(0), roomId(LOBBY_ROOM_ID) {
         auto now = std::chrono::system_clock::now();
         auto time_t = std::chrono::system_clock::to_time_t(now);
         timestamp = std::to_string(time_t);
     }
 };
 
+// Non-owning view of a serialized message. The string fields point into the
+// frame buffer it was parsed from and are only valid while that buffer is.
+struct MessageView {
+    MessageType type;
+    std::string_view sender;
+    std::string_view content;
+    std::string_view timestamp;
+    uint32_t messageId;
+    uint32_t roomId;
+    bool compressed; // content is still compressed; decode with Serializer::toMessage
+    
+    MessageView() : type(MessageType::TEXT), messageId(0), roomId(LOBBY_ROOM_ID), compressed(false) {}
+    
+    explicit MessageView(const Message& msg)
+        : type(msg.type), sender(msg.sender), content(msg.content), timestamp(msg.timestamp),
+          messageId(msg.messageId), roomId(msg.roomId), compressed(false) {}
+    
+    // Copies the fields as they are; see Serializer::toMessage
+    Message toMessage() const {
+        Message msg;
+        msg.type = type;
+        msg.sender.assign(sender.data(), sender.size());
+        msg.content.assign(content.data(), content.size());
+        msg.timestamp.assign(timestamp.data(), timestamp.size());
+        msg.messageId = messageId;
+        msg.roomId = roomId;
+        return msg;
+    }
+};
+
 #endif // MESSAGE_H
 
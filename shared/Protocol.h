@@ -2,13 +2,44 @@
 #define PROTOCOL_H
 
 #include <cstdint>
+#include <cstddef>
 #include <string>
 
 // Protocol constants
 constexpr uint32_t PROTOCOL_MAGIC = 0x43484154; // "CHAT"
-constexpr uint16_t PROTOCOL_VERSION = 1;
+constexpr uint16_t PROTOCOL_VERSION = 1;     // Newest version this build speaks
+constexpr uint16_t MIN_PROTOCOL_VERSION = 1; // Oldest version it still accepts
+constexpr uint32_t MAX_PAYLOAD_SIZE = 16 * 1024 * 1024; // Larger frames are rejected
 
-// Message header structure (sent before each message)
+// Optional features, as a bit mask negotiated by the CLIENT_HELLO /
+// SERVER_HELLO handshake. A peer only uses a feature the other side
+// accepted; without a handshake none are used.
+constexpr uint32_t FEATURE_COMPRESSION = 0x1;      // Compressed TEXT content
+constexpr uint32_t FEATURE_BATCHING = 0x2;         // Reserved: several messages per frame
+constexpr uint32_t FEATURE_COMPACT_ENCODING = 0x4; // Server may send compact (v2) frames
+constexpr uint32_t FEATURE_HEARTBEAT = 0x8;        // Client answers HEARTBEAT frames
+constexpr uint32_t FEATURE_PRESENCE = 0x10;        // Server sends PRESENCE deltas instead of
+                                                   // JOIN/LEAVE notices and USER_LIST rebroadcasts
+
+// High bits of the header's messageType carry per-frame flags; the low
+// byte is the MessageType. A compressed frame's content field holds the
+// u32 original length followed by a Compression block, and is only sent
+// to peers that negotiated FEATURE_COMPRESSION.
+constexpr uint16_t FRAME_FLAG_COMPRESSED = 0x8000;
+constexpr uint16_t FRAME_TYPE_MASK = 0x00FF;
+
+// Compact (v2) frames replace the fixed header with a marker byte, the
+// MessageType byte and a varint payload length. The marker can never start
+// a v1 frame, whose first byte is the magic's low byte. They are only sent
+// by the server, to clients that negotiated FEATURE_COMPACT_ENCODING; see
+// CompactSerializer for the payloads.
+constexpr uint8_t COMPACT_FRAME_MARKER = 0xC2;
+constexpr size_t COMPACT_LENGTH_MAX_SIZE = 4; // Varint bytes for MAX_PAYLOAD_SIZE
+constexpr size_t COMPACT_HEADER_MAX_SIZE = 2 + COMPACT_LENGTH_MAX_SIZE;
+
+// Message header structure (sent before each message). On the wire it is
+// MESSAGE_HEADER_SIZE packed little-endian bytes in field order; use
+// encodeHeader/decodeHeader rather than copying the struct.
 struct MessageHeader {
     uint32_t magic;
     uint16_t version;
@@ -20,6 +51,95 @@ struct MessageHeader {
                      messageType(0), payloadSize(0), messageId(0) {}
 };
 
+constexpr size_t MESSAGE_HEADER_SIZE = 16;
+
+// Little-endian field access, independent of host byte order and alignment
+inline void writeLE16(uint8_t* out, uint16_t value) {
+    out[0] = static_cast<uint8_t>(value);
+    out[1] = static_cast<uint8_t>(value >> 8);
+}
+
+inline void writeLE32(uint8_t* out, uint32_t value) {
+    out[0] = static_cast<uint8_t>(value);
+    out[1] = static_cast<uint8_t>(value >> 8);
+    out[2] = static_cast<uint8_t>(value >> 16);
+    out[3] = static_cast<uint8_t>(value >> 24);
+}
+
+inline void writeLE64(uint8_t* out, uint64_t value) {
+    writeLE32(out, static_cast<uint32_t>(value));
+    writeLE32(out + 4, static_cast<uint32_t>(value >> 32));
+}
+
+inline uint16_t readLE16(const uint8_t* in) {
+    return static_cast<uint16_t>(in[0] | (in[1] << 8));
+}
+
+inline uint32_t readLE32(const uint8_t* in) {
+    return static_cast<uint32_t>(in[0]) |
+           (static_cast<uint32_t>(in[1]) << 8) |
+           (static_cast<uint32_t>(in[2]) << 16) |
+           (static_cast<uint32_t>(in[3]) << 24);
+}
+
+inline uint64_t readLE64(const uint8_t* in) {
+    return static_cast<uint64_t>(readLE32(in)) |
+           (static_cast<uint64_t>(readLE32(in + 4)) << 32);
+}
+
+// Unsigned LEB128 varints: 7 bits per byte, low bits first, high bit set
+// on every byte but the last
+constexpr size_t MAX_VARINT_SIZE = 10;
+
+inline size_t varintSize(uint64_t value) {
+    size_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+// Returns the number of bytes written
+inline size_t writeVarint(uint8_t* out, uint64_t value) {
+    size_t size = 0;
+    while (value >= 0x80) {
+        out[size++] = static_cast<uint8_t>(value | 0x80);
+        value >>= 7;
+    }
+    out[size++] = static_cast<uint8_t>(value);
+    return size;
+}
+
+// Returns the number of bytes read, or 0 if the varint is cut off by size
+// or longer than MAX_VARINT_SIZE
+inline size_t readVarint(const uint8_t* in, size_t size, uint64_t& value) {
+    value = 0;
+    for (size_t i = 0; i < size && i < MAX_VARINT_SIZE; ++i) {
+        value |= static_cast<uint64_t>(in[i] & 0x7F) << (7 * i);
+        if ((in[i] & 0x80) == 0) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+inline void encodeHeader(const MessageHeader& header, uint8_t* out) {
+    writeLE32(out, header.magic);
+    writeLE16(out + 4, header.version);
+    writeLE16(out + 6, header.messageType);
+    writeLE32(out + 8, header.payloadSize);
+    writeLE32(out + 12, header.messageId);
+}
+
+inline void decodeHeader(const uint8_t* in, MessageHeader& header) {
+    header.magic = readLE32(in);
+    header.version = readLE16(in + 4);
+    header.messageType = readLE16(in + 6);
+    header.payloadSize = readLE32(in + 8);
+    header.messageId = readLE32(in + 12);
+}
+
 // Protocol message types
 enum class ProtocolMessageType : uint16_t {
     CLIENT_HELLO = 100,
@@ -30,7 +150,26 @@ enum class ProtocolMessageType : uint16_t {
     USER_LIST_REQUEST = 105,
     USER_LIST_RESPONSE = 106,
     ERROR_MESSAGE = 107,
-    HEARTBEAT = 108
+    HEARTBEAT = 108,     // Header only; the server sends it to a silent client that
+                         // negotiated FEATURE_HEARTBEAT, which sends it back
+    STATS_REQUEST = 109, // Header only; asks the server for its metrics
+    STATS_RESPONSE = 110 // u32-length-prefixed text, one metric per line; only
+                         // loopback clients get it, others an UNAUTHORIZED error
+};
+
+// Payload of CLIENT_HELLO and SERVER_HELLO frames (little-endian): u16
+// minVersion, u16 maxVersion, u32 features, then a u32-length-prefixed
+// agent string. The client sends the versions it speaks and the features
+// it wants before JOIN; the server answers with the chosen version as both
+// min and max, and the subset of features it accepted. Clients that
+// start with JOIN get version 1 with no features.
+struct HelloMessage {
+    uint16_t minVersion;
+    uint16_t maxVersion;
+    uint32_t features;
+    std::string agent; // Software name and version, informational
+    
+    HelloMessage() : minVersion(MIN_PROTOCOL_VERSION), maxVersion(PROTOCOL_VERSION), features(0) {}
 };
 
 // Protocol error codes
@@ -40,7 +179,11 @@ enum class ProtocolError : uint16_t {
     USERNAME_TAKEN = 2,
     SERVER_FULL = 3,
     UNAUTHORIZED = 4,
-    INTERNAL_ERROR = 5
+    INTERNAL_ERROR = 5,
+    SLOW_CONSUMER = 6,
+    INVALID_ROOM = 7,
+    NOT_IN_ROOM = 8,
+    UNSUPPORTED_VERSION = 9
 };
 
 #endif // PROTOCOL_H
@@ -0,0 +1,106 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+
+// Byte ring buffer with power-of-two capacity. Head and tail are free-running
+// counters, so the buffer can be filled completely without an extra slot.
+// The writable area is exposed as up to two contiguous regions so a socket
+// read can fill all free space in a single scatter call.
+class RingBuffer {
+public:
+    explicit RingBuffer(size_t capacity = 64 * 1024)
+        : buffer_(roundUpPowerOfTwo(capacity)), head_(0), tail_(0) {
+    }
+    
+    size_t size() const { return tail_ - head_; }
+    size_t capacity() const { return buffer_.size(); }
+    size_t freeSpace() const { return capacity() - size(); }
+    bool empty() const { return head_ == tail_; }
+    
+    // Free space as (first, second) regions; second may be empty
+    void writableRegions(uint8_t*& first, size_t& firstLen,
+                         uint8_t*& second, size_t& secondLen) {
+        size_t start = tail_ & mask();
+        size_t free = freeSpace();
+        first = buffer_.data() + start;
+        firstLen = std::min(free, capacity() - start);
+        second = buffer_.data();
+        secondLen = free - firstLen;
+    }
+    
+    void commitWrite(size_t len) {
+        tail_ += len;
+    }
+    
+    void write(const uint8_t* data, size_t len) {
+        reserve(len);
+        size_t start = tail_ & mask();
+        size_t firstLen = std::min(len, capacity() - start);
+        std::memcpy(buffer_.data() + start, data, firstLen);
+        std::memcpy(buffer_.data(), data + firstLen, len - firstLen);
+        tail_ += len;
+    }
+    
+    // Copy len bytes starting offset bytes past the read position
+    void peek(size_t offset, uint8_t* out, size_t len) const {
+        size_t start = (head_ + offset) & mask();
+        size_t firstLen = std::min(len, capacity() - start);
+        std::memcpy(out, buffer_.data() + start, firstLen);
+        std::memcpy(out + firstLen, buffer_.data(), len - firstLen);
+    }
+    
+    // Pointer to the next len readable bytes if they do not wrap, else null
+    const uint8_t* contiguousRead(size_t len) const {
+        size_t start = head_ & mask();
+        return start + len <= capacity() ? buffer_.data() + start : nullptr;
+    }
+    
+    void consume(size_t len) {
+        head_ += len;
+        if (head_ == tail_) {
+            // Rewind so the next read gets the whole buffer as one region
+            head_ = tail_ = 0;
+        }
+    }
+    
+    // Drop all buffered bytes, keeping the allocation
+    void clear() {
+        head_ = tail_ = 0;
+    }
+    
+    // Grow (never shrink) until at least minFree bytes can be written
+    void reserve(size_t minFree) {
+        if (freeSpace() >= minFree) {
+            return;
+        }
+        
+        size_t used = size();
+        std::vector<uint8_t> grown(roundUpPowerOfTwo(used + minFree));
+        peek(0, grown.data(), used);
+        buffer_.swap(grown);
+        head_ = 0;
+        tail_ = used;
+    }
+    
+private:
+    size_t mask() const { return buffer_.size() - 1; }
+    
+    static size_t roundUpPowerOfTwo(size_t value) {
+        size_t result = 1;
+        while (result < value) {
+            result <<= 1;
+        }
+        return result;
+    }
+    
+    std::vector<uint8_t> buffer_;
+    size_t head_;
+    size_t tail_;
+};
+
+#endif // RINGBUFFER_H
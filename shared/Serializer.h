@@ -3,112 +3,262 @@
 
 #include "Message.h"
 #include "Protocol.h"
+#include "Compression.h"
 #include <vector>
 #include <cstring>
-#include <sstream>
 
 class Serializer {
 public:
-    // Serialize a message to binary format
-    static std::vector<uint8_t> serialize(const Message& msg) {
-        std::vector<uint8_t> buffer;
+    // Exact encoded size of a message, header included
+    static size_t serializedSize(const Message& msg) {
+        return MESSAGE_HEADER_SIZE + payloadSize(MessageView(msg));
+    }
+    
+    static size_t serializedSize(const MessageView& view) {
+        return MESSAGE_HEADER_SIZE + payloadSize(view);
+    }
+    
+    // Encode a message into caller-provided memory in one pass, without
+    // allocating. Returns the number of bytes written, or 0 if capacity is
+    // smaller than serializedSize(msg).
+    static size_t serializeInto(const Message& msg, uint8_t* out, size_t capacity) {
+        size_t total = serializedSize(msg);
+        if (capacity < total) {
+            return 0;
+        }
         
-        // Serialize header
         MessageHeader header;
         header.messageType = static_cast<uint16_t>(msg.type);
+        header.payloadSize = static_cast<uint32_t>(total - MESSAGE_HEADER_SIZE);
         header.messageId = msg.messageId;
+        encodeHeader(header, out);
         
-        // Calculate payload size
-        uint32_t payloadSize = sizeof(uint32_t) + // sender length
-                              msg.sender.size() +
-                              sizeof(uint32_t) + // content length
-                              msg.content.size() +
-                              sizeof(uint32_t) + // timestamp length
-                              msg.timestamp.size();
-        
-        header.payloadSize = payloadSize;
-        
-        // Write header
-        buffer.resize(sizeof(MessageHeader) + payloadSize);
-        std::memcpy(buffer.data(), &header, sizeof(MessageHeader));
-        
-        size_t offset = sizeof(MessageHeader);
+        uint8_t* cursor = out + MESSAGE_HEADER_SIZE;
+        cursor = writeString(cursor, msg.sender);
+        cursor = writeString(cursor, msg.content);
+        cursor = writeString(cursor, msg.timestamp);
+        if (msg.roomId != LOBBY_ROOM_ID) {
+            writeLE32(cursor, msg.roomId);
+        }
         
-        // Write sender
-        uint32_t len = static_cast<uint32_t>(msg.sender.size());
-        std::memcpy(buffer.data() + offset, &len, sizeof(uint32_t));
-        offset += sizeof(uint32_t);
-        std::memcpy(buffer.data() + offset, msg.sender.data(), len);
-        offset += len;
+        return total;
+    }
+    
+    // Encode a message with its content compressed, for a peer that
+    // negotiated FEATURE_COMPRESSION; capacity must be at least
+    // serializedSize(view). Returns the number of bytes written, or 0 if the
+    // content is shorter than Compression::MIN_INPUT_SIZE or would shrink
+    // by less than 1/MIN_SAVING_RATIO, in which case send it uncompressed.
+    static size_t serializeCompressedInto(const MessageView& view, uint8_t* out, size_t capacity) {
+        size_t plainTotal = serializedSize(view);
+        size_t contentSize = view.content.size();
+        if (capacity < plainTotal || view.compressed || contentSize < Compression::MIN_INPUT_SIZE) {
+            return 0;
+        }
         
-        // Write content
-        len = static_cast<uint32_t>(msg.content.size());
-        std::memcpy(buffer.data() + offset, &len, sizeof(uint32_t));
-        offset += sizeof(uint32_t);
-        std::memcpy(buffer.data() + offset, msg.content.data(), len);
-        offset += len;
+        uint8_t* cursor = writeString(out + MESSAGE_HEADER_SIZE, view.sender);
+        uint8_t* field = cursor;
+        uint8_t* block = field + 2 * sizeof(uint32_t);
+        // The original length costs 4 bytes, which the block has to win back
+        size_t budget = contentSize - contentSize / MIN_SAVING_RATIO - sizeof(uint32_t);
+        size_t blockSize = Compression::compress(
+            reinterpret_cast<const uint8_t*>(view.content.data()), contentSize, block, budget);
+        if (blockSize == 0) {
+            return 0;
+        }
+        writeLE32(field, static_cast<uint32_t>(sizeof(uint32_t) + blockSize));
+        writeLE32(field + sizeof(uint32_t), static_cast<uint32_t>(contentSize));
         
-        // Write timestamp
-        len = static_cast<uint32_t>(msg.timestamp.size());
-        std::memcpy(buffer.data() + offset, &len, sizeof(uint32_t));
-        offset += sizeof(uint32_t);
-        std::memcpy(buffer.data() + offset, msg.timestamp.data(), len);
+        cursor = writeString(block + blockSize, view.timestamp);
+        if (view.roomId != LOBBY_ROOM_ID) {
+            writeLE32(cursor, view.roomId);
+            cursor += sizeof(uint32_t);
+        }
         
+        size_t total = static_cast<size_t>(cursor - out);
+        MessageHeader header;
+        header.messageType = static_cast<uint16_t>(view.type) | FRAME_FLAG_COMPRESSED;
+        header.payloadSize = static_cast<uint32_t>(total - MESSAGE_HEADER_SIZE);
+        header.messageId = view.messageId;
+        encodeHeader(header, out);
+        return total;
+    }
+    
+    static size_t serializeCompressedInto(const Message& msg, uint8_t* out, size_t capacity) {
+        return serializeCompressedInto(MessageView(msg), out, capacity);
+    }
+    
+    // Serialize a message to binary format
+    static std::vector<uint8_t> serialize(const Message& msg) {
+        std::vector<uint8_t> buffer(serializedSize(msg));
+        serializeInto(msg, buffer.data(), buffer.size());
         return buffer;
     }
     
     // Deserialize a message from binary format
     static bool deserialize(const std::vector<uint8_t>& buffer, Message& msg) {
-        if (buffer.size() < sizeof(MessageHeader)) {
+        MessageView view;
+        if (!deserializeView(buffer.data(), buffer.size(), view)) {
+            return false;
+        }
+        return toMessage(view, msg);
+    }
+    
+    // Copy a view into a message, decompressing its content if needed.
+    // Returns false if the compressed content is invalid.
+    static bool toMessage(const MessageView& view, Message& msg) {
+        if (!view.compressed) {
+            msg = view.toMessage();
+            return true;
+        }
+        
+        if (view.content.size() < sizeof(uint32_t)) {
+            return false;
+        }
+        const uint8_t* field = reinterpret_cast<const uint8_t*>(view.content.data());
+        uint32_t originalSize = readLE32(field);
+        if (originalSize > MAX_PAYLOAD_SIZE) {
+            return false;
+        }
+        
+        msg.content.resize(originalSize);
+        if (!Compression::decompress(field + sizeof(uint32_t), view.content.size() - sizeof(uint32_t),
+                                     reinterpret_cast<uint8_t*>(&msg.content[0]), originalSize)) {
+            return false;
+        }
+        msg.type = view.type;
+        msg.sender.assign(view.sender.data(), view.sender.size());
+        msg.timestamp.assign(view.timestamp.data(), view.timestamp.size());
+        msg.messageId = view.messageId;
+        msg.roomId = view.roomId;
+        return true;
+    }
+    
+    // Parse a frame without copying; the view's fields point into data
+    static bool deserializeView(const uint8_t* data, size_t size, MessageView& view) {
+        if (size < MESSAGE_HEADER_SIZE) {
             return false;
         }
         
         MessageHeader header;
-        std::memcpy(&header, buffer.data(), sizeof(MessageHeader));
+        decodeHeader(data, header);
         
-        // Validate magic number
         if (header.magic != PROTOCOL_MAGIC) {
             return false;
         }
         
-        msg.type = static_cast<MessageType>(header.messageType);
-        msg.messageId = header.messageId;
+        view.type = static_cast<MessageType>(header.messageType & FRAME_TYPE_MASK);
+        view.compressed = (header.messageType & FRAME_FLAG_COMPRESSED) != 0;
+        view.messageId = header.messageId;
         
-        size_t offset = sizeof(MessageHeader);
+        size_t offset = MESSAGE_HEADER_SIZE;
+        if (!readStringView(data, size, offset, view.sender)) return false;
+        if (!readStringView(data, size, offset, view.content)) return false;
+        if (!readStringView(data, size, offset, view.timestamp)) return false;
         
-        // Read sender
-        if (offset + sizeof(uint32_t) > buffer.size()) return false;
-        uint32_t len;
-        std::memcpy(&len, buffer.data() + offset, sizeof(uint32_t));
-        offset += sizeof(uint32_t);
-        if (offset + len > buffer.size()) return false;
-        msg.sender.assign(reinterpret_cast<const char*>(buffer.data() + offset), len);
-        offset += len;
+        // Optional trailing room id; lobby frames omit it
+        view.roomId = LOBBY_ROOM_ID;
+        if (size - offset >= sizeof(uint32_t)) {
+            view.roomId = readLE32(data + offset);
+        }
         
-        // Read content
-        if (offset + sizeof(uint32_t) > buffer.size()) return false;
-        std::memcpy(&len, buffer.data() + offset, sizeof(uint32_t));
-        offset += sizeof(uint32_t);
-        if (offset + len > buffer.size()) return false;
-        msg.content.assign(reinterpret_cast<const char*>(buffer.data() + offset), len);
-        offset += len;
+        return true;
+    }
+    
+    // Encode a CLIENT_HELLO or SERVER_HELLO frame
+    static std::vector<uint8_t> serializeHello(ProtocolMessageType type, const HelloMessage& hello) {
+        size_t payload = HELLO_FIXED_SIZE + sizeof(uint32_t) + hello.agent.size();
+        std::vector<uint8_t> buffer(MESSAGE_HEADER_SIZE + payload);
         
-        // Read timestamp
-        if (offset + sizeof(uint32_t) > buffer.size()) return false;
-        std::memcpy(&len, buffer.data() + offset, sizeof(uint32_t));
-        offset += sizeof(uint32_t);
-        if (offset + len > buffer.size()) return false;
-        msg.timestamp.assign(reinterpret_cast<const char*>(buffer.data() + offset), len);
+        MessageHeader header;
+        header.messageType = static_cast<uint16_t>(type);
+        header.payloadSize = static_cast<uint32_t>(payload);
+        encodeHeader(header, buffer.data());
+        
+        uint8_t* cursor = buffer.data() + MESSAGE_HEADER_SIZE;
+        writeLE16(cursor, hello.minVersion);
+        writeLE16(cursor + 2, hello.maxVersion);
+        writeLE32(cursor + 4, hello.features);
+        writeString(cursor + HELLO_FIXED_SIZE, hello.agent);
+        return buffer;
+    }
+    
+    // Parse the payload of a hello frame; the caller checks its type
+    static bool deserializeHello(const uint8_t* data, size_t size, HelloMessage& hello) {
+        if (size < MESSAGE_HEADER_SIZE + HELLO_FIXED_SIZE) {
+            return false;
+        }
+        
+        const uint8_t* payload = data + MESSAGE_HEADER_SIZE;
+        hello.minVersion = readLE16(payload);
+        hello.maxVersion = readLE16(payload + 2);
+        hello.features = readLE32(payload + 4);
         
+        size_t offset = MESSAGE_HEADER_SIZE + HELLO_FIXED_SIZE;
+        std::string_view agent;
+        if (!readStringView(data, size, offset, agent)) {
+            return false;
+        }
+        hello.agent.assign(agent.data(), agent.size());
+        return hello.minVersion <= hello.maxVersion;
+    }
+    
+    // Encode a HEARTBEAT frame, which has no payload
+    static std::vector<uint8_t> serializeHeartbeat() {
+        std::vector<uint8_t> buffer(MESSAGE_HEADER_SIZE);
+        MessageHeader header;
+        header.messageType = static_cast<uint16_t>(ProtocolMessageType::HEARTBEAT);
+        encodeHeader(header, buffer.data());
+        return buffer;
+    }
+    
+    // Encode a STATS_REQUEST frame, which has no payload
+    static std::vector<uint8_t> serializeStatsRequest() {
+        std::vector<uint8_t> buffer(MESSAGE_HEADER_SIZE);
+        MessageHeader header;
+        header.messageType = static_cast<uint16_t>(ProtocolMessageType::STATS_REQUEST);
+        encodeHeader(header, buffer.data());
+        return buffer;
+    }
+    
+    // Encode a STATS_RESPONSE frame carrying the metrics text
+    static std::vector<uint8_t> serializeStats(const std::string& text) {
+        size_t payload = sizeof(uint32_t) + text.size();
+        std::vector<uint8_t> buffer(MESSAGE_HEADER_SIZE + payload);
+        
+        MessageHeader header;
+        header.messageType = static_cast<uint16_t>(ProtocolMessageType::STATS_RESPONSE);
+        header.payloadSize = static_cast<uint32_t>(payload);
+        encodeHeader(header, buffer.data());
+        writeString(buffer.data() + MESSAGE_HEADER_SIZE, text);
+        return buffer;
+    }
+    
+    // Parse the payload of a STATS_RESPONSE frame; the caller checks its type
+    static bool deserializeStats(const uint8_t* data, size_t size, std::string& text) {
+        size_t offset = MESSAGE_HEADER_SIZE;
+        std::string_view view;
+        if (size < MESSAGE_HEADER_SIZE || !readStringView(data, size, offset, view)) {
+            return false;
+        }
+        text.assign(view.data(), view.size());
         return true;
     }
     
+    // The header's messageType of a frame, flag bits included; data must
+    // hold at least MESSAGE_HEADER_SIZE bytes
+    static uint16_t frameType(const uint8_t* data) {
+        MessageHeader header;
+        decodeHeader(data, header);
+        return header.messageType;
+    }
+    
     // Serialize a simple string message (for quick messages)
     static std::vector<uint8_t> serializeString(const std::string& str) {
         std::vector<uint8_t> buffer;
         uint32_t len = static_cast<uint32_t>(str.size());
         buffer.resize(sizeof(uint32_t) + len);
-        std::memcpy(buffer.data(), &len, sizeof(uint32_t));
+        writeLE32(buffer.data(), len);
         std::memcpy(buffer.data() + sizeof(uint32_t), str.data(), len);
         return buffer;
     }
@@ -118,14 +268,44 @@ public:
         if (buffer.size() < sizeof(uint32_t)) {
             return false;
         }
-        uint32_t len;
-        std::memcpy(&len, buffer.data(), sizeof(uint32_t));
+        uint32_t len = readLE32(buffer.data());
         if (buffer.size() < sizeof(uint32_t) + len) {
             return false;
         }
         str.assign(reinterpret_cast<const char*>(buffer.data() + sizeof(uint32_t)), len);
         return true;
     }
+    
+private:
+    // Compressed content must save at least 1/MIN_SAVING_RATIO of its size
+    static constexpr size_t MIN_SAVING_RATIO = 8;
+    // Versions and features ahead of a hello's agent string
+    static constexpr size_t HELLO_FIXED_SIZE = 8;
+    
+    static size_t payloadSize(const MessageView& view) {
+        return sizeof(uint32_t) + view.sender.size() +
+               sizeof(uint32_t) + view.content.size() +
+               sizeof(uint32_t) + view.timestamp.size() +
+               (view.roomId != LOBBY_ROOM_ID ? sizeof(uint32_t) : 0);
+    }
+    
+    // Length-prefixed string; returns the position just past it
+    static uint8_t* writeString(uint8_t* out, std::string_view str) {
+        writeLE32(out, static_cast<uint32_t>(str.size()));
+        std::memcpy(out + sizeof(uint32_t), str.data(), str.size());
+        return out + sizeof(uint32_t) + str.size();
+    }
+    
+    static bool readStringView(const uint8_t* data, size_t size, size_t& offset,
+                               std::string_view& out) {
+        if (offset + sizeof(uint32_t) > size) return false;
+        uint32_t len = readLE32(data + offset);
+        offset += sizeof(uint32_t);
+        if (len > size - offset) return false;
+        out = std::string_view(reinterpret_cast<const char*>(data + offset), len);
+        offset += len;
+        return true;
+    }
 };
 
 #endif // SERIALIZER_H